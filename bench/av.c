@@ -0,0 +1,563 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs a video call between two plugin instances over localhost and
+ * measures the mouth to ear latency: the caller sends silence and black
+ * frames with a loud or white one now and then, the callee notes when
+ * those arrive. Optionally the main loop is kept busy to show that the
+ * AV thread keeps calls smooth while the UI stalls, or the loopback
+ * device is impaired with netem to exercise the bit rate adaptation.
+ * Results are printed as JSON.
+ */
+
+/* the plugin internals are static */
+#include "toxprpl.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "harness.h"
+
+#define AV_BENCH_PEERS 2
+/* a marker frame every that many frames */
+#define AV_BENCH_AUDIO_MARK 25
+#define AV_BENCH_VIDEO_MARK 25
+#define AV_BENCH_VIDEO_FPS 25
+/* received audio frames with a mean amplitude above count as marked */
+#define AV_BENCH_AUDIO_LOUD 4000
+/* same for the mean luma of video frames */
+#define AV_BENCH_VIDEO_BRIGHT 128
+
+typedef struct
+{
+    PurpleAccount *account;
+    gchar *buddy;
+} av_bench_peer;
+
+/* shared between the sender thread and the callee's AV thread */
+typedef struct
+{
+    GMutex lock;
+    gint64 audio_mark_sent;
+    gint64 video_mark_sent;
+    gboolean audio_loud;
+    gboolean video_bright;
+    GArray *audio_latency;
+    GArray *video_latency;
+    volatile gint running;
+} av_bench_state;
+
+static av_bench_peer av_bench_peers[AV_BENCH_PEERS];
+static av_bench_state av_bench;
+
+static gint av_bench_duration = 20;
+static gint av_bench_load = 0;
+static gint av_bench_timeout = 120;
+static gchar *av_bench_netem = NULL;
+static gchar *av_bench_output = NULL;
+
+static GOptionEntry av_bench_options[] =
+{
+    { "duration", 'd', 0, G_OPTION_ARG_INT, &av_bench_duration,
+      "length of the call in seconds", "SECONDS" },
+    { "main-loop-load", 'l', 0, G_OPTION_ARG_INT, &av_bench_load,
+      "block the main loop for MS every 100 ms during the call", "MS" },
+    { "netem", 'n', 0, G_OPTION_ARG_STRING, &av_bench_netem,
+      "impair the loopback device during the call with this netem spec, "
+      "e.g. \"delay 40ms 10ms loss 3%\" (needs CAP_NET_ADMIN)", "SPEC" },
+    { "timeout", 't', 0, G_OPTION_ARG_INT, &av_bench_timeout,
+      "seconds to wait for the instances to connect", "SECONDS" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &av_bench_output,
+      "write the JSON results to FILE instead of stdout", "FILE" },
+    { NULL }
+};
+
+static toxprpl_plugin_data *av_bench_plugin_data(av_bench_peer *peer)
+{
+    PurpleConnection *gc = purple_account_get_connection(peer->account);
+    return (gc != NULL) ? purple_connection_get_protocol_data(gc) : NULL;
+}
+
+static gboolean av_bench_logged_in(gpointer data)
+{
+    int i;
+    for (i = 0; i < AV_BENCH_PEERS; i++)
+    {
+        if (av_bench_plugin_data(&av_bench_peers[i]) == NULL)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean av_bench_friends_online(gpointer data)
+{
+    int i;
+    for (i = 0; i < AV_BENCH_PEERS; i++)
+    {
+        toxprpl_plugin_data *plugin = av_bench_plugin_data(
+                &av_bench_peers[i]);
+        TOX_ERR_FRIEND_QUERY err_back;
+        if (!purple_account_is_connected(av_bench_peers[i].account) ||
+            (tox_friend_get_connection_status(plugin->tox, 0, &err_back) ==
+             TOX_CONNECTION_NONE))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean av_bench_call_ringing(gpointer data)
+{
+    toxprpl_plugin_data *plugin = data;
+    return g_hash_table_size(plugin->calls) > 0;
+}
+
+static gboolean av_bench_call_active(gpointer data)
+{
+    toxprpl_plugin_data *plugin = data;
+    toxprpl_call *call = g_hash_table_lookup(plugin->calls,
+                                             GUINT_TO_POINTER(0));
+    return (call != NULL) && call->active;
+}
+
+static gboolean av_bench_flag_unset(gpointer data)
+{
+    return !g_atomic_int_get((volatile gint *)data);
+}
+
+static void av_bench_bootstrap(av_bench_peer *peer, av_bench_peer *node)
+{
+    Tox *tox = av_bench_plugin_data(peer)->tox;
+    Tox *node_tox = av_bench_plugin_data(node)->tox;
+    uint8_t dht_id[TOX_PUBLIC_KEY_SIZE];
+    TOX_ERR_GET_PORT err_port;
+    TOX_ERR_BOOTSTRAP err_bootstrap;
+
+    tox_self_get_dht_id(node_tox, dht_id);
+    uint16_t port = tox_self_get_udp_port(node_tox, &err_port);
+    tox_bootstrap(tox, "127.0.0.1", port, dht_id, &err_bootstrap);
+}
+
+/* runs tc on the loopback device, spec NULL removes the impairment */
+static gboolean av_bench_impair(const char *spec)
+{
+    gchar *command = (spec != NULL) ?
+        g_strdup_printf("tc qdisc add dev lo root netem %s", spec) :
+        g_strdup("tc qdisc del dev lo root");
+    gint status = 0;
+    GError *error = NULL;
+    gboolean ok = g_spawn_command_line_sync(command, NULL, NULL, &status,
+                                            &error) &&
+                  g_spawn_check_exit_status(status, &error);
+    if (!ok)
+    {
+        g_printerr("%s: %s\n", command, error->message);
+        g_error_free(error);
+    }
+    g_free(command);
+    return ok;
+}
+
+/* notes the latency of a marker on its first frame */
+static void av_bench_detect(gboolean marked, gboolean *was_marked,
+                            gint64 sent, GArray *latency)
+{
+    if (marked && !*was_marked && (sent > 0))
+    {
+        gint64 usec = g_get_monotonic_time() - sent;
+        g_array_append_val(latency, usec);
+    }
+    *was_marked = marked;
+}
+
+static void av_bench_audio_received(ToxAV *av, uint32_t fnum,
+                                    const int16_t *pcm, size_t sample_count,
+                                    uint8_t channels, uint32_t sampling_rate,
+                                    void *user_data)
+{
+    guint64 sum = 0;
+    size_t i;
+    for (i = 0; i < sample_count * channels; i++)
+    {
+        sum += ABS(pcm[i]);
+    }
+    gboolean loud = (sample_count > 0) &&
+                    (sum / (sample_count * channels) > AV_BENCH_AUDIO_LOUD);
+
+    g_mutex_lock(&av_bench.lock);
+    av_bench_detect(loud, &av_bench.audio_loud, av_bench.audio_mark_sent,
+                    av_bench.audio_latency);
+    g_mutex_unlock(&av_bench.lock);
+}
+
+static void av_bench_video_received(ToxAV *av, uint32_t fnum, uint16_t width,
+                                    uint16_t height, const uint8_t *y,
+                                    const uint8_t *u, const uint8_t *v,
+                                    int32_t ystride, int32_t ustride,
+                                    int32_t vstride, void *user_data)
+{
+    guint64 sum = 0;
+    guint row;
+    guint col;
+    for (row = 0; row < height; row += 8)
+    {
+        for (col = 0; col < width; col += 8)
+        {
+            sum += y[(gssize)row * ABS(ystride) + col];
+        }
+    }
+    guint64 samples = ((height + 7) / 8) * ((width + 7) / 8);
+    gboolean bright = (samples > 0) &&
+                      (sum / samples > AV_BENCH_VIDEO_BRIGHT);
+
+    g_mutex_lock(&av_bench.lock);
+    av_bench_detect(bright, &av_bench.video_bright, av_bench.video_mark_sent,
+                    av_bench.video_latency);
+    g_mutex_unlock(&av_bench.lock);
+}
+
+/* plays the role of the capture pipelines on the caller */
+static gpointer av_bench_sender(gpointer data)
+{
+    ToxAV *toxav = data;
+    int16_t pcm[AV_AUDIO_FRAME_SAMPLES * AV_AUDIO_CHANNELS];
+    gsize luma = AV_VIDEO_WIDTH * AV_VIDEO_HEIGHT;
+    uint8_t *black = g_malloc(luma * 3 / 2);
+    uint8_t *white = g_malloc(luma * 3 / 2);
+    memset(black, 16, luma);
+    memset(white, 235, luma);
+    memset(black + luma, 128, luma / 2);
+    memset(white + luma, 128, luma / 2);
+
+    const gint64 audio_interval = AV_AUDIO_FRAME_SAMPLES * G_USEC_PER_SEC /
+                                  AV_AUDIO_RATE;
+    const gint64 video_interval = G_USEC_PER_SEC / AV_BENCH_VIDEO_FPS;
+    gint64 next_audio = g_get_monotonic_time();
+    gint64 next_video = next_audio;
+    guint audio_frame = 0;
+    guint video_frame = 0;
+
+    while (g_atomic_int_get(&av_bench.running))
+    {
+        gint64 now = g_get_monotonic_time();
+        if (now >= next_audio)
+        {
+            gboolean mark = (++audio_frame % AV_BENCH_AUDIO_MARK) == 0;
+            guint i;
+            for (i = 0; i < G_N_ELEMENTS(pcm); i++)
+            {
+                /* square wave for the marker, otherwise silence */
+                pcm[i] = mark ? (((i / 24) % 2) ? 16000 : -16000) : 0;
+            }
+            if (mark)
+            {
+                g_mutex_lock(&av_bench.lock);
+                av_bench.audio_mark_sent = now;
+                g_mutex_unlock(&av_bench.lock);
+            }
+            TOXAV_ERR_SEND_FRAME err_back;
+            toxav_audio_send_frame(toxav, 0, pcm, AV_AUDIO_FRAME_SAMPLES,
+                                   AV_AUDIO_CHANNELS, AV_AUDIO_RATE,
+                                   &err_back);
+            next_audio += audio_interval;
+        }
+        if (now >= next_video)
+        {
+            gboolean mark = (++video_frame % AV_BENCH_VIDEO_MARK) == 0;
+            uint8_t *frame = mark ? white : black;
+            if (mark)
+            {
+                g_mutex_lock(&av_bench.lock);
+                av_bench.video_mark_sent = now;
+                g_mutex_unlock(&av_bench.lock);
+            }
+            TOXAV_ERR_SEND_FRAME err_back;
+            toxav_video_send_frame(toxav, 0, AV_VIDEO_WIDTH, AV_VIDEO_HEIGHT,
+                                   frame, frame + luma,
+                                   frame + luma + luma / 4, &err_back);
+            next_video += video_interval;
+        }
+
+        now = g_get_monotonic_time();
+        gint64 next = MIN(next_audio, next_video);
+        if (next > now)
+        {
+            g_usleep(next - now);
+        }
+    }
+
+    g_free(black);
+    g_free(white);
+    return NULL;
+}
+
+/* stands in for a UI that is busy rendering or with plugins */
+static gboolean av_bench_block(gpointer data)
+{
+    gint64 until = g_get_monotonic_time() + av_bench_load * 1000;
+    while (g_get_monotonic_time() < until)
+    {
+    }
+    return TRUE;
+}
+
+static gboolean av_bench_stop(gpointer data)
+{
+    g_atomic_int_set(&av_bench.running, 0);
+    return FALSE;
+}
+
+static void av_bench_json_latency(GString *json, const char *name,
+                                  GArray *usec)
+{
+    if (usec->len == 0)
+    {
+        g_string_append_printf(json, "  \"%s\": {\"samples\": 0},\n", name);
+        return;
+    }
+    g_string_append_printf(json,
+            "  \"%s\": {\"samples\": %u, \"p50\": %.3f, \"p90\": %.3f, "
+            "\"p99\": %.3f, \"max\": %.3f},\n", name, usec->len,
+            bench_percentile(usec, 50) / 1000.0,
+            bench_percentile(usec, 90) / 1000.0,
+            bench_percentile(usec, 99) / 1000.0,
+            bench_percentile(usec, 100) / 1000.0);
+}
+
+static gboolean av_bench_call(GString *json)
+{
+    PurpleConnection *caller = purple_account_get_connection(
+            av_bench_peers[0].account);
+    toxprpl_plugin_data *caller_data = av_bench_plugin_data(
+            &av_bench_peers[0]);
+    toxprpl_plugin_data *callee_data = av_bench_plugin_data(
+            &av_bench_peers[1]);
+    if ((caller_data->toxav == NULL) || (callee_data->toxav == NULL))
+    {
+        g_printerr("toxav is not available\n");
+        return FALSE;
+    }
+
+    if (!toxprpl_av_call(caller, av_bench_peers[0].buddy, TRUE) ||
+        !bench_run_until(av_bench_call_ringing, callee_data, 10000))
+    {
+        g_printerr("the call did not ring\n");
+        return FALSE;
+    }
+
+    /* what the answer button does, with the measuring receivers instead
+     * of playback */
+    toxprpl_call *call = g_hash_table_lookup(callee_data->calls,
+                                             GUINT_TO_POINTER(0));
+    toxav_callback_audio_receive_frame(callee_data->toxav,
+                                       av_bench_audio_received, NULL);
+    toxav_callback_video_receive_frame(callee_data->toxav,
+                                       av_bench_video_received, NULL);
+    toxprpl_call_answer(call, 0);
+    if (!bench_run_until(av_bench_call_active, caller_data, 10000))
+    {
+        g_printerr("the call was not answered\n");
+        return FALSE;
+    }
+
+    g_mutex_init(&av_bench.lock);
+    av_bench.audio_latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+    av_bench.video_latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+    g_atomic_int_set(&av_bench.running, 1);
+    GThread *sender = g_thread_new("av-bench-sender", av_bench_sender,
+                                   caller_data->toxav);
+
+    if ((av_bench_netem != NULL) && !av_bench_impair(av_bench_netem))
+    {
+        g_atomic_int_set(&av_bench.running, 0);
+        g_thread_join(sender);
+        return FALSE;
+    }
+    guint load = (av_bench_load > 0) ?
+        g_timeout_add(100, av_bench_block, NULL) : 0;
+    g_timeout_add_seconds(av_bench_duration, av_bench_stop, NULL);
+    bench_run_until(av_bench_flag_unset, (gpointer)&av_bench.running,
+                    (av_bench_duration + 10) * 1000);
+    if (load != 0)
+    {
+        g_source_remove(load);
+    }
+    g_thread_join(sender);
+    if (av_bench_netem != NULL)
+    {
+        av_bench_impair(NULL);
+    }
+
+    toxprpl_call *sent = g_hash_table_lookup(caller_data->calls,
+                                             GUINT_TO_POINTER(0));
+    guint audio_bit_rate = (sent != NULL) ? sent->audio_bit_rate : 0;
+    guint video_bit_rate = (sent != NULL) ? sent->video_bit_rate : 0;
+    toxprpl_av_hangup(caller, av_bench_peers[0].buddy);
+
+    g_string_append_printf(json,
+            "  \"duration_s\": %d,\n"
+            "  \"main_loop_load_ms\": %d,\n"
+            "  \"netem\": \"%s\",\n", av_bench_duration, av_bench_load,
+            (av_bench_netem != NULL) ? av_bench_netem : "");
+    g_mutex_lock(&av_bench.lock);
+    av_bench_json_latency(json, "audio_latency_ms", av_bench.audio_latency);
+    av_bench_json_latency(json, "video_latency_ms", av_bench.video_latency);
+    g_mutex_unlock(&av_bench.lock);
+
+    /* the sender adapts */
+    toxprpl_stats *stats = &caller_data->stats;
+    g_string_append_printf(json,
+            "  \"bit_rate_steps\": {\"up\": %" G_GUINT64_FORMAT
+            ", \"down\": %" G_GUINT64_FORMAT ", \"tcp_cap\": %"
+            G_GUINT64_FORMAT "},\n"
+            "  \"final_bit_rates_kbps\": {\"audio\": %u, \"video\": %u},\n",
+            stats->av_rate_increases, stats->av_rate_decreases,
+            stats->av_rate_caps, audio_bit_rate, video_bit_rate);
+
+    stats = &callee_data->stats;
+    g_string_append_printf(json,
+            "  \"audio_frames_in\": %d,\n"
+            "  \"video_frames_in\": %d,\n",
+            g_atomic_int_get(&stats->audio_frames_in),
+            g_atomic_int_get(&stats->video_frames_in));
+    if (stats->av_lateness_msec.count > 0)
+    {
+        g_string_append_printf(json,
+                "  \"av_loop_lateness_ms\": {\"p50\": %" G_GUINT64_FORMAT
+                ", \"p99\": %" G_GUINT64_FORMAT ", \"max\": %"
+                G_GUINT64_FORMAT "},\n",
+                toxprpl_histogram_percentile(&stats->av_lateness_msec, 50),
+                toxprpl_histogram_percentile(&stats->av_lateness_msec, 99),
+                stats->av_lateness_msec.max);
+    }
+
+    g_array_free(av_bench.audio_latency, TRUE);
+    g_array_free(av_bench.video_latency, TRUE);
+    g_mutex_clear(&av_bench.lock);
+    return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new(
+            "- call latency benchmark of the Tox protocol plugin");
+    g_option_context_add_main_entries(context, av_bench_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    /* frames come from the sender thread, no devices needed */
+    toxprpl_av_audio_source = NULL;
+    toxprpl_av_audio_sink = NULL;
+    toxprpl_av_video_source = NULL;
+    toxprpl_av_video_sink = NULL;
+
+    if ((bench_core_init() == NULL) ||
+        (bench_register_plugin(purple_init_plugin) == NULL))
+    {
+        return EXIT_FAILURE;
+    }
+
+    /* profiles that already have each other as friends */
+    Tox *profiles[AV_BENCH_PEERS];
+    uint8_t public_keys[AV_BENCH_PEERS][TOX_PUBLIC_KEY_SIZE];
+    int i;
+    for (i = 0; i < AV_BENCH_PEERS; i++)
+    {
+        profiles[i] = tox_new(NULL, NULL);
+        tox_self_get_public_key(profiles[i], public_keys[i]);
+    }
+    for (i = 0; i < AV_BENCH_PEERS; i++)
+    {
+        int other = (i + 1) % AV_BENCH_PEERS;
+        TOX_ERR_FRIEND_ADD err_back;
+        tox_friend_add_norequest(profiles[i], public_keys[other], &err_back);
+
+        gchar *name = g_strdup_printf("av-%c", 'a' + i);
+        bench_write_profile(name, profiles[i]);
+        av_bench_peers[i].account = bench_account_new(name, name,
+                                                      profiles[i]);
+        av_bench_peers[i].buddy = toxprpl_tox_bin_id_to_string(
+                public_keys[other]);
+        g_free(name);
+    }
+    for (i = 0; i < AV_BENCH_PEERS; i++)
+    {
+        tox_kill(profiles[i]);
+    }
+
+    bench_accounts_connect();
+    gboolean ok = bench_run_until(av_bench_logged_in, NULL,
+                                  av_bench_timeout * 1000);
+    if (ok)
+    {
+        av_bench_bootstrap(&av_bench_peers[0], &av_bench_peers[1]);
+        av_bench_bootstrap(&av_bench_peers[1], &av_bench_peers[0]);
+        ok = bench_run_until(av_bench_friends_online, NULL,
+                             av_bench_timeout * 1000);
+    }
+    if (!ok)
+    {
+        g_printerr("instances did not connect to each other\n");
+    }
+
+    GString *json = g_string_new("{\n");
+    g_string_append_printf(json,
+            "  \"plugin_version\": \"%s\",\n"
+            "  \"toxcore_version\": \"%u.%u.%u\",\n",
+            VERSION, tox_version_major(), tox_version_minor(),
+            tox_version_patch());
+    ok = ok && av_bench_call(json);
+    /* drop the trailing comma */
+    g_string_truncate(json, json->len - 2);
+    g_string_append(json, "\n}\n");
+
+    if (ok)
+    {
+        if (av_bench_output != NULL)
+        {
+            ok = g_file_set_contents(av_bench_output, json->str, -1, &error);
+            if (!ok)
+            {
+                g_printerr("%s\n", error->message);
+                g_error_free(error);
+            }
+        }
+        else
+        {
+            fputs(json->str, stdout);
+        }
+    }
+    g_string_free(json, TRUE);
+
+    for (i = 0; i < AV_BENCH_PEERS; i++)
+    {
+        g_free(av_bench_peers[i].buddy);
+    }
+    bench_core_quit();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,318 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the compression path of file transfers between tox-prpl instances
+ * over generated corpora: the sender side compression (including the
+ * digest) and the receiver side inflate, both in file transfer sized
+ * chunks.
+ * Results are printed as JSON.
+ */
+
+/* the helpers under test are static */
+#include "toxprpl.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* size of the chunks toxcore requests from on_file_chunk_request and
+ * delivers to on_file_recv_chunk */
+#define COMPRESS_BENCH_CHUNK 1371
+
+static gint compress_size = 8;
+static gchar *compress_levels = NULL;
+static gchar *compress_output = NULL;
+
+static GOptionEntry compress_options[] =
+{
+    { "size", 's', 0, G_OPTION_ARG_INT, &compress_size,
+      "size of each corpus in MiB", "MIB" },
+    { "levels", 'l', 0, G_OPTION_ARG_STRING, &compress_levels,
+      "comma separated zlib levels (default: 1,6,9)", "LEVELS" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &compress_output,
+      "write the JSON results to FILE instead of stdout", "FILE" },
+    { NULL }
+};
+
+static const char *compress_words[] =
+{
+    "connection", "friend", "request", "timeout", "message", "transfer",
+    "offline", "online", "bootstrap", "node", "packet", "queue", "retry",
+    "status", "avatar", "conference", "peer", "chunk", "digest", "error"
+};
+
+static const char *compress_levels_names[] =
+{
+    "DEBUG", "INFO", "WARNING", "ERROR"
+};
+
+/* build logs */
+static void compress_corpus_text(GString *out, GRand *rand, gsize size)
+{
+    guint line = 0;
+    while (out->len < size)
+    {
+        g_string_append_printf(out,
+                "2016-%02d-%02d %02d:%02d:%02d.%03d [%s] %s: %s %s id=%u "
+                "took %u ms\n",
+                g_rand_int_range(rand, 1, 13), g_rand_int_range(rand, 1, 29),
+                g_rand_int_range(rand, 0, 24), g_rand_int_range(rand, 0, 60),
+                g_rand_int_range(rand, 0, 60), g_rand_int_range(rand, 0, 1000),
+                compress_levels_names[g_rand_int_range(rand, 0, 4)],
+                compress_words[g_rand_int_range(rand, 0, 20)],
+                compress_words[g_rand_int_range(rand, 0, 20)],
+                compress_words[g_rand_int_range(rand, 0, 20)],
+                line++, g_rand_int_range(rand, 0, 5000));
+    }
+}
+
+/* text dumps of structured data */
+static void compress_corpus_json(GString *out, GRand *rand, gsize size)
+{
+    g_string_append(out, "[\n");
+    while (out->len < size)
+    {
+        g_string_append_printf(out,
+                "  {\"friend\": %u, \"name\": \"%s-%u\", \"online\": %s, "
+                "\"bytes\": %u, \"tags\": [\"%s\", \"%s\"]},\n",
+                g_rand_int(rand) % 100000,
+                compress_words[g_rand_int_range(rand, 0, 20)],
+                g_rand_int_range(rand, 0, 1000),
+                g_rand_boolean(rand) ? "true" : "false",
+                g_rand_int(rand),
+                compress_words[g_rand_int_range(rand, 0, 20)],
+                compress_words[g_rand_int_range(rand, 0, 20)]);
+    }
+    g_string_append(out, "]\n");
+}
+
+/* fixed size records with small numbers, like object files or databases */
+static void compress_corpus_records(GString *out, GRand *rand, gsize size)
+{
+    while (out->len < size)
+    {
+        guint32 record[8];
+        record[0] = 0x7f454c46;
+        record[1] = out->len / sizeof(record);
+        record[2] = g_rand_int_range(rand, 0, 256);
+        record[3] = g_rand_int_range(rand, 0, 16);
+        record[4] = 0;
+        record[5] = g_rand_int(rand);
+        record[6] = 0;
+        record[7] = g_rand_int_range(rand, 0, 65536);
+        g_string_append_len(out, (const gchar *)record, sizeof(record));
+    }
+}
+
+/* already compressed or encrypted data */
+static void compress_corpus_random(GString *out, GRand *rand, gsize size)
+{
+    while (out->len < size)
+    {
+        guint32 r = g_rand_int(rand);
+        g_string_append_len(out, (const gchar *)&r, sizeof(r));
+    }
+}
+
+typedef struct
+{
+    const char *name;
+    void (*generate)(GString *out, GRand *rand, gsize size);
+} compress_corpus;
+
+static const compress_corpus compress_corpora[] =
+{
+    { "text_log", compress_corpus_text },
+    { "text_json", compress_corpus_json },
+    { "binary_records", compress_corpus_records },
+    { "binary_random", compress_corpus_random }
+};
+
+static gboolean compress_count_sink(gpointer user_data, const uint8_t *data,
+                                    size_t length)
+{
+    *(guint64 *)user_data += length;
+    return TRUE;
+}
+
+static double compress_mib_per_sec(guint64 bytes, gint64 usec)
+{
+    return (bytes / 1048576.0) / (MAX(usec, 1) / (double)G_USEC_PER_SEC);
+}
+
+static void compress_run(GString *json, const compress_corpus *corpus,
+                         const char *src, gint level)
+{
+    toxprpl_deflate_stream *deflate = toxprpl_deflate_new(src, level);
+    if (deflate == NULL)
+    {
+        g_printerr("opening %s failed\n", corpus->name);
+        return;
+    }
+    crypto_generichash_state *digest = toxprpl_digest_new();
+    GByteArray *compressed = g_byte_array_new();
+    uint8_t chunk[COMPRESS_BENCH_CHUNK];
+    gssize n;
+
+    gint64 start = g_get_monotonic_time();
+    while ((n = toxprpl_deflate_read(deflate, digest, chunk,
+                                     sizeof(chunk))) > 0)
+    {
+        g_byte_array_append(compressed, chunk, n);
+    }
+    gint64 compress_usec = g_get_monotonic_time() - start;
+    gboolean ok = (n == 0) && deflate->finished;
+    guint64 in_size = deflate->in_size;
+    guint64 out_size = deflate->out_size;
+    toxprpl_deflate_free(deflate);
+    toxprpl_digest_free(digest);
+    if (!ok)
+    {
+        g_printerr("compressing %s failed\n", corpus->name);
+        g_byte_array_free(compressed, TRUE);
+        return;
+    }
+    guint8 *compressed_data = compressed->data;
+    gsize compressed_size = compressed->len;
+
+    GConverter *inflate = G_CONVERTER(g_zlib_decompressor_new(
+            G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+    guint64 inflated = 0;
+    gsize offset;
+    start = g_get_monotonic_time();
+    for (offset = 0; ok && (offset < compressed_size);
+         offset += COMPRESS_BENCH_CHUNK)
+    {
+        ok = toxprpl_inflate(inflate, compressed_data + offset,
+                             MIN(COMPRESS_BENCH_CHUNK,
+                                 compressed_size - offset),
+                             compress_count_sink, &inflated);
+    }
+    ok = ok && toxprpl_inflate_finish(inflate, compress_count_sink, &inflated);
+    gint64 inflate_usec = g_get_monotonic_time() - start;
+    g_object_unref(inflate);
+    g_byte_array_free(compressed, TRUE);
+
+    if (!ok || (inflated != in_size))
+    {
+        g_printerr("inflating %s failed\n", corpus->name);
+        return;
+    }
+
+    if (json->len > 0)
+    {
+        g_string_append(json, ",\n");
+    }
+    g_string_append_printf(json,
+            "    {\"corpus\": \"%s\", \"level\": %d, "
+            "\"input_bytes\": %" G_GUINT64_FORMAT ", "
+            "\"output_bytes\": %" G_GUINT64_FORMAT ", \"ratio\": %.3f, "
+            "\"compress_mib_s\": %.1f, \"inflate_mib_s\": %.1f, "
+            "\"sent_compressed\": %s}",
+            corpus->name, level, in_size, out_size,
+            (double)out_size / MAX(in_size, 1),
+            compress_mib_per_sec(in_size, compress_usec),
+            compress_mib_per_sec(in_size, inflate_usec),
+            toxprpl_compress_worthwhile(src, level) ? "true" : "false");
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new(
+            "- compression benchmark of the Tox protocol plugin");
+    g_option_context_add_main_entries(context, compress_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    if (sodium_init() < 0)
+    {
+        g_printerr("libsodium initialization failed\n");
+        return EXIT_FAILURE;
+    }
+
+    gchar *dir = g_dir_make_tmp("toxprpl-compress-XXXXXX", &error);
+    if (dir == NULL)
+    {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    gchar **levels = g_strsplit(compress_levels != NULL ? compress_levels :
+                                "1,6,9", ",", -1);
+    GString *json = g_string_new("");
+    GRand *rand = g_rand_new_with_seed(42);
+    gsize size = (gsize)MAX(compress_size, 1) * 1048576;
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(compress_corpora); i++)
+    {
+        GString *data = g_string_sized_new(size + 256);
+        compress_corpora[i].generate(data, rand, size);
+
+        gchar *src = g_build_filename(dir, compress_corpora[i].name, NULL);
+        if (g_file_set_contents(src, data->str, data->len, &error))
+        {
+            guint j;
+            for (j = 0; levels[j] != NULL; j++)
+            {
+                compress_run(json, &compress_corpora[i], src,
+                             (gint)g_ascii_strtoll(levels[j], NULL, 10));
+            }
+            g_remove(src);
+        }
+        else
+        {
+            g_printerr("%s\n", error->message);
+            g_clear_error(&error);
+        }
+        g_free(src);
+        g_string_free(data, TRUE);
+    }
+    g_rand_free(rand);
+    g_strfreev(levels);
+    g_remove(dir);
+    g_free(dir);
+
+    gchar *result = g_strdup_printf("{\n"
+            "  \"plugin_version\": \"%s\",\n"
+            "  \"results\": [\n%s\n  ]\n}\n", VERSION, json->str);
+    g_string_free(json, TRUE);
+
+    gboolean ok = TRUE;
+    if (compress_output != NULL)
+    {
+        ok = g_file_set_contents(compress_output, result, -1, &error);
+        if (!ok)
+        {
+            g_printerr("%s\n", error->message);
+            g_error_free(error);
+        }
+    }
+    else
+    {
+        fputs(result, stdout);
+    }
+    g_free(result);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
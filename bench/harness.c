@@ -0,0 +1,314 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+    #include "autoconfig.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <blist.h>
+#include <core.h>
+#include <debug.h>
+#include <eventloop.h>
+#include <prefs.h>
+#include <savedstatuses.h>
+#include <util.h>
+
+#include "harness.h"
+
+#define BENCH_PRPL_ID "prpl-jin_eld-tox"
+#define BENCH_INPUT_READ  (G_IO_IN | G_IO_HUP | G_IO_ERR)
+#define BENCH_INPUT_WRITE (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+static gchar *bench_user_dir = NULL;
+
+typedef struct
+{
+    PurpleInputFunction function;
+    guint result;
+    gpointer data;
+} bench_input_closure;
+
+static gboolean bench_input_dispatch(GIOChannel *source,
+                                     GIOCondition condition, gpointer data)
+{
+    bench_input_closure *closure = data;
+    PurpleInputCondition purple_cond = 0;
+
+    if (condition & BENCH_INPUT_READ)
+    {
+        purple_cond |= PURPLE_INPUT_READ;
+    }
+    if (condition & BENCH_INPUT_WRITE)
+    {
+        purple_cond |= PURPLE_INPUT_WRITE;
+    }
+
+    closure->function(closure->data, g_io_channel_unix_get_fd(source),
+                      purple_cond);
+    return TRUE;
+}
+
+static guint bench_input_add(gint fd, PurpleInputCondition condition,
+                             PurpleInputFunction function, gpointer data)
+{
+    bench_input_closure *closure = g_new0(bench_input_closure, 1);
+    GIOCondition cond = 0;
+
+    closure->function = function;
+    closure->data = data;
+
+    if (condition & PURPLE_INPUT_READ)
+    {
+        cond |= BENCH_INPUT_READ;
+    }
+    if (condition & PURPLE_INPUT_WRITE)
+    {
+        cond |= BENCH_INPUT_WRITE;
+    }
+
+    GIOChannel *channel = g_io_channel_unix_new(fd);
+    closure->result = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond,
+                                          bench_input_dispatch, closure,
+                                          g_free);
+    g_io_channel_unref(channel);
+    return closure->result;
+}
+
+static PurpleEventLoopUiOps bench_eventloop_ops =
+{
+    g_timeout_add,
+    g_source_remove,
+    bench_input_add,
+    g_source_remove,
+    NULL,                   /* input_get_error */
+    g_timeout_add_seconds,
+    NULL,
+    NULL,
+    NULL
+};
+
+const char *bench_core_init(void)
+{
+    GError *error = NULL;
+    bench_user_dir = g_dir_make_tmp("toxprpl-bench-XXXXXX", &error);
+    if (bench_user_dir == NULL)
+    {
+        g_printerr("could not create temporary directory: %s\n",
+                   error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    purple_util_set_user_dir(bench_user_dir);
+    purple_debug_set_enabled(g_getenv("TOXPRPL_BENCH_DEBUG") != NULL);
+    purple_eventloop_set_ui_ops(&bench_eventloop_ops);
+
+    if (!purple_core_init(BENCH_UI_ID))
+    {
+        g_printerr("libpurple initialization failed\n");
+        return NULL;
+    }
+
+    purple_set_blist(purple_blist_new());
+    purple_blist_load();
+    return bench_user_dir;
+}
+
+static void bench_remove_tree(const char *path)
+{
+    GDir *dir = g_dir_open(path, 0, NULL);
+    if (dir != NULL)
+    {
+        const char *name;
+        while ((name = g_dir_read_name(dir)) != NULL)
+        {
+            gchar *child = g_build_filename(path, name, NULL);
+            bench_remove_tree(child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+    }
+    g_remove(path);
+}
+
+void bench_core_quit(void)
+{
+    purple_core_quit();
+    if (bench_user_dir != NULL)
+    {
+        bench_remove_tree(bench_user_dir);
+        g_free(bench_user_dir);
+        bench_user_dir = NULL;
+    }
+}
+
+PurplePlugin *bench_register_plugin(gboolean (*init)(PurplePlugin *))
+{
+    PurplePlugin *plugin = purple_plugin_new(TRUE, NULL);
+    if (!init(plugin) || !purple_plugin_load(plugin))
+    {
+        g_printerr("could not load the plugin\n");
+        return NULL;
+    }
+    return plugin;
+}
+
+Tox *bench_generate_profile(guint friends)
+{
+    TOX_ERR_NEW err_new;
+    Tox *tox = tox_new(NULL, &err_new);
+    if (tox == NULL)
+    {
+        g_printerr("could not create a Tox instance (%d)\n", err_new);
+        return NULL;
+    }
+
+    /* random keys make friends that simply never come online, toxcore only
+     * rejects keys with the highest bit set */
+    guint i;
+    for (i = 0; i < friends; i++)
+    {
+        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+        guint j;
+        for (j = 0; j < TOX_PUBLIC_KEY_SIZE; j += sizeof(guint32))
+        {
+            guint32 r = g_random_int();
+            memcpy(public_key + j, &r, sizeof(r));
+        }
+        public_key[TOX_PUBLIC_KEY_SIZE - 1] &= 0x7f;
+
+        TOX_ERR_FRIEND_ADD err_add;
+        tox_friend_add_norequest(tox, public_key, &err_add);
+        if (err_add != TOX_ERR_FRIEND_ADD_OK)
+        {
+            g_printerr("could not add friend #%u (%d)\n", i, err_add);
+            tox_kill(tox);
+            return NULL;
+        }
+    }
+    return tox;
+}
+
+gboolean bench_save_profile(Tox *tox, const char *filename)
+{
+    size_t size = tox_get_savedata_size(tox);
+    uint8_t *savedata = g_malloc(size);
+    tox_get_savedata(tox, savedata);
+
+    GError *error = NULL;
+    gboolean ok = g_file_set_contents(filename, (const gchar *)savedata, size,
+                                      &error);
+    if (!ok)
+    {
+        g_printerr("could not write %s: %s\n", filename, error->message);
+        g_error_free(error);
+    }
+    g_free(savedata);
+    return ok;
+}
+
+gboolean bench_write_profile(const char *account_path, Tox *tox)
+{
+    gchar *filename = g_build_filename(purple_user_dir(), "tox", account_path,
+                                       "tox_save.tox", NULL);
+    gchar *dirname = g_path_get_dirname(filename);
+    g_mkdir_with_parents(dirname, 0700);
+
+    gboolean ok = bench_save_profile(tox, filename);
+    g_free(dirname);
+    g_free(filename);
+    return ok;
+}
+
+PurpleAccount *bench_account_new(const char *username,
+                                 const char *account_path, Tox *profile)
+{
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    char hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    int i;
+
+    /* the plugin refuses to log in if the bootstrap node does not resolve,
+     * the benchmarks bootstrap the instances to each other afterwards */
+    tox_self_get_public_key(profile, public_key);
+    for (i = 0; i < TOX_PUBLIC_KEY_SIZE; i++)
+    {
+        g_snprintf(hex + i * 2, 3, "%02X", public_key[i]);
+    }
+
+    PurpleAccount *account = purple_account_new(username, BENCH_PRPL_ID);
+    purple_account_set_string(account, "account_path", account_path);
+    purple_account_set_string(account, "dht_server", "127.0.0.1");
+    purple_account_set_int(account, "dht_server_port", 33445);
+    purple_account_set_string(account, "dht_server_key", hex);
+    purple_account_set_string(account, "nickname", username);
+    purple_accounts_add(account);
+    return account;
+}
+
+void bench_accounts_connect(void)
+{
+    GList *accounts;
+    for (accounts = purple_accounts_get_all(); accounts != NULL;
+         accounts = g_list_next(accounts))
+    {
+        purple_account_set_enabled(accounts->data, BENCH_UI_ID, TRUE);
+    }
+    PurpleSavedStatus *status = purple_savedstatus_new(NULL,
+                                                    PURPLE_STATUS_AVAILABLE);
+    purple_savedstatus_activate(status);
+}
+
+gboolean bench_run_until(bench_condition done, gpointer data,
+                         guint timeout_ms)
+{
+    gint64 deadline = g_get_monotonic_time() + (gint64)timeout_ms * 1000;
+    while (!done(data))
+    {
+        if (g_get_monotonic_time() > deadline)
+        {
+            return FALSE;
+        }
+        g_main_context_iteration(NULL, TRUE);
+    }
+    return TRUE;
+}
+
+static gint bench_compare_gint64(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *)a;
+    gint64 y = *(const gint64 *)b;
+    return (x > y) - (x < y);
+}
+
+gint64 bench_percentile(GArray *values, double percentile)
+{
+    if (values->len == 0)
+    {
+        return 0;
+    }
+    g_array_sort(values, bench_compare_gint64);
+    guint rank = (guint)((values->len - 1) * percentile / 100.0 + 0.5);
+    return g_array_index(values, gint64, MIN(rank, values->len - 1));
+}
@@ -0,0 +1,68 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Minimal libpurple "UI" for the benchmarks: a GLib event loop, a throwaway
+ * user directory and helpers to register the statically linked plugin and
+ * to write Tox profiles the plugin will pick up on login.
+ */
+
+#ifndef TOXPRPL_BENCH_HARNESS_H
+#define TOXPRPL_BENCH_HARNESS_H
+
+#include <glib.h>
+#include <tox/tox.h>
+
+#include <account.h>
+#include <plugin.h>
+
+#define BENCH_UI_ID "toxprpl-bench"
+
+typedef gboolean (*bench_condition)(gpointer data);
+
+/* initializes libpurple with its user directory in a new temporary dir */
+const char *bench_core_init(void);
+/* shuts libpurple down and removes the temporary directory */
+void bench_core_quit(void);
+
+/* registers and loads a plugin linked into the benchmark executable */
+PurplePlugin *bench_register_plugin(gboolean (*init)(PurplePlugin *));
+
+/* creates a Tox instance with the given number of random friends */
+Tox *bench_generate_profile(guint friends);
+/* writes the savedata of tox to filename */
+gboolean bench_save_profile(Tox *tox, const char *filename);
+/* writes the savedata of tox where the plugin looks for account_path */
+gboolean bench_write_profile(const char *account_path, Tox *tox);
+
+/* creates an account using the local profile in account_path and a
+ * bootstrap node on localhost, it is not connected yet */
+PurpleAccount *bench_account_new(const char *username,
+                                 const char *account_path, Tox *profile);
+/* connects all accounts created with bench_account_new() */
+void bench_accounts_connect(void);
+
+/* runs the main loop until done returns TRUE or timeout_ms passed */
+gboolean bench_run_until(bench_condition done, gpointer data,
+                         guint timeout_ms);
+
+/* nearest rank percentile of values, sorts the array in place */
+gint64 bench_percentile(GArray *values, double percentile);
+
+#endif
@@ -0,0 +1,618 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Loopback benchmark: two accounts of the plugin talk to each other over
+ * localhost, without any outside DHT node. Measures message round trip
+ * latency, message throughput and file transfer speed in both directions
+ * and prints the results as JSON. On the way it checks that lossless raw
+ * records of mixed sizes arrive in the order they were sent.
+ */
+
+/* the benchmark needs the plugin internals, e.g. to bootstrap the two
+ * instances to each other */
+#include "toxprpl.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ft.h>
+#include <server.h>
+
+#include "harness.h"
+
+#define BENCH_PEERS 2
+
+typedef enum
+{
+    BENCH_PHASE_SETUP,
+    BENCH_PHASE_RTT,
+    BENCH_PHASE_BURST,
+    BENCH_PHASE_RAW,
+    BENCH_PHASE_FILES
+} bench_phase;
+
+typedef struct
+{
+    PurpleAccount *account;
+    /* buddy name of the other peer */
+    gchar *buddy;
+    guint received;
+} bench_peer;
+
+static bench_peer bench_peers[BENCH_PEERS];
+static bench_phase bench_current_phase = BENCH_PHASE_SETUP;
+static gboolean bench_echo_received = FALSE;
+
+/* file transfer in progress */
+static bench_peer *bench_recv_peer = NULL;
+static gchar *bench_recv_filename = NULL;
+static gboolean bench_recv_done = FALSE;
+
+/* raw records: sequence number expected next and records out of order */
+static guint bench_raw_expected = 0;
+static guint bench_raw_misordered = 0;
+
+/* handle for our signal connections */
+static int bench_handle;
+
+static gint bench_rtt_samples = 200;
+static gint bench_burst_messages = 2000;
+static gint bench_raw_records = 1000;
+static gchar *bench_sizes = NULL;
+static gint bench_timeout = 120;
+static gchar *bench_output = NULL;
+
+static GOptionEntry bench_options[] =
+{
+    { "rtt-samples", 'r', 0, G_OPTION_ARG_INT, &bench_rtt_samples,
+      "number of round trips to measure", "N" },
+    { "messages", 'm', 0, G_OPTION_ARG_INT, &bench_burst_messages,
+      "number of messages for the throughput test", "N" },
+    { "raw-records", 'R', 0, G_OPTION_ARG_INT, &bench_raw_records,
+      "number of raw records for the ordering test", "N" },
+    { "sizes", 's', 0, G_OPTION_ARG_STRING, &bench_sizes,
+      "comma separated file sizes in bytes", "SIZES" },
+    { "timeout", 't', 0, G_OPTION_ARG_INT, &bench_timeout,
+      "seconds to wait for each step", "SECONDS" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &bench_output,
+      "write the JSON results to FILE instead of stdout", "FILE" },
+    { NULL }
+};
+
+static bench_peer *bench_find_peer(PurpleAccount *account)
+{
+    int i;
+    for (i = 0; i < BENCH_PEERS; i++)
+    {
+        if (bench_peers[i].account == account)
+        {
+            return &bench_peers[i];
+        }
+    }
+    return NULL;
+}
+
+static toxprpl_plugin_data *bench_plugin_data(bench_peer *peer)
+{
+    PurpleConnection *gc = purple_account_get_connection(peer->account);
+    return (gc != NULL) ? purple_connection_get_protocol_data(gc) : NULL;
+}
+
+static void bench_received_im(PurpleAccount *account, char *sender,
+                              char *message, PurpleConversation *conv,
+                              PurpleMessageFlags flags, gpointer data)
+{
+    bench_peer *peer = bench_find_peer(account);
+    if (peer == NULL)
+    {
+        return;
+    }
+    peer->received++;
+
+    if (bench_current_phase == BENCH_PHASE_RTT)
+    {
+        if (peer == &bench_peers[1])
+        {
+            serv_send_im(purple_account_get_connection(account), sender,
+                         message, 0);
+        }
+        else
+        {
+            bench_echo_received = TRUE;
+        }
+    }
+}
+
+static void bench_raw_received(PurpleConnection *gc, const char *who,
+                               const guchar *data, guint length, guint id,
+                               gpointer user_data)
+{
+    if ((bench_current_phase != BENCH_PHASE_RAW) ||
+        (purple_connection_get_account(gc) != bench_peers[1].account) ||
+        (length < sizeof(guint32)))
+    {
+        return;
+    }
+    guint32 sequence;
+    memcpy(&sequence, data, sizeof(sequence));
+    if (GUINT32_FROM_BE(sequence) != bench_raw_expected)
+    {
+        bench_raw_misordered++;
+    }
+    bench_raw_expected = GUINT32_FROM_BE(sequence) + 1;
+}
+
+static void bench_file_recv_request(PurpleXfer *xfer, gpointer data)
+{
+    if ((bench_recv_peer != NULL) &&
+        (purple_xfer_get_account(xfer) == bench_recv_peer->account))
+    {
+        purple_xfer_request_accepted(xfer, bench_recv_filename);
+    }
+}
+
+static void bench_file_recv_complete(PurpleXfer *xfer, gpointer data)
+{
+    if ((bench_recv_peer != NULL) &&
+        (purple_xfer_get_account(xfer) == bench_recv_peer->account))
+    {
+        bench_recv_done = TRUE;
+    }
+}
+
+static gboolean bench_logged_in(gpointer data)
+{
+    int i;
+    for (i = 0; i < BENCH_PEERS; i++)
+    {
+        if (bench_plugin_data(&bench_peers[i]) == NULL)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean bench_friends_online(gpointer data)
+{
+    int i;
+    for (i = 0; i < BENCH_PEERS; i++)
+    {
+        toxprpl_plugin_data *plugin = bench_plugin_data(&bench_peers[i]);
+        TOX_ERR_FRIEND_QUERY err_back;
+        if (!purple_account_is_connected(bench_peers[i].account) ||
+            (tox_friend_get_connection_status(plugin->tox, 0, &err_back) ==
+             TOX_CONNECTION_NONE))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean bench_flag_set(gpointer data)
+{
+    return *(gboolean *)data;
+}
+
+static gboolean bench_received_all(gpointer data)
+{
+    return bench_peers[1].received >= GPOINTER_TO_UINT(data);
+}
+
+static gboolean bench_frames_supported(gpointer data)
+{
+    toxprpl_friend_data *fdata = g_hash_table_lookup(
+            bench_plugin_data(&bench_peers[0])->friends, GUINT_TO_POINTER(0));
+    return (fdata != NULL) && (fdata->peer_caps & TOXPRPL_CAP_FRAMES);
+}
+
+static gboolean bench_raw_received_all(gpointer data)
+{
+    return bench_raw_expected >= GPOINTER_TO_UINT(data);
+}
+
+static gboolean bench_never(gpointer data)
+{
+    return FALSE;
+}
+
+/* the plugin bootstraps to a dummy node, connect the instances directly */
+static void bench_bootstrap(bench_peer *peer, bench_peer *node)
+{
+    Tox *tox = bench_plugin_data(peer)->tox;
+    Tox *node_tox = bench_plugin_data(node)->tox;
+    uint8_t dht_id[TOX_PUBLIC_KEY_SIZE];
+    TOX_ERR_GET_PORT err_port;
+    TOX_ERR_BOOTSTRAP err_bootstrap;
+
+    tox_self_get_dht_id(node_tox, dht_id);
+    uint16_t port = tox_self_get_udp_port(node_tox, &err_port);
+    tox_bootstrap(tox, "127.0.0.1", port, dht_id, &err_bootstrap);
+}
+
+static void bench_json_latency(GString *json, const char *name,
+                               GArray *usec)
+{
+    g_string_append_printf(json,
+            "  \"%s\": {\"samples\": %u, \"p50\": %.3f, \"p90\": %.3f, "
+            "\"p99\": %.3f, \"max\": %.3f},\n", name, usec->len,
+            bench_percentile(usec, 50) / 1000.0,
+            bench_percentile(usec, 90) / 1000.0,
+            bench_percentile(usec, 99) / 1000.0,
+            bench_percentile(usec, 100) / 1000.0);
+}
+
+static gboolean bench_measure_rtt(GString *json)
+{
+    GArray *rtt = g_array_new(FALSE, FALSE, sizeof(gint64));
+    PurpleConnection *gc = purple_account_get_connection(
+            bench_peers[0].account);
+    gint i;
+
+    bench_current_phase = BENCH_PHASE_RTT;
+    for (i = 0; i < bench_rtt_samples; i++)
+    {
+        gchar *message = g_strdup_printf("rtt %d", i);
+        bench_echo_received = FALSE;
+        gint64 start = g_get_monotonic_time();
+        serv_send_im(gc, bench_peers[0].buddy, message, 0);
+        g_free(message);
+
+        if (!bench_run_until(bench_flag_set, &bench_echo_received,
+                             bench_timeout * 1000))
+        {
+            g_printerr("no echo for message %d\n", i);
+            g_array_free(rtt, TRUE);
+            return FALSE;
+        }
+        gint64 elapsed = g_get_monotonic_time() - start;
+        g_array_append_val(rtt, elapsed);
+    }
+
+    bench_json_latency(json, "message_rtt_ms", rtt);
+    g_array_free(rtt, TRUE);
+    return TRUE;
+}
+
+static gboolean bench_measure_burst(GString *json)
+{
+    PurpleConnection *gc = purple_account_get_connection(
+            bench_peers[0].account);
+    gint i;
+
+    bench_current_phase = BENCH_PHASE_BURST;
+    bench_peers[1].received = 0;
+    gint64 start = g_get_monotonic_time();
+    for (i = 0; i < bench_burst_messages; i++)
+    {
+        gchar *message = g_strdup_printf("burst %d", i);
+        serv_send_im(gc, bench_peers[0].buddy, message, 0);
+        g_free(message);
+    }
+
+    if (!bench_run_until(bench_received_all,
+                         GUINT_TO_POINTER(bench_burst_messages),
+                         bench_timeout * 1000))
+    {
+        g_printerr("only %u of %d messages arrived\n",
+                   bench_peers[1].received, bench_burst_messages);
+        return FALSE;
+    }
+    double seconds = (g_get_monotonic_time() - start) /
+                     (double)G_USEC_PER_SEC;
+
+    g_string_append_printf(json,
+            "  \"messages\": {\"count\": %d, \"seconds\": %.3f, "
+            "\"per_second\": %.1f},\n", bench_burst_messages, seconds,
+            bench_burst_messages / seconds);
+    return TRUE;
+}
+
+/* Sends lossless raw records alternating between sizes that are collected
+ * into frames and sizes that go out as packets of their own, each starting
+ * with its big endian sequence number, and checks that they arrive in
+ * order. */
+static gboolean bench_check_raw_order(GString *json)
+{
+    PurpleConnection *gc = purple_account_get_connection(
+            bench_peers[0].account);
+    uint8_t buf[TOX_PUBLIC_KEY_SIZE + TOX_MAX_CUSTOM_PACKET_SIZE];
+    guint i;
+
+    if (!bench_run_until(bench_frames_supported, NULL, bench_timeout * 1000))
+    {
+        g_printerr("peer capabilities did not arrive\n");
+        return FALSE;
+    }
+
+    bench_current_phase = BENCH_PHASE_RAW;
+    bench_raw_expected = 0;
+    bench_raw_misordered = 0;
+    unsigned char *key = toxprpl_hex_string_to_data(bench_peers[0].buddy);
+    memcpy(buf, key, TOX_PUBLIC_KEY_SIZE);
+    free(key);
+    memset(buf + TOX_PUBLIC_KEY_SIZE, 0xaa, TOX_MAX_CUSTOM_PACKET_SIZE);
+    gint64 start = g_get_monotonic_time();
+    for (i = 0; i < (guint)bench_raw_records; i++)
+    {
+        /* every third record is too large for a frame */
+        size_t length = (i % 3 == 2) ? TOX_MAX_CUSTOM_PACKET_SIZE :
+                        1 + sizeof(guint32) + (i % 64);
+        guint32 sequence = GUINT32_TO_BE(i);
+        buf[TOX_PUBLIC_KEY_SIZE] = TOXPRPL_PACKET_RAW_FIRST;
+        memcpy(buf + TOX_PUBLIC_KEY_SIZE + 1, &sequence, sizeof(sequence));
+
+        while (toxprpl_send_raw(gc, (const char *)buf,
+                                TOX_PUBLIC_KEY_SIZE + length) < 0)
+        {
+            /* the send queue is full, let toxcore empty it */
+            if (g_get_monotonic_time() - start >
+                bench_timeout * G_USEC_PER_SEC)
+            {
+                g_printerr("raw record %u could not be sent\n", i);
+                return FALSE;
+            }
+            bench_run_until(bench_never, NULL, 10);
+        }
+    }
+
+    if (!bench_run_until(bench_raw_received_all,
+                         GUINT_TO_POINTER(bench_raw_records),
+                         bench_timeout * 1000))
+    {
+        g_printerr("only %u of %d raw records arrived\n", bench_raw_expected,
+                   bench_raw_records);
+        return FALSE;
+    }
+    g_string_append_printf(json,
+            "  \"raw_records\": {\"count\": %d, \"misordered\": %u},\n",
+            bench_raw_records, bench_raw_misordered);
+    if (bench_raw_misordered > 0)
+    {
+        g_printerr("%u raw records arrived out of order\n",
+                   bench_raw_misordered);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gchar *bench_make_file(const char *dir, guint64 size)
+{
+    gchar *name = g_strdup_printf("send-%" G_GUINT64_FORMAT, size);
+    gchar *filename = g_build_filename(dir, name, NULL);
+    g_free(name);
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL)
+    {
+        g_free(filename);
+        return NULL;
+    }
+    guint32 block[1024];
+    guint64 written = 0;
+    while (written < size)
+    {
+        guint i;
+        for (i = 0; i < G_N_ELEMENTS(block); i++)
+        {
+            block[i] = g_random_int();
+        }
+        size_t length = MIN(sizeof(block), size - written);
+        fwrite(block, 1, length, fp);
+        written += length;
+    }
+    fclose(fp);
+    return filename;
+}
+
+static gboolean bench_transfer(GString *json, const char *dir,
+                               bench_peer *from, bench_peer *to,
+                               const char *direction, guint64 size,
+                               gboolean last)
+{
+    gchar *source = bench_make_file(dir, size);
+    if (source == NULL)
+    {
+        g_printerr("could not create a %" G_GUINT64_FORMAT " byte file\n",
+                   size);
+        return FALSE;
+    }
+
+    gchar *name = g_strdup_printf("recv-%s-%" G_GUINT64_FORMAT, direction,
+                                  size);
+    bench_recv_filename = g_build_filename(dir, name, NULL);
+    g_free(name);
+    g_remove(bench_recv_filename);
+    bench_recv_peer = to;
+    bench_recv_done = FALSE;
+
+    gint64 start = g_get_monotonic_time();
+    serv_send_file(purple_account_get_connection(from->account), from->buddy,
+                   source);
+    gboolean done = bench_run_until(bench_flag_set, &bench_recv_done,
+                                    bench_timeout * 1000);
+    double seconds = (g_get_monotonic_time() - start) /
+                     (double)G_USEC_PER_SEC;
+
+    GStatBuf sb;
+    if (!done || (g_stat(bench_recv_filename, &sb) != 0) ||
+        ((guint64)sb.st_size != size))
+    {
+        g_printerr("transfer %s of %" G_GUINT64_FORMAT " bytes failed\n",
+                   direction, size);
+        done = FALSE;
+    }
+    else
+    {
+        g_string_append_printf(json,
+                "    {\"direction\": \"%s\", \"bytes\": %" G_GUINT64_FORMAT
+                ", \"seconds\": %.3f, \"mb_per_second\": %.3f}%s\n",
+                direction, size, seconds,
+                size / (1024.0 * 1024.0) / seconds, last ? "" : ",");
+    }
+
+    bench_recv_peer = NULL;
+    g_remove(bench_recv_filename);
+    g_free(bench_recv_filename);
+    bench_recv_filename = NULL;
+    g_remove(source);
+    g_free(source);
+    return done;
+}
+
+static gboolean bench_measure_files(GString *json, const char *user_dir)
+{
+    gchar **sizes = g_strsplit(bench_sizes != NULL ? bench_sizes :
+                               "65536,1048576,16777216", ",", -1);
+    gchar *dir = g_build_filename(user_dir, "files", NULL);
+    g_mkdir_with_parents(dir, 0700);
+    gboolean ok = TRUE;
+    guint i;
+
+    bench_current_phase = BENCH_PHASE_FILES;
+    g_string_append(json, "  \"file_transfers\": [\n");
+    for (i = 0; ok && (sizes[i] != NULL); i++)
+    {
+        guint64 size = g_ascii_strtoull(sizes[i], NULL, 10);
+        gboolean last = (sizes[i + 1] == NULL);
+        ok = bench_transfer(json, dir, &bench_peers[0], &bench_peers[1],
+                            "a_to_b", size, FALSE) &&
+             bench_transfer(json, dir, &bench_peers[1], &bench_peers[0],
+                            "b_to_a", size, last);
+    }
+    g_string_append(json, "  ]\n");
+
+    g_free(dir);
+    g_strfreev(sizes);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new(
+            "- loopback benchmark of the Tox protocol plugin");
+    g_option_context_add_main_entries(context, bench_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    const char *user_dir = bench_core_init();
+    if ((user_dir == NULL) ||
+        (bench_register_plugin(purple_init_plugin) == NULL))
+    {
+        return EXIT_FAILURE;
+    }
+
+    /* profiles that already have each other as friends */
+    Tox *profiles[BENCH_PEERS];
+    uint8_t public_keys[BENCH_PEERS][TOX_PUBLIC_KEY_SIZE];
+    int i;
+    for (i = 0; i < BENCH_PEERS; i++)
+    {
+        profiles[i] = tox_new(NULL, NULL);
+        tox_self_get_public_key(profiles[i], public_keys[i]);
+    }
+    for (i = 0; i < BENCH_PEERS; i++)
+    {
+        int other = (i + 1) % BENCH_PEERS;
+        TOX_ERR_FRIEND_ADD err_back;
+        tox_friend_add_norequest(profiles[i], public_keys[other], &err_back);
+
+        gchar *name = g_strdup_printf("bench-%c", 'a' + i);
+        bench_write_profile(name, profiles[i]);
+        bench_peers[i].account = bench_account_new(name, name, profiles[i]);
+        bench_peers[i].buddy = toxprpl_tox_bin_id_to_string(
+                public_keys[other]);
+        g_free(name);
+    }
+    for (i = 0; i < BENCH_PEERS; i++)
+    {
+        tox_kill(profiles[i]);
+    }
+
+    purple_signal_connect(purple_conversations_get_handle(),
+                          "received-im-msg", &bench_handle,
+                          PURPLE_CALLBACK(bench_received_im), NULL);
+    purple_signal_connect(purple_xfers_get_handle(), "file-recv-request",
+                          &bench_handle, PURPLE_CALLBACK(bench_file_recv_request),
+                          NULL);
+    purple_signal_connect(purple_xfers_get_handle(), "file-recv-complete",
+                          &bench_handle, PURPLE_CALLBACK(bench_file_recv_complete),
+                          NULL);
+    purple_signal_connect(toxprpl_plugin, "raw-received", &bench_handle,
+                          PURPLE_CALLBACK(bench_raw_received), NULL);
+
+    bench_accounts_connect();
+    gboolean ok = bench_run_until(bench_logged_in, NULL,
+                                  bench_timeout * 1000);
+    if (ok)
+    {
+        bench_bootstrap(&bench_peers[0], &bench_peers[1]);
+        bench_bootstrap(&bench_peers[1], &bench_peers[0]);
+        ok = bench_run_until(bench_friends_online, NULL,
+                             bench_timeout * 1000);
+    }
+    if (!ok)
+    {
+        g_printerr("instances did not connect to each other\n");
+    }
+
+    GString *json = g_string_new("{\n");
+    g_string_append_printf(json,
+            "  \"plugin_version\": \"%s\",\n"
+            "  \"toxcore_version\": \"%u.%u.%u\",\n",
+            VERSION, tox_version_major(), tox_version_minor(),
+            tox_version_patch());
+
+    ok = ok && bench_measure_rtt(json) && bench_measure_burst(json) &&
+         bench_check_raw_order(json) && bench_measure_files(json, user_dir);
+    g_string_append(json, "}\n");
+
+    if (ok)
+    {
+        if (bench_output != NULL)
+        {
+            ok = g_file_set_contents(bench_output, json->str, -1, &error);
+            if (!ok)
+            {
+                g_printerr("%s\n", error->message);
+                g_error_free(error);
+            }
+        }
+        else
+        {
+            fputs(json->str, stdout);
+        }
+    }
+    g_string_free(json, TRUE);
+
+    purple_signals_disconnect_by_handle(&bench_handle);
+    for (i = 0; i < BENCH_PEERS; i++)
+    {
+        g_free(bench_peers[i].buddy);
+    }
+    bench_core_quit();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
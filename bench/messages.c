@@ -0,0 +1,286 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Counts the heap allocations the plugin makes for each text message it
+ * receives or sends: the buddy lookup and text preparation before
+ * serv_got_im(), and the markup stripping and /me handling before
+ * tox_friend_send_message(). The previous implementation of both paths is
+ * run as well for comparison. Allocations are counted by replacing the
+ * glibc allocator entry points. Results are printed as JSON.
+ */
+
+/* the helpers under test are static */
+#include "toxprpl.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static gint messages_count = 1000000;
+static gchar *messages_output = NULL;
+
+static GOptionEntry messages_options[] =
+{
+    { "messages", 'm', 0, G_OPTION_ARG_INT, &messages_count,
+      "messages per case", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &messages_output,
+      "write the JSON results to FILE instead of stdout", "FILE" },
+    { NULL }
+};
+
+/* every malloc, calloc and realloc of the process, glib included */
+static guint64 messages_allocs;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    messages_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    messages_allocs++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    messages_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+/* keeps the compiler from dropping the measured calls */
+static volatile guint64 messages_sink;
+
+typedef struct
+{
+    const char *name;
+    TOX_MESSAGE_TYPE type;
+    const char *text;
+} messages_case;
+
+static const messages_case messages_incoming[] =
+{
+    { "incoming_text", TOX_MESSAGE_TYPE_NORMAL,
+      "are you around later? the build finished, logs are on the share" },
+    { "incoming_action", TOX_MESSAGE_TYPE_ACTION,
+      "waves from the other side of the network" },
+    { "incoming_utf8", TOX_MESSAGE_TYPE_NORMAL,
+      "Grüße aus Zürich, bis später \xe2\x98\x95 \xf0\x9f\x91\x8d" },
+    { "incoming_invalid", TOX_MESSAGE_TYPE_NORMAL,
+      "truncated in the middle of a character \xe2\x98" }
+};
+
+static const messages_case messages_outgoing[] =
+{
+    { "outgoing_text", TOX_MESSAGE_TYPE_NORMAL,
+      "sure, ping me when you are done with the release notes" },
+    { "outgoing_action", TOX_MESSAGE_TYPE_ACTION,
+      "/me is looking at the logs now" },
+    { "outgoing_markup", TOX_MESSAGE_TYPE_NORMAL,
+      "<b>important:</b> don't merge before &quot;make bench&quot; ran" }
+};
+
+static void messages_report(GString *json, const char *name,
+                            const char *path, guint64 allocs, gint64 usec)
+{
+    if (json->len > 0)
+    {
+        g_string_append(json, ",\n");
+    }
+    g_string_append_printf(json,
+            "    {\"name\": \"%s\", \"path\": \"%s\", "
+            "\"messages\": %d, \"allocs_per_message\": %.2f, "
+            "\"ns_per_message\": %.1f}",
+            name, path, messages_count,
+            (double)allocs / MAX(messages_count, 1),
+            usec * 1000.0 / MAX(messages_count, 1));
+}
+
+/* what on_incoming_message() did before the scratch buffers */
+static void messages_incoming_previous(toxprpl_plugin_data *plugin,
+                                       const messages_case *c)
+{
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
+    tox_friend_get_public_key(plugin->tox, 0, public_key, &err_back);
+
+    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
+    gchar *message = g_strndup(c->text, strlen(c->text));
+    if (c->type == TOX_MESSAGE_TYPE_ACTION)
+    {
+        gchar *action = g_strdup_printf("/me %s", message);
+        g_free(message);
+        message = action;
+    }
+    messages_sink += strlen(message) + strlen(buddy_key);
+    g_free(buddy_key);
+    g_free(message);
+}
+
+static void messages_incoming_current(toxprpl_plugin_data *plugin,
+                                      const messages_case *c)
+{
+    const char *buddy_key = toxprpl_friend_buddy_key(plugin,
+            toxprpl_get_friend_data(plugin, 0));
+
+    char scratch[MESSAGE_SCRATCH_SIZE];
+    gchar *salvaged;
+    const char *message = toxprpl_incoming_text(scratch, c->type,
+            (const uint8_t *)c->text, strlen(c->text), &salvaged);
+    messages_sink += strlen(message) + strlen(buddy_key);
+    g_free(salvaged);
+}
+
+/* what toxprpl_send_im() did before the scratch buffers */
+static void messages_outgoing_previous(const messages_case *c)
+{
+    char *no_html = purple_markup_strip_html(c->text);
+    messages_sink += purple_message_meify(no_html, -1) + strlen(no_html);
+    g_free(no_html);
+}
+
+static void messages_outgoing_current(const messages_case *c)
+{
+    char scratch[MESSAGE_SCRATCH_SIZE];
+    char *allocated;
+    TOX_MESSAGE_TYPE type;
+    char *text = toxprpl_outgoing_text(c->text, scratch, &type, &allocated);
+    messages_sink += type + strlen(text);
+    g_free(allocated);
+}
+
+static void messages_run(GString *json, toxprpl_plugin_data *plugin)
+{
+    guint i;
+    gint n;
+
+    for (i = 0; i < G_N_ELEMENTS(messages_incoming); i++)
+    {
+        const messages_case *c = &messages_incoming[i];
+
+        guint64 allocs = messages_allocs;
+        gint64 start = g_get_monotonic_time();
+        for (n = 0; n < messages_count; n++)
+        {
+            messages_incoming_previous(plugin, c);
+        }
+        messages_report(json, c->name, "previous", messages_allocs - allocs,
+                        g_get_monotonic_time() - start);
+
+        allocs = messages_allocs;
+        start = g_get_monotonic_time();
+        for (n = 0; n < messages_count; n++)
+        {
+            messages_incoming_current(plugin, c);
+        }
+        messages_report(json, c->name, "current", messages_allocs - allocs,
+                        g_get_monotonic_time() - start);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(messages_outgoing); i++)
+    {
+        const messages_case *c = &messages_outgoing[i];
+
+        guint64 allocs = messages_allocs;
+        gint64 start = g_get_monotonic_time();
+        for (n = 0; n < messages_count; n++)
+        {
+            messages_outgoing_previous(c);
+        }
+        messages_report(json, c->name, "previous", messages_allocs - allocs,
+                        g_get_monotonic_time() - start);
+
+        allocs = messages_allocs;
+        start = g_get_monotonic_time();
+        for (n = 0; n < messages_count; n++)
+        {
+            messages_outgoing_current(c);
+        }
+        messages_report(json, c->name, "current", messages_allocs - allocs,
+                        g_get_monotonic_time() - start);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new(
+            "- message path allocation benchmark of the Tox protocol plugin");
+    g_option_context_add_main_entries(context, messages_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    /* one friend is enough, the messages only need its buddy name */
+    TOX_ERR_NEW err_new;
+    toxprpl_plugin_data plugin;
+    memset(&plugin, 0, sizeof(plugin));
+    plugin.tox = tox_new(NULL, &err_new);
+    if (plugin.tox == NULL)
+    {
+        g_printerr("could not create a Tox instance: %d\n", err_new);
+        return EXIT_FAILURE;
+    }
+    plugin.friends = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                           NULL, toxprpl_friend_data_free);
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    guint i;
+    for (i = 0; i < TOX_PUBLIC_KEY_SIZE; i++)
+    {
+        public_key[i] = g_random_int_range(0, 256);
+    }
+    TOX_ERR_FRIEND_ADD err_add;
+    tox_friend_add_norequest(plugin.tox, public_key, &err_add);
+
+    GString *json = g_string_new("");
+    messages_run(json, &plugin);
+    g_hash_table_destroy(plugin.friends);
+    tox_kill(plugin.tox);
+
+    gchar *result = g_strdup_printf("{\n"
+            "  \"plugin_version\": \"%s\",\n"
+            "  \"results\": [\n%s\n  ]\n}\n", VERSION, json->str);
+    g_string_free(json, TRUE);
+
+    gboolean ok = TRUE;
+    if (messages_output != NULL)
+    {
+        ok = g_file_set_contents(messages_output, result, -1, &error);
+        if (!ok)
+        {
+            g_printerr("%s\n", error->message);
+            g_error_free(error);
+        }
+    }
+    else
+    {
+        fputs(result, stdout);
+    }
+    g_free(result);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
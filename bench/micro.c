@@ -0,0 +1,268 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the CPU bound parts of the plugin: hex conversion,
+ * status mapping, and for synthetic profiles of different sizes the buddy
+ * list sync, profile import and savedata export. Results are printed as
+ * JSON.
+ */
+
+/* the helpers under test are static */
+#include "toxprpl.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "harness.h"
+
+static gint micro_iterations = 1000000;
+static gchar *micro_sizes = NULL;
+static gchar *micro_output = NULL;
+
+static GOptionEntry micro_options[] =
+{
+    { "iterations", 'i', 0, G_OPTION_ARG_INT, &micro_iterations,
+      "iterations of the small benchmarks", "N" },
+    { "friends", 'f', 0, G_OPTION_ARG_STRING, &micro_sizes,
+      "comma separated friend counts of the synthetic profiles", "SIZES" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &micro_output,
+      "write the JSON results to FILE instead of stdout", "FILE" },
+    { NULL }
+};
+
+/* keeps the compiler from dropping the measured calls */
+static volatile guint64 micro_sink;
+
+static void micro_report(GString *json, const char *name, guint friends,
+                         guint64 iterations, gint64 usec)
+{
+    if (json->len > 2)
+    {
+        g_string_append(json, ",\n");
+    }
+    g_string_append_printf(json, "    {\"name\": \"%s\", ", name);
+    if (friends > 0)
+    {
+        g_string_append_printf(json, "\"friends\": %u, ", friends);
+    }
+    g_string_append_printf(json,
+            "\"iterations\": %" G_GUINT64_FORMAT ", \"ns_per_op\": %.1f}",
+            iterations, usec * 1000.0 / MAX(iterations, 1));
+}
+
+static void micro_hex(GString *json)
+{
+    uint8_t bin[TOX_ADDRESS_SIZE];
+    char hex[TOX_ADDRESS_SIZE * 2 + 1];
+    gint i;
+
+    for (i = 0; i < TOX_ADDRESS_SIZE; i++)
+    {
+        bin[i] = g_random_int_range(0, 256);
+    }
+
+    gint64 start = g_get_monotonic_time();
+    for (i = 0; i < micro_iterations; i++)
+    {
+        toxprpl_data_to_hex_buf(bin, TOX_ADDRESS_SIZE, hex);
+        micro_sink += hex[i % (TOX_ADDRESS_SIZE * 2)];
+    }
+    micro_report(json, "hex_encode_buf", 0, micro_iterations,
+                 g_get_monotonic_time() - start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < micro_iterations; i++)
+    {
+        gchar *id = toxprpl_tox_bin_id_to_string(bin);
+        micro_sink += id[0];
+        g_free(id);
+    }
+    micro_report(json, "hex_encode_string", 0, micro_iterations,
+                 g_get_monotonic_time() - start);
+
+    toxprpl_data_to_hex_buf(bin, TOX_ADDRESS_SIZE, hex);
+    start = g_get_monotonic_time();
+    for (i = 0; i < micro_iterations; i++)
+    {
+        unsigned char *data = toxprpl_hex_string_to_data(hex);
+        micro_sink += data[0];
+        free(data);
+    }
+    micro_report(json, "hex_decode", 0, micro_iterations,
+                 g_get_monotonic_time() - start);
+}
+
+static void micro_status(GString *json, Tox *tox)
+{
+    static const TOX_USER_STATUS statuses[] =
+    {
+        TOX_USER_STATUS_NONE, TOX_USER_STATUS_AWAY, TOX_USER_STATUS_BUSY
+    };
+    gint i;
+
+    gint64 start = g_get_monotonic_time();
+    for (i = 0; i < micro_iterations; i++)
+    {
+        micro_sink += toxprpl_get_status_index(tox, 0,
+                statuses[i % G_N_ELEMENTS(statuses)]);
+    }
+    micro_report(json, "status_index", 0, micro_iterations,
+                 g_get_monotonic_time() - start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < micro_iterations; i++)
+    {
+        TOX_USER_STATUS status;
+        micro_sink += toxprpl_get_tox_status_from_id(
+                toxprpl_statuses[i % TOXPRPL_MAX_STATUS].id, &status);
+    }
+    micro_report(json, "status_from_id", 0, micro_iterations,
+                 g_get_monotonic_time() - start);
+}
+
+static void micro_profile(GString *json, guint friends)
+{
+    Tox *tox = bench_generate_profile(friends);
+    if (tox == NULL)
+    {
+        return;
+    }
+
+    gchar *path = g_strdup_printf("micro-%u", friends);
+    bench_write_profile(path, tox);
+    PurpleAccount *account = bench_account_new(path, path, tox);
+
+    /* first login with an empty buddy list adds every friend */
+    gint64 start = g_get_monotonic_time();
+    toxprpl_sync_friends(account, tox);
+    micro_report(json, "sync_friends_initial", friends, 1,
+                 g_get_monotonic_time() - start);
+
+    /* later logins only match friends to existing buddies */
+    start = g_get_monotonic_time();
+    toxprpl_sync_friends(account, tox);
+    micro_report(json, "sync_friends_reconcile", friends, 1,
+                 g_get_monotonic_time() - start);
+
+    gchar *filename = g_build_filename(purple_user_dir(), "tox", path,
+                                       "tox_save.tox", NULL);
+    toxprpl_profile_data profile;
+    start = g_get_monotonic_time();
+    toxprpl_user_import(account, filename, &profile);
+    micro_report(json, "profile_import", friends, 1,
+                 g_get_monotonic_time() - start);
+
+    if (profile.exists)
+    {
+        struct Tox_Options *options = tox_options_new(NULL);
+        options->savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE;
+        options->savedata_length = profile.size;
+        options->savedata_data = profile.account_data;
+        start = g_get_monotonic_time();
+        Tox *loaded = tox_new(options, NULL);
+        micro_report(json, "profile_load", friends, 1,
+                     g_get_monotonic_time() - start);
+        if (loaded != NULL)
+        {
+            tox_kill(loaded);
+        }
+        tox_options_free(options);
+        g_free(profile.account_data);
+    }
+
+    /* toxprpl_user_export only needs the account and the protocol data */
+    toxprpl_plugin_data plugin;
+    PurpleConnection gc;
+    memset(&plugin, 0, sizeof(plugin));
+    memset(&gc, 0, sizeof(gc));
+    plugin.tox = tox;
+    gc.account = account;
+    purple_connection_set_protocol_data(&gc, &plugin);
+    start = g_get_monotonic_time();
+    toxprpl_user_export(&gc, filename);
+    micro_report(json, "savedata_export", friends, 1,
+                 g_get_monotonic_time() - start);
+
+    g_free(filename);
+    g_free(path);
+    tox_kill(tox);
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new(
+            "- microbenchmarks of the Tox protocol plugin");
+    g_option_context_add_main_entries(context, micro_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    if ((bench_core_init() == NULL) ||
+        (bench_register_plugin(purple_init_plugin) == NULL))
+    {
+        return EXIT_FAILURE;
+    }
+
+    GString *json = g_string_new("");
+    Tox *tox = bench_generate_profile(1);
+    if (tox != NULL)
+    {
+        micro_hex(json);
+        micro_status(json, tox);
+        tox_kill(tox);
+    }
+
+    gchar **sizes = g_strsplit(micro_sizes != NULL ? micro_sizes :
+                               "1000,10000,50000", ",", -1);
+    guint i;
+    for (i = 0; sizes[i] != NULL; i++)
+    {
+        micro_profile(json, (guint)g_ascii_strtoull(sizes[i], NULL, 10));
+    }
+    g_strfreev(sizes);
+
+    gchar *result = g_strdup_printf("{\n"
+            "  \"plugin_version\": \"%s\",\n"
+            "  \"results\": [\n%s\n  ]\n}\n", VERSION, json->str);
+    g_string_free(json, TRUE);
+
+    gboolean ok = TRUE;
+    if (micro_output != NULL)
+    {
+        ok = g_file_set_contents(micro_output, result, -1, &error);
+        if (!ok)
+        {
+            g_printerr("%s\n", error->message);
+            g_error_free(error);
+        }
+    }
+    else
+    {
+        fputs(result, stdout);
+    }
+    g_free(result);
+
+    bench_core_quit();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,82 @@
+/*
+ *  Copyright (c) 2013 Sergey 'Jin' Bostandzhyan <jin at mediatomb dot cc>
+ *
+ *  tox-prlp - libpurple protocol plugin or Tox (see http://tox.im)
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Writes a tox_save.tox profile with a given number of made up friends, to
+ * reproduce login and sync costs of large accounts. Copy the result into
+ * ~/.purple/tox/<account path>/ to use it with a real client.
+ */
+
+#ifdef HAVE_CONFIG_H
+    #include "autoconfig.h"
+#endif
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "harness.h"
+
+static gint profilegen_friends = 1000;
+static gchar *profilegen_output = NULL;
+
+static GOptionEntry profilegen_options[] =
+{
+    { "friends", 'f', 0, G_OPTION_ARG_INT, &profilegen_friends,
+      "number of friends in the profile", "N" },
+    { "output", 'o', 0, G_OPTION_ARG_FILENAME, &profilegen_output,
+      "profile to write (default: tox_save.tox)", "FILE" },
+    { NULL }
+};
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context = g_option_context_new(
+            "- generate a synthetic Tox profile");
+    g_option_context_add_main_entries(context, profilegen_options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    if (profilegen_friends < 0)
+    {
+        g_printerr("the number of friends can't be negative\n");
+        return EXIT_FAILURE;
+    }
+
+    Tox *tox = bench_generate_profile(profilegen_friends);
+    if (tox == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    const char *filename = (profilegen_output != NULL) ? profilegen_output :
+                                                         "tox_save.tox";
+    gboolean ok = bench_save_profile(tox, filename);
+    if (ok)
+    {
+        g_print("wrote %s with %d friends\n", filename, profilegen_friends);
+    }
+    tox_kill(tox);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
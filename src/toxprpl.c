@@ -25,12 +25,14 @@
 #endif
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include <errno.h>
 #include <sys/types.h>
 #ifdef __WIN32__
+    #include <malloc.h>
     #include <winsock2.h>
     #include <ws2tcpip.h>
 #else
@@ -52,8 +54,16 @@
 
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <gio/gio.h>
 
 #include <tox/tox.h>
+#include <sodium.h>
+#ifdef HAVE_TOXAV
+    #include <tox/toxav.h>
+    #include <gst/gst.h>
+    #include <gst/app/gstappsink.h>
+    #include <gst/app/gstappsrc.h>
+#endif
 #include <network.h>
 
 #define PURPLE_PLUGINS
@@ -70,6 +80,7 @@
 #include <prpl.h>
 #include <roomlist.h>
 #include <request.h>
+#include <signals.h>
 #include <status.h>
 #include <util.h>
 #include <version.h>
@@ -101,8 +112,65 @@
         return;                                  \
     }
 
+/*
+ * Log levels of the toxprpl_log_* macros. Calls below TOXPRPL_LOG_LEVEL,
+ * which is set by ./configure --with-log-level, are compiled out and the
+ * remaining ones only evaluate their arguments if libpurple would print the
+ * message. Trace messages additionally need PURPLE_VERBOSE_DEBUG to be set.
+ */
+#define TOXPRPL_LOG_TRACE       0
+#define TOXPRPL_LOG_MISC        1
+#define TOXPRPL_LOG_INFO        2
+#define TOXPRPL_LOG_WARNING     3
+#define TOXPRPL_LOG_ERROR       4
+
+#ifndef TOXPRPL_LOG_LEVEL
+    #define TOXPRPL_LOG_LEVEL   TOXPRPL_LOG_MISC
+#endif
+
+#define toxprpl_log(level, purple_level, ...)                   \
+    do                                                          \
+    {                                                           \
+        if (((level) >= TOXPRPL_LOG_LEVEL) &&                   \
+            toxprpl_log_enabled((level), (purple_level)))       \
+        {                                                       \
+            purple_debug((purple_level), "toxprpl", __VA_ARGS__);\
+        }                                                       \
+    } while (0)
+
+#define toxprpl_log_trace(...)                                  \
+    toxprpl_log(TOXPRPL_LOG_TRACE, PURPLE_DEBUG_MISC, __VA_ARGS__)
+#define toxprpl_log_misc(...)                                   \
+    toxprpl_log(TOXPRPL_LOG_MISC, PURPLE_DEBUG_MISC, __VA_ARGS__)
+#define toxprpl_log_info(...)                                   \
+    toxprpl_log(TOXPRPL_LOG_INFO, PURPLE_DEBUG_INFO, __VA_ARGS__)
+#define toxprpl_log_warning(...)                                \
+    toxprpl_log(TOXPRPL_LOG_WARNING, PURPLE_DEBUG_WARNING, __VA_ARGS__)
+#define toxprpl_log_error(...)                                  \
+    toxprpl_log(TOXPRPL_LOG_ERROR, PURPLE_DEBUG_ERROR, __VA_ARGS__)
+
+static gboolean toxprpl_log_enabled(int level, PurpleDebugLevel purple_level)
+{
+    if ((level == TOXPRPL_LOG_TRACE) && !purple_debug_is_verbose())
+    {
+        return FALSE;
+    }
+    if (purple_debug_is_enabled())
+    {
+        return TRUE;
+    }
+    /* same test purple_debug() does before formatting the message */
+    PurpleDebugUiOps *ops = purple_debug_get_ui_ops();
+    return (ops != NULL) && (ops->print != NULL) &&
+           ((ops->is_enabled == NULL) ||
+            ops->is_enabled(purple_level, "toxprpl"));
+}
+
 static const char *g_HEX_CHARS = "0123456789abcdef";
 
+/* handle for our signals, set in toxprpl_init */
+static PurplePlugin *toxprpl_plugin = NULL;
+
 typedef struct
 {
     PurpleStatusPrimitive primitive;
@@ -122,16 +190,491 @@ typedef struct
     char *buddy_key;
 } toxprpl_accept_friend_data;
 
+/* log2 histogram, bucket i counts values in [2^(i-1), 2^i) */
+#define TOXPRPL_HISTOGRAM_BUCKETS   24
+
+typedef struct
+{
+    guint64 count;
+    guint64 sum;
+    guint64 min;
+    guint64 max;
+    guint64 buckets[TOXPRPL_HISTOGRAM_BUCKETS];
+} toxprpl_histogram;
+
+/* a sent message still waiting for its read receipt */
+typedef struct
+{
+    uint32_t message_id;
+    TOX_MESSAGE_TYPE type;
+    guint retransmits;
+    gint64 sent;
+    gchar *message;
+    /* outbox record closed when the receipt arrives, 0 for none */
+    guint64 outbox_seq;
+} toxprpl_receipt;
+
+#define RECEIPT_RING_SIZE           64
+/* show a delivery notice in the conversation for messages slower than this */
+#define RECEIPT_NOTICE_LATENCY      5000
+
+/* typing notifications within this interval are merged into one */
+#define TYPING_COALESCE_INTERVAL    250
+
+/* presence and alias changes of friends are collected this long in ms and
+ * only the net change is applied to the buddy list */
+#define PRESENCE_COALESCE_DELAY     500
+
+/* TOX_CONNECTION values the time spent in is counted for */
+#define TOXPRPL_PATH_COUNT          (TOX_CONNECTION_UDP + 1)
+/* online friends running tox-prpl are probed this often for the RTT */
+#define PING_INTERVAL               15000
+#define PING_TIMEOUT                5000
+/* weight of a new sample in the rolling average, as 1/n */
+#define RTT_AVERAGE_WEIGHT          8
+
+typedef struct
+{
+    Tox *tox;
+    uint32_t friendnumber;
+    /* typing state last sent to the friend and the one the user is in */
+    gboolean typing_sent;
+    gboolean typing_wanted;
+    guint typing_timer;
+    /* unacknowledged messages, oldest at receipt_head */
+    toxprpl_receipt receipts[RECEIPT_RING_SIZE];
+    guint receipt_head;
+    guint receipt_count;
+    /* capability handshake, see toxprpl_send_caps() */
+    gboolean caps_sent;
+    guint8 peer_caps;
+    /* toxprpl_compressed_file announced by the friend */
+    GSList *compressed_files;
+    /* buddy name handed to raw-received subscribers, created on first use */
+    gchar *buddy_key;
+    /* raw records waiting for the next tick, lossless and lossy, see
+     * toxprpl_send_raw() */
+    uint8_t *raw_frames[2];
+    size_t raw_length[2];
+    guint raw_records[2];
+    /* link telemetry, see toxprpl_link_update() */
+    TOX_CONNECTION connection;
+    gint64 connection_since;
+    gint64 path_usec[TOXPRPL_PATH_COUNT];
+    /* outstanding RTT probe, ping_sent is 0 if there is none */
+    guint32 ping_seq;
+    gint64 ping_sent;
+    gint64 next_ping;
+    gboolean ping_report;
+    gint64 rtt_usec;
+    gint64 rtt_avg_usec;
+    guint pings_lost;
+    /* latest user status and name, applied by toxprpl_presence_flush() */
+    TOX_USER_STATUS user_status;
+    gchar *alias;
+    gboolean presence_pending;
+} toxprpl_friend_data;
+
+/* custom lossless packets between tox-prpl instances, toxcore reserves
+ * the ids 160 to 191 for them */
+#define TOXPRPL_PACKET_CAPS             176
+#define TOXPRPL_PACKET_COMPRESSED_FILE  177
+#define TOXPRPL_PACKET_FRAME            178
+#define TOXPRPL_PACKET_VERSION          1
+/* capability bits of TOXPRPL_PACKET_CAPS */
+#define TOXPRPL_CAP_ZLIB                0x01
+#define TOXPRPL_CAP_FRAMES              0x02
+#define TOXPRPL_CAP_PING                0x04
+
+/* lossy packets between tox-prpl instances, toxcore reserves 200 to 254
+ * for lossy packets */
+#define TOXPRPL_PACKET_LOSSY_FRAME      200
+#define TOXPRPL_PACKET_PING             201
+#define TOXPRPL_PACKET_PONG             202
+/* id and big endian sequence number */
+#define PING_PACKET_SIZE                5
+
+/* packet ids left to send_raw() users */
+#define TOXPRPL_PACKET_RAW_FIRST        180
+#define TOXPRPL_PACKET_RAW_LAST         191
+#define TOXPRPL_PACKET_LOSSY_FIRST      208
+#define TOXPRPL_PACKET_LOSSY_LAST       254
+/* a frame record is the packet id, a 16 bit big endian length and the
+ * data */
+#define RAW_RECORD_HEADER               3
+#define RAW_RECORD_MAX  (TOX_MAX_CUSTOM_PACKET_SIZE - 1 - RAW_RECORD_HEADER)
+
+/* a file that will be sent zlib compressed, size is the original size */
+typedef struct
+{
+    uint8_t file_id[TOX_FILE_ID_LENGTH];
+    guint64 size;
+} toxprpl_compressed_file;
+
+/* default zlib level for transfers to other tox-prpl instances, 0 turns
+ * compression off */
+#define DEFAULT_COMPRESSION_LEVEL   6
+/* smaller files are sent as they are */
+#define COMPRESS_MIN_SIZE           4096
+#define COMPRESS_BUFFER_SIZE        65536
+/* input read at a time while compressing a transfer */
+#define COMPRESS_READ_SIZE          16384
+/* compressed files that don't shrink below this percentage of their
+ * original size are sent uncompressed */
+#define COMPRESS_MAX_RATIO          90
+
+#ifdef HAVE_TOXAV
+/* bit rates in kbit/s */
+#define AV_AUDIO_BIT_RATE           48
+#define AV_VIDEO_BIT_RATE           2500
+#define AV_AUDIO_RATE               48000
+#define AV_AUDIO_CHANNELS           1
+#define AV_AUDIO_FRAME_SAMPLES      (AV_AUDIO_RATE / 1000 * 20)
+#define AV_VIDEO_WIDTH              640
+#define AV_VIDEO_HEIGHT             480
+/* bit rate adaptation: rates shrink multiplicatively while the peer
+ * reports loss or the jitter of what we receive grows, and come back
+ * additively once the link stayed clean for a few steps */
+#define AV_VIDEO_BIT_RATE_TCP       800
+#define AV_AUDIO_BIT_RATE_MIN       16
+#define AV_VIDEO_BIT_RATE_MIN       100
+#define AV_AUDIO_BIT_RATE_STEP      8
+#define AV_VIDEO_BIT_RATE_STEP      (AV_VIDEO_BIT_RATE / 10)
+/* percent of the rate kept on congestion */
+#define AV_ADAPT_DECREASE           75
+#define AV_ADAPT_LOSS_HIGH          10
+#define AV_ADAPT_LOSS_LOW           2
+#define AV_ADAPT_JITTER_HIGH        40
+#define AV_ADAPT_JITTER_LOW         15
+#define AV_ADAPT_STABLE_STEPS       3
+#define AV_JITTER_WEIGHT            16
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    #define AV_AUDIO_FORMAT         "S16LE"
+#else
+    #define AV_AUDIO_FORMAT         "S16BE"
+#endif
+#endif
+
+typedef struct
+{
+    gchar *nick;
+    gboolean ours;
+    /* list change this peer was last seen in */
+    guint generation;
+} toxprpl_conference_peer;
+
+typedef struct
+{
+    uint32_t conference_number;
+    /* peer public key (hex) -> toxprpl_conference_peer */
+    GHashTable *peers;
+    /* chat nick -> toxprpl_conference_peer, keeps nicks unique */
+    GHashTable *nicks;
+    /* peer number -> toxprpl_conference_peer, valid until the next change */
+    GPtrArray *by_number;
+    guint generation;
+} toxprpl_conference_data;
+
+/* an avatar transfer, kept in memory instead of going through PurpleXfer */
+typedef struct
+{
+    /* toxprpl_file_key(), also used as the hash table key */
+    guint64 key;
+    gboolean incoming;
+    uint8_t hash[TOX_HASH_LENGTH];
+    uint8_t *data;
+    uint64_t size;
+    uint64_t offset;
+} toxprpl_avatar_transfer;
+
+#define AVATAR_MAX_SIZE             65536
+#define AVATAR_CACHE_DIR            "avatars"
+/* blist setting holding the hash of the avatar last sent to a buddy */
+#define AVATAR_SENT_SETTING         "tox-avatar-sent"
+
+/* callbacks counted in toxprpl_stats */
+typedef enum
+{
+    TOXPRPL_CB_FRIEND_MESSAGE,
+    TOXPRPL_CB_FRIEND_NAME,
+    TOXPRPL_CB_FRIEND_STATUS,
+    TOXPRPL_CB_FRIEND_REQUEST,
+    TOXPRPL_CB_FRIEND_CONNECTION,
+    TOXPRPL_CB_FRIEND_TYPING,
+    TOXPRPL_CB_READ_RECEIPT,
+    TOXPRPL_CB_FRIEND_LOSSLESS_PACKET,
+    TOXPRPL_CB_FRIEND_LOSSY_PACKET,
+    TOXPRPL_CB_FILE_RECV,
+    TOXPRPL_CB_FILE_CONTROL,
+    TOXPRPL_CB_FILE_CHUNK_REQUEST,
+    TOXPRPL_CB_FILE_RECV_CHUNK,
+    TOXPRPL_CB_CONFERENCE_INVITE,
+    TOXPRPL_CB_CONFERENCE_MESSAGE,
+    TOXPRPL_CB_CONFERENCE_TITLE,
+    TOXPRPL_CB_CONFERENCE_PEER_NAME,
+    TOXPRPL_CB_CONFERENCE_PEER_LIST,
+    TOXPRPL_CB_CALL,
+    TOXPRPL_CB_CALL_STATE,
+    TOXPRPL_CB_COUNT
+} toxprpl_callback_type;
+
+static const char *toxprpl_callback_names[TOXPRPL_CB_COUNT] =
+{
+    "friend_message",
+    "friend_name",
+    "friend_status",
+    "friend_request",
+    "friend_connection",
+    "friend_typing",
+    "read_receipt",
+    "friend_lossless_packet",
+    "friend_lossy_packet",
+    "file_recv",
+    "file_control",
+    "file_chunk_request",
+    "file_recv_chunk",
+    "conference_invite",
+    "conference_message",
+    "conference_title",
+    "conference_peer_name",
+    "conference_peer_list",
+    "call",
+    "call_state"
+};
+
+/* per connection counters, shown by /toxstats */
+typedef struct
+{
+    gint64 started;
+    toxprpl_histogram iterate_usec;
+    /* tox_iterate() calls beyond the first one of a tick */
+    guint64 extra_iterations;
+    /* how much later than scheduled tox_iterate() ran */
+    toxprpl_histogram loop_lateness_msec;
+    guint64 callbacks[TOXPRPL_CB_COUNT];
+    guint64 messages_in;
+    guint64 messages_out;
+    guint64 bytes_in;
+    guint64 bytes_out;
+    guint64 file_bytes_in;
+    guint64 file_bytes_out;
+    /* transfers stalled by TOX_ERR_FILE_SEND_CHUNK_SENDQ, retries not
+     * counted */
+    guint64 sendq_full;
+    /* file transfers, avatars are counted on their own */
+    guint64 transfers_completed;
+    guint64 avatars_completed;
+    /* bytes not sent thanks to compressed transfers */
+    gint64 compression_saved;
+    guint64 raw_records_in;
+    guint64 raw_records_out;
+    guint64 raw_packets_out;
+    guint64 raw_dropped;
+    toxprpl_histogram save_usec;
+    toxprpl_histogram rtt_msec;
+    /* received messages written together with the previous one */
+    guint64 messages_coalesced;
+    guint64 im_writes;
+    /* presence and alias changes received and written to the buddy list */
+    guint64 presence_changes;
+    guint64 presence_writes;
+    guint64 requests_in;
+    guint64 requests_duplicate;
+    guint64 requests_dropped;
+    guint64 requests_accepted;
+    guint64 requests_rejected;
+    guint64 reconnects;
+    guint64 bootstraps;
+    guint64 network_changes;
+    toxprpl_histogram reconnect_msec;
+#ifdef HAVE_TOXAV
+    /* written by the AV thread */
+    toxprpl_histogram av_iterate_usec;
+    toxprpl_histogram av_lateness_msec;
+    /* also written by GStreamer's streaming threads */
+    volatile gint audio_frames_in;
+    volatile gint audio_frames_out;
+    volatile gint video_frames_in;
+    volatile gint video_frames_out;
+    /* bit rate adaptation steps */
+    guint64 av_rate_increases;
+    guint64 av_rate_decreases;
+    guint64 av_rate_caps;
+    toxprpl_histogram av_loss_percent;
+    toxprpl_histogram av_jitter_msec;
+    toxprpl_histogram av_audio_kbps;
+    toxprpl_histogram av_video_kbps;
+#endif
+} toxprpl_stats;
+
+#ifdef HAVE_TOXAV
+/* a call with one friend, shared with the AV thread and GStreamer's
+ * streaming threads and therefore reference counted */
+typedef struct
+{
+    volatile gint ref;
+    PurpleConnection *gc;
+    ToxAV *toxav;
+    toxprpl_stats *stats;
+    uint32_t friendnumber;
+    gchar *who;
+    gboolean video;
+    /* media is flowing */
+    gboolean active;
+    /* incoming call dialog */
+    gpointer request;
+    /* capture and playback pipelines, NULL if left out */
+    GstElement *audio_in;
+    GstElement *audio_out;
+    GstElement *video_in;
+    GstElement *video_out;
+    GstAppSrc *audio_src;
+    GstAppSrc *video_src;
+    /* only used by the audio capture thread */
+    int16_t audio_frame[AV_AUDIO_FRAME_SAMPLES * AV_AUDIO_CHANNELS];
+    size_t audio_buffered;
+    /* only used by the AV thread */
+    guint audio_channels;
+    guint audio_rate;
+    guint video_width;
+    guint video_height;
+    /* bit rate adaptation, guarded by the plugin's av_lock, the rates are
+     * the ones toxav currently encodes with */
+    guint audio_bit_rate;
+    guint video_bit_rate;
+    /* highest loss the peer reported since the last step */
+    float loss;
+    /* interarrival jitter of received audio frames */
+    gint64 jitter_usec;
+    gint64 audio_arrival;
+    guint stable_steps;
+} toxprpl_call;
+#endif
+
+/* upper bound for the time between two tox_iterate() calls, toxcore may
+ * ask for shorter intervals with tox_iteration_interval() */
+#define MESSENGER_LOOP_INTERVAL     80
+#define CONNECTION_CHECK_INTERVAL   2000
+/* default wall clock time in msec a tick may keep calling tox_iterate()
+ * while file data is moving, 0 means one call per tick */
+#define DEFAULT_ITERATE_BUDGET      20
+/* wakeups are rounded up to multiples of these, so that accounts with the
+ * same interval share the scheduler ticks */
+#define SCHEDULER_GRANULARITY       10
+#define CONNECTION_CHECK_GRANULARITY 1000
+/* after the DHT connection is lost the nodes are bootstrapped again right
+ * away, then with doubling delays up to the maximum, each off by up to a
+ * quarter either way so that clients behind the same outage spread out */
+#define REBOOTSTRAP_BASE_DELAY      2000
+#define REBOOTSTRAP_MAX_DELAY       300000
+#define REBOOTSTRAP_JITTER          25
+/* addresses of the configured node, so bootstrapping works without DNS */
+#define NODES_FILENAME              "nodes"
+#define NODES_CACHE_SIZE            8
+
+/* a DHT node to bootstrap from */
+typedef struct
+{
+    gchar *host;
+    uint16_t port;
+    uint8_t key[TOX_PUBLIC_KEY_SIZE];
+} toxprpl_node;
+
 typedef struct
 {
     Tox *tox;
-    guint tox_timer;
-    guint connection_timer;
+    /* monotonic times in usec, see toxprpl_scheduler_tick() */
+    gint64 next_iterate;
+    gint64 next_connection_check;
+    guint iterate_budget;
     guint connected;
+    /* the configured node followed by the cached ones */
+    GList *nodes;
+    gchar *nodes_path;
+    GCancellable *nodes_resolve;
+    /* when the DHT connection was lost, 0 while connected */
+    gint64 disconnected;
+    /* next re-bootstrap, 0 if none is due */
+    gint64 next_bootstrap;
+    guint bootstrap_attempts;
     PurpleCmdId myid_command_id;
     PurpleCmdId nick_command_id;
+    PurpleCmdId stats_command_id;
+    PurpleCmdId ping_command_id;
+#ifdef HAVE_TOXAV
+    PurpleCmdId hangup_command_id;
+#endif
+    toxprpl_stats stats;
+    /* offline message outbox, see toxprpl_outbox_load() */
+    GHashTable *outbox;
+    GHashTable *outbox_flush;
+    FILE *outbox_log;
+    gchar *outbox_path;
+    guint64 outbox_seq;
+    guint outbox_live;
+    guint outbox_dead;
+    guint outbox_timer;
+    /* friend number -> toxprpl_friend_data */
+    GHashTable *friends;
+    toxprpl_histogram receipt_latency;
+    guint64 receipts_evicted;
+    guint64 retransmits;
+    /* conference number -> toxprpl_conference_data */
+    GHashTable *conferences;
+    /* toxprpl_file_key() -> toxprpl_avatar_transfer */
+    GHashTable *avatar_transfers;
+    uint8_t *avatar;
+    size_t avatar_size;
+    uint8_t avatar_hash[TOX_HASH_LENGTH];
+    /* outgoing PurpleXfers with chunks waiting for toxcore's send queue */
+    GList *stalled_xfers;
+    /* buddy name -> toxprpl_send_queue */
+    GHashTable *send_queues;
+    guint send_slots;
+    gint compression_level;
+    /* numbers of friends with raw frames to flush */
+    GList *raw_pending;
+    /* numbers of friends with presence or alias changes to apply */
+    GList *presence_pending;
+    guint presence_timer;
+    /* friend requests waiting for a dialog */
+    GQueue *requests;
+    /* buddy key -> toxprpl_friend_request, queued, shown or accepted */
+    GHashTable *request_keys;
+    guint requests_shown;
+    /* request handed to libpurple right now, NULL once it was answered */
+    gpointer request_showing;
+    guint request_timer;
+    /* toxprpl_friend_request accepted, added together */
+    GQueue *accepted;
+    guint accept_timer;
+    /* toxprpl_inbound in arrival order, delivered at the end of the tick */
+    gboolean coalesce_messages;
+    GQueue *inbound;
+    /* friend number -> its batch still open for more messages */
+    GHashTable *inbound_open;
+#ifdef HAVE_TOXAV
+    ToxAV *toxav;
+    GThread *av_thread;
+    volatile gint av_running;
+    /* friend number -> toxprpl_call, av_lock guards it as the AV thread
+     * looks calls up as well */
+    GHashTable *calls;
+    GMutex av_lock;
+#endif
 } toxprpl_plugin_data;
 
+/* one timer drives all logged in accounts of the process */
+typedef struct
+{
+    /* PurpleConnection list */
+    GList *connections;
+    guint timer;
+    gint64 next_tick;
+} toxprpl_scheduler;
+
+static toxprpl_scheduler scheduler = { NULL, 0, 0 };
+
 typedef struct
 {
     PurpleXfer *xfer;
@@ -140,15 +683,62 @@ typedef struct
     gboolean running;
 } toxprpl_idle_write_data;
 
+/* a requested chunk that could not be sent yet, kept with its data so a
+ * retry doesn't read the file again */
+typedef struct
+{
+    uint64_t position;
+    size_t length;
+    uint8_t data[];
+} toxprpl_pending_chunk;
+
+/* an outgoing file read as a zlib stream, see toxprpl_deflate_read() */
+typedef struct
+{
+    GConverter *zlib;
+    FILE *in;
+    /* bytes read from the file and compressed so far */
+    guint64 in_size;
+    guint64 out_size;
+    /* compressed data, the first taken bytes were handed out already */
+    GByteArray *out;
+    gsize taken;
+    gboolean finished;
+} toxprpl_deflate_stream;
+
 typedef struct
 {
     Tox *tox;
     uint32_t friendnumber;
     uint32_t filenumber;
     toxprpl_idle_write_data *idle_write_data;
-    uint8_t *file_id;
+    uint8_t file_id[TOX_FILE_ID_LENGTH];
+    /* toxprpl_pending_chunk, oldest first */
+    GQueue pending;
+    /* BLAKE2b of the first digest_offset bytes, NULL once chunks arrived
+     * out of order, see toxprpl_xfer_digest_update() */
+    crypto_generichash_state *digest;
+    uint64_t digest_offset;
+    /* started from a toxprpl_send_queue */
+    gboolean queued;
+    /* outgoing: compresses the file as its chunks are requested */
+    toxprpl_deflate_stream *deflate;
+    /* incoming: decompresses the chunks of a compressed transfer */
+    GConverter *inflate;
+    uint64_t recv_offset;
+    /* incoming: the file the chunks are written to */
+    FILE *recv_fp;
+    /* incoming: where a resumed file waits for purple_xfer_start() */
+    gchar *resume_path;
 } toxprpl_xfer_data;
 
+/* partial-transfer record stored next to an incomplete incoming file:
+ * magic, file id, received bytes (big endian) and the digest state */
+#define PARTIAL_SUFFIX              ".toxpart"
+#define RESUME_SUFFIX               ".toxresume"
+#define PARTIAL_MAGIC               "TOXPART1"
+#define PARTIAL_MAGIC_LENGTH        8
+
 typedef struct
 {
     bool exists;
@@ -183,22 +773,81 @@ static toxprpl_status toxprpl_statuses[] =
 };
 
 /*
- * stores offline messages that haven't been delivered yet. maps username
- * (char *) to GList * of GOfflineMessages. initialized in toxprpl_init.
+ * messages to offline friends that haven't been delivered yet. every
+ * connection keeps a hash table in toxprpl_plugin_data->outbox which maps
+ * the buddy key (char *) to a GQueue * of GOfflineMessages in send order.
  */
-GHashTable* goffline_messages = NULL;
-
 typedef struct
 {
-    char *from;
+    guint64 seq;
+    TOX_MESSAGE_TYPE type;
     char *message;
     time_t mtime;
-    PurpleMessageFlags flags;
 } GOfflineMessage;
 
+#define OUTBOX_FILENAME             "outbox.log"
+/* rewrite the log once it holds more delivered records than pending ones */
+#define OUTBOX_COMPACT_MIN_DEAD     64
+/* pacing of the outbox flush: messages per tick and tick interval in ms */
+#define OUTBOX_FLUSH_BATCH          8
+#define OUTBOX_FLUSH_INTERVAL       50
+
+/* friend requests waiting for a dialog, more are dropped */
+#define REQUEST_QUEUE_SIZE          64
+/* dialogs open at the same time and the pace new ones appear at in ms */
+#define REQUEST_DIALOGS_MAX         3
+#define REQUEST_DIALOG_INTERVAL     2000
+/* accepted requests are collected this long in ms and added at once */
+#define REQUEST_ACCEPT_DELAY        1000
+#define DEFAULT_REQUEST_POLICY      "ask"
+
+/* an incoming friend request, queued or shown */
+typedef struct
+{
+    PurpleConnection *gc;
+    gchar *buddy_key;
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    gchar *message;
+    /* authorization dialog, NULL while queued */
+    gpointer ui;
+} toxprpl_friend_request;
+
+/* messages from a friend that arrive in the same tick are written to the
+ * conversation together, up to this many bytes per write */
+#define DEFAULT_COALESCE_MESSAGES   FALSE
+#define INBOUND_BATCH_MAX           16384
+
+/* messages of one friend received during a tick, see
+ * toxprpl_inbound_flush() */
+typedef struct
+{
+    uint32_t friendnumber;
+    GString *text;
+    time_t received;
+} toxprpl_inbound;
+
+/* default number of files sent to one buddy at the same time */
+#define DEFAULT_SEND_SLOTS          4
+
+/* files waiting to be sent to one buddy, see toxprpl_send_file() */
+typedef struct
+{
+    PurpleConnection *gc;
+    gchar *who;
+    /* local paths */
+    GQueue files;
+    guint in_flight;
+    guint files_total;
+    guint files_done;
+    guint64 bytes_total;
+    guint64 bytes_done;
+    guint pump_timer;
+} toxprpl_send_queue;
+
 static void toxprpl_login(PurpleAccount *acct);
 static void toxprpl_query_buddy_info(gpointer data, gpointer user_data);
 static void toxprpl_set_status(PurpleAccount *account, PurpleStatus *status);
+static void toxprpl_avatar_send(PurpleConnection *gc, uint32_t friendnumber);
 static PurpleXfer *toxprpl_new_xfer_receive(PurpleConnection *gc,
                                             const char *who,
                                             uint32_t friendnumber,
@@ -206,6 +855,17 @@ static PurpleXfer *toxprpl_new_xfer_receive(PurpleConnection *gc,
                                             const goffset filesize,
                                             const char *filename);
 static void toxprpl_user_export(PurpleConnection *gc, const char *filename);
+static void toxprpl_send_queue_done(PurpleXfer *xfer);
+static void toxprpl_send_queue_free(gpointer data);
+static guint64 toxprpl_take_compressed_file(toxprpl_plugin_data *plugin,
+                                            uint32_t fnum,
+                                            const uint8_t *file_id);
+static void toxprpl_sync_add_buddy(PurpleAccount *account, Tox *tox,
+                                   int friend_number);
+static gboolean toxprpl_save_account(PurpleAccount *account, Tox* tox);
+#ifdef HAVE_TOXAV
+static void toxprpl_av_adapt(PurpleConnection *gc);
+#endif
 static void toxprpl_user_import(PurpleAccount *acct, const char *filename,
                                 toxprpl_profile_data* profile);
 
@@ -281,20 +941,16 @@ void toxprpl_err_file_control(TOX_ERR_FILE_CONTROL err, PurpleConnection* gc)
     purple_notify_error(gc, _("Error"), msg, NULL);
 }
 
-// returned buffer must be freed by the caller
-static char *toxprpl_data_to_hex_string(const unsigned char *data,
-                                        const size_t len)
+// buf must hold at least (len * 2) + 1 bytes
+static void toxprpl_data_to_hex_buf(const unsigned char *data,
+                                    const size_t len, char *buf)
 {
-    unsigned char *chars;
     unsigned char hi, lo;
     size_t i;
-    char *buf = malloc((len * 2) + 1);
     char *p = buf;
-    chars = (unsigned char *)data;
-    chars = (unsigned char *)data;
     for (i = 0; i < len; i++)
     {
-        unsigned char c = chars[i];
+        unsigned char c = data[i];
         hi = c >> 4;
         lo = c & 0xF;
         *p = g_HEX_CHARS[hi];
@@ -303,6 +959,14 @@ static char *toxprpl_data_to_hex_string(const unsigned char *data,
         p++;
     }
     buf[len*2] = '\0';
+}
+
+// returned buffer must be freed by the caller
+static char *toxprpl_data_to_hex_string(const unsigned char *data,
+                                        const size_t len)
+{
+    char *buf = malloc((len * 2) + 1);
+    toxprpl_data_to_hex_buf(data, len, buf);
     return buf;
 }
 
@@ -343,6 +1007,252 @@ unsigned char *toxprpl_hex_string_to_data(const char *s)
     return buf;
 }
 
+static void toxprpl_histogram_add(toxprpl_histogram *h, guint64 value)
+{
+    guint bucket = (value == 0) ? 0 : g_bit_storage(value);
+    if (bucket >= TOXPRPL_HISTOGRAM_BUCKETS)
+    {
+        bucket = TOXPRPL_HISTOGRAM_BUCKETS - 1;
+    }
+
+    if ((h->count == 0) || (value < h->min))
+    {
+        h->min = value;
+    }
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+    h->count++;
+    h->sum += value;
+    h->buckets[bucket]++;
+}
+
+/* upper bound of the bucket holding the given percentile (0 - 100) */
+static guint64 toxprpl_histogram_percentile(const toxprpl_histogram *h,
+                                            double percentile)
+{
+    toxprpl_return_val_if_fail(h->count > 0, 0);
+
+    guint64 rank = (guint64)((h->count * percentile) / 100.0);
+    guint64 seen = 0;
+    guint i;
+    for (i = 0; i < TOXPRPL_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen > rank)
+        {
+            break;
+        }
+    }
+
+    if (i >= TOXPRPL_HISTOGRAM_BUCKETS - 1)
+    {
+        return h->max;
+    }
+    return MIN(((guint64)1 << i) - 1, h->max);
+}
+
+/* performance counters */
+
+static toxprpl_stats *toxprpl_stats_callback(gpointer user_data,
+                                             toxprpl_callback_type type)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(
+            (PurpleConnection *)user_data);
+    toxprpl_return_val_if_fail(plugin != NULL, NULL);
+    plugin->stats.callbacks[type]++;
+    return &plugin->stats;
+}
+
+static void toxprpl_stats_append_histogram(GString *out, const char *name,
+                                           const toxprpl_histogram *h,
+                                           const char *unit)
+{
+    g_string_append_printf(out, "%s: %" G_GUINT64_FORMAT " samples",
+                           name, h->count);
+    if (h->count > 0)
+    {
+        g_string_append_printf(out,
+                ", avg %" G_GUINT64_FORMAT " %s"
+                ", p50 <= %" G_GUINT64_FORMAT
+                ", p99 <= %" G_GUINT64_FORMAT
+                ", max %" G_GUINT64_FORMAT " %s",
+                h->sum / h->count, unit,
+                toxprpl_histogram_percentile(h, 50),
+                toxprpl_histogram_percentile(h, 99), h->max, unit);
+    }
+    g_string_append_c(out, '\n');
+}
+
+/* plain text report of all counters, one item per line */
+static gchar *toxprpl_stats_format(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_val_if_fail(plugin != NULL, NULL);
+    const toxprpl_stats *stats = &plugin->stats;
+    GString *out = g_string_new(NULL);
+    guint i;
+
+    g_string_append_printf(out, "uptime: %" G_GINT64_FORMAT " s\n",
+            (g_get_monotonic_time() - stats->started) / G_USEC_PER_SEC);
+    toxprpl_stats_append_histogram(out, "tox_iterate", &stats->iterate_usec,
+                                   "us");
+    g_string_append_printf(out, "extra iterations: %" G_GUINT64_FORMAT "\n",
+                           stats->extra_iterations);
+    toxprpl_stats_append_histogram(out, "messenger loop lateness",
+                                   &stats->loop_lateness_msec, "ms");
+
+    g_string_append(out, "callbacks:");
+    for (i = 0; i < TOXPRPL_CB_COUNT; i++)
+    {
+        g_string_append_printf(out, " %s=%" G_GUINT64_FORMAT,
+                               toxprpl_callback_names[i], stats->callbacks[i]);
+    }
+    g_string_append_c(out, '\n');
+
+    g_string_append_printf(out,
+            "messages in: %" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT " bytes) "
+            "in %" G_GUINT64_FORMAT " writes, %" G_GUINT64_FORMAT
+            " coalesced\n"
+            "messages out: %" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT
+            " bytes)\n"
+            "file data in: %" G_GUINT64_FORMAT " bytes\n"
+            "file data out: %" G_GUINT64_FORMAT " bytes\n"
+            "send queue full: %" G_GUINT64_FORMAT " times\n"
+            "transfers completed: %" G_GUINT64_FORMAT " files, %"
+            G_GUINT64_FORMAT " avatars\n"
+            "saved by compression: %" G_GINT64_FORMAT " bytes\n"
+            "raw records in: %" G_GUINT64_FORMAT "\n"
+            "raw records out: %" G_GUINT64_FORMAT " in %" G_GUINT64_FORMAT
+            " packets, %" G_GUINT64_FORMAT " dropped\n",
+            stats->messages_in, stats->bytes_in, stats->im_writes,
+            stats->messages_coalesced, stats->messages_out, stats->bytes_out,
+            stats->file_bytes_in, stats->file_bytes_out,
+            stats->sendq_full, stats->transfers_completed,
+            stats->avatars_completed, stats->compression_saved, stats->raw_records_in,
+            stats->raw_records_out, stats->raw_packets_out,
+            stats->raw_dropped);
+
+    PurpleAccount *account = purple_connection_get_account(gc);
+    GString *transfers = g_string_new(NULL);
+    guint active = 0;
+    GList *xfers;
+    for (xfers = purple_xfers_get_all(); xfers != NULL;
+         xfers = g_list_next(xfers))
+    {
+        PurpleXfer *xfer = xfers->data;
+        if ((purple_xfer_get_account(xfer) != account) ||
+            (purple_xfer_get_status(xfer) != PURPLE_XFER_STATUS_STARTED))
+        {
+            continue;
+        }
+        active++;
+        time_t elapsed = time(NULL) - purple_xfer_get_start_time(xfer);
+        g_string_append_printf(transfers,
+                "  %s %s %s: %zu of %zu bytes, %zu KiB/s\n",
+                purple_xfer_get_filename(xfer),
+                (purple_xfer_get_type(xfer) == PURPLE_XFER_SEND) ?
+                    "to" : "from",
+                purple_xfer_get_remote_user(xfer),
+                purple_xfer_get_bytes_sent(xfer), purple_xfer_get_size(xfer),
+                purple_xfer_get_bytes_sent(xfer) / 1024 /
+                    (size_t)MAX(elapsed, 1));
+    }
+    g_string_append_printf(out, "active transfers: %u\n%s", active,
+                           transfers->str);
+    g_string_free(transfers, TRUE);
+
+    if ((plugin->send_queues != NULL) &&
+        (g_hash_table_size(plugin->send_queues) > 0))
+    {
+        GHashTableIter iter;
+        gpointer value;
+        g_string_append(out, "send queues:\n");
+        g_hash_table_iter_init(&iter, plugin->send_queues);
+        while (g_hash_table_iter_next(&iter, NULL, &value))
+        {
+            toxprpl_send_queue *queue = value;
+            g_string_append_printf(out,
+                    "  %s: %u of %u files, %" G_GUINT64_FORMAT " of %"
+                    G_GUINT64_FORMAT " bytes, %u in flight\n",
+                    queue->who, queue->files_done, queue->files_total,
+                    queue->bytes_done, queue->bytes_total, queue->in_flight);
+        }
+    }
+
+    guint paths[TOXPRPL_PATH_COUNT] = { 0 };
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, plugin->friends);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        const toxprpl_friend_data *fdata = value;
+        if (fdata->connection < TOXPRPL_PATH_COUNT)
+        {
+            paths[fdata->connection]++;
+        }
+    }
+    g_string_append_printf(out, "friends online: %u over UDP, %u over TCP\n",
+                           paths[TOX_CONNECTION_UDP],
+                           paths[TOX_CONNECTION_TCP]);
+    toxprpl_stats_append_histogram(out, "friend RTT", &stats->rtt_msec, "ms");
+    g_string_append_printf(out,
+            "presence and alias changes: %" G_GUINT64_FORMAT
+            ", buddy list writes: %" G_GUINT64_FORMAT "\n",
+            stats->presence_changes, stats->presence_writes);
+    g_string_append_printf(out,
+            "friend requests: %" G_GUINT64_FORMAT ", duplicates: %"
+            G_GUINT64_FORMAT ", dropped: %" G_GUINT64_FORMAT
+            ", accepted: %" G_GUINT64_FORMAT ", rejected: %"
+            G_GUINT64_FORMAT "\n", stats->requests_in,
+            stats->requests_duplicate, stats->requests_dropped,
+            stats->requests_accepted, stats->requests_rejected);
+    g_string_append_printf(out,
+            "DHT reconnects: %" G_GUINT64_FORMAT ", bootstraps: %"
+            G_GUINT64_FORMAT ", network changes: %" G_GUINT64_FORMAT "\n",
+            stats->reconnects, stats->bootstraps, stats->network_changes);
+    toxprpl_stats_append_histogram(out, "time to reconnect",
+                                   &stats->reconnect_msec, "ms");
+
+#ifdef HAVE_TOXAV
+    if (plugin->calls != NULL)
+    {
+        g_mutex_lock(&plugin->av_lock);
+        guint calls = g_hash_table_size(plugin->calls);
+        g_mutex_unlock(&plugin->av_lock);
+        g_string_append_printf(out,
+                "calls: %u\n"
+                "audio frames in: %d, out: %d\n"
+                "video frames in: %d, out: %d\n", calls,
+                g_atomic_int_get(&stats->audio_frames_in),
+                g_atomic_int_get(&stats->audio_frames_out),
+                g_atomic_int_get(&stats->video_frames_in),
+                g_atomic_int_get(&stats->video_frames_out));
+        toxprpl_stats_append_histogram(out, "toxav_iterate",
+                                       &stats->av_iterate_usec, "us");
+        toxprpl_stats_append_histogram(out, "AV loop lateness",
+                                       &stats->av_lateness_msec, "ms");
+        g_string_append_printf(out,
+                "bit rate steps: %" G_GUINT64_FORMAT " up, %"
+                G_GUINT64_FORMAT " down, %" G_GUINT64_FORMAT
+                " capped for TCP\n", stats->av_rate_increases,
+                stats->av_rate_decreases, stats->av_rate_caps);
+        toxprpl_stats_append_histogram(out, "reported loss",
+                                       &stats->av_loss_percent, "%");
+        toxprpl_stats_append_histogram(out, "receive jitter",
+                                       &stats->av_jitter_msec, "ms");
+        toxprpl_stats_append_histogram(out, "audio bit rate",
+                                       &stats->av_audio_kbps, "kbit/s");
+        toxprpl_stats_append_histogram(out, "video bit rate",
+                                       &stats->av_video_kbps, "kbit/s");
+    }
+#endif
+
+    toxprpl_stats_append_histogram(out, "saves", &stats->save_usec, "us");
+    return g_string_free(out, FALSE);
+}
+
 // stay independent from the lib
 static int toxprpl_get_status_index(Tox *tox, int fnum, TOX_USER_STATUS status)
 {
@@ -393,783 +1303,5696 @@ static gchar *toxprpl_tox_friend_id_to_string(uint8_t *bin_id)
     return toxprpl_data_to_hex_string(bin_id, TOX_ADDRESS_SIZE);
 }
 
-/* tox specific stuff */
-static void on_connectionstatus(Tox *tox, uint32_t fnum, TOX_CONNECTION status,
-                                void *user_data)
+/* read receipts */
+
+static toxprpl_friend_data *toxprpl_get_friend_data(toxprpl_plugin_data *plugin,
+                                                    uint32_t fnum)
 {
-    PurpleConnection *gc = (PurpleConnection *)user_data;
-    int tox_status = TOXPRPL_STATUS_OFFLINE;
-    if (status != TOX_CONNECTION_NONE)
+    toxprpl_friend_data *fdata = g_hash_table_lookup(plugin->friends,
+                                                     GUINT_TO_POINTER(fnum));
+    if (fdata == NULL)
     {
-        tox_status = TOXPRPL_STATUS_ONLINE;
+        fdata = g_new0(toxprpl_friend_data, 1);
+        fdata->tox = plugin->tox;
+        fdata->friendnumber = fnum;
+        g_hash_table_insert(plugin->friends, GUINT_TO_POINTER(fnum), fdata);
     }
+    return fdata;
+}
 
-    purple_debug_info("toxprpl", "Friend status change: %d\n", status);
-    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
-    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
-    // ToDo: Hanndle err_back
-    if (tox_friend_get_public_key(tox, fnum, public_key, &err_back) != true)
+static void toxprpl_friend_data_free(gpointer data)
+{
+    toxprpl_friend_data *fdata = data;
+    if (fdata->typing_timer != 0)
     {
-        purple_debug_info("toxprpl", "Could not get id of friend #%d\n",
-                          fnum);
-        return;
+        purple_timeout_remove(fdata->typing_timer);
     }
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
-    PurpleAccount *account = purple_connection_get_account(gc);
-    purple_prpl_got_user_status(account, buddy_key,
-        toxprpl_statuses[tox_status].id, NULL);
-    g_free(buddy_key);
+    guint i;
+    for (i = 0; i < fdata->receipt_count; i++)
+    {
+        g_free(fdata->receipts[
+                (fdata->receipt_head + i) % RECEIPT_RING_SIZE].message);
+    }
+    g_slist_free_full(fdata->compressed_files, g_free);
+    g_free(fdata->buddy_key);
+    g_free(fdata->alias);
+    g_free(fdata->raw_frames[0]);
+    g_free(fdata->raw_frames[1]);
+    g_free(fdata);
 }
 
-static void on_request(struct Tox *tox, const uint8_t *public_key,
-                       const uint8_t *data, size_t length, void *user_data)
+/* buddy name of a friend, kept in the friend data after the first call */
+static const char *toxprpl_friend_buddy_key(toxprpl_plugin_data *plugin,
+                                            toxprpl_friend_data *fdata)
 {
-    purple_debug_info("toxprpl", "incoming friend request!\n");
-    PurpleConnection *gc = (PurpleConnection *)user_data;
-
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
-    purple_debug_info("toxprpl", "Buddy request from %s: %s\n",
-                      buddy_key, data);
+    if (fdata->buddy_key == NULL)
+    {
+        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+        TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
+        if (tox_friend_get_public_key(plugin->tox, fdata->friendnumber,
+                                      public_key, &err_back))
+        {
+            fdata->buddy_key = toxprpl_tox_bin_id_to_string(public_key);
+        }
+    }
+    return fdata->buddy_key;
+}
 
-    PurpleAccount *account = purple_connection_get_account(gc);
-    PurpleBuddy *buddy = purple_find_buddy(account, buddy_key);
-    if (buddy != NULL)
+static void toxprpl_receipt_track(toxprpl_plugin_data *plugin,
+                                  toxprpl_friend_data *fdata,
+                                  uint32_t message_id, TOX_MESSAGE_TYPE type,
+                                  const char *message, gint64 sent,
+                                  guint retransmits, guint64 outbox_seq)
+{
+    if (fdata->receipt_count == RECEIPT_RING_SIZE)
     {
-        purple_debug_info("toxprpl", "Buddy %s already in buddy list!\n",
-                          buddy_key);
-        g_free(buddy_key);
-        return;
+        /* friend is not acknowledging, stop tracking the oldest message */
+        g_free(fdata->receipts[fdata->receipt_head].message);
+        fdata->receipt_head = (fdata->receipt_head + 1) % RECEIPT_RING_SIZE;
+        fdata->receipt_count--;
+        plugin->receipts_evicted++;
     }
 
-    gchar *request_msg = NULL;
-    if (length > 0)
+    toxprpl_receipt *receipt = &fdata->receipts[
+            (fdata->receipt_head + fdata->receipt_count) % RECEIPT_RING_SIZE];
+    receipt->message_id = message_id;
+    receipt->type = type;
+    receipt->retransmits = retransmits;
+    receipt->sent = sent;
+    receipt->message = g_strdup(message);
+    receipt->outbox_seq = outbox_seq;
+    fdata->receipt_count++;
+}
+
+static uint32_t toxprpl_send_message_full(toxprpl_plugin_data *plugin,
+                                          uint32_t fnum, TOX_MESSAGE_TYPE type,
+                                          const char *message, gint64 sent,
+                                          guint retransmits,
+                                          guint64 outbox_seq,
+                                          TOX_ERR_FRIEND_SEND_MESSAGE *err)
+{
+    uint32_t message_id = tox_friend_send_message(plugin->tox, fnum, type,
+                                                  (const uint8_t *)message,
+                                                  strlen(message), err);
+    if (*err == TOX_ERR_FRIEND_SEND_MESSAGE_OK)
     {
-        request_msg = g_strndup((const gchar *)data, length);
+        plugin->stats.messages_out++;
+        plugin->stats.bytes_out += strlen(message);
+        toxprpl_receipt_track(plugin, toxprpl_get_friend_data(plugin, fnum),
+                              message_id, type, message, sent, retransmits,
+                              outbox_seq);
     }
+    return message_id;
+}
 
-    purple_account_request_authorization(account, buddy_key, NULL, NULL, NULL,
-                                         0, NULL, NULL, NULL);
-    g_free(request_msg);
+/* sends a message and remembers it until the read receipt arrives */
+static uint32_t toxprpl_send_message(toxprpl_plugin_data *plugin,
+                                     uint32_t fnum, TOX_MESSAGE_TYPE type,
+                                     const char *message,
+                                     TOX_ERR_FRIEND_SEND_MESSAGE *err)
+{
+    return toxprpl_send_message_full(plugin, fnum, type, message,
+                                     g_get_monotonic_time(), 0, 0, err);
 }
 
-static void on_incoming_message(Tox *tox, uint32_t friendnum,
-                                TOX_MESSAGE_TYPE type,
-                                const uint8_t *string,
-                                size_t length, void *user_data)
+static void toxprpl_outbox_done(toxprpl_plugin_data *plugin, guint64 seq);
+
+static void on_read_receipt(Tox *tox, uint32_t fnum, uint32_t message_id,
+                            void *user_data)
 {
-    /* TODO: Review if/else for overlapping content */
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_READ_RECEIPT);
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
 
-    if (type == TOX_MESSAGE_TYPE_NORMAL)
-    {
-        purple_debug_info("toxprpl", "Message received!\n");
-        PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_friend_data *fdata = g_hash_table_lookup(plugin->friends,
+                                                     GUINT_TO_POINTER(fnum));
+    toxprpl_return_if_fail(fdata != NULL);
 
-        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
-        TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
-        /* TODO: Hanndle err_back */
-        if (tox_friend_get_public_key(tox, friendnum, public_key,
-                                      &err_back) != true)
+    /* receipts arrive in send order, so this is almost always the head */
+    guint i;
+    for (i = 0; i < fdata->receipt_count; i++)
+    {
+        if (fdata->receipts[(fdata->receipt_head + i) % RECEIPT_RING_SIZE]
+                .message_id == message_id)
         {
-            purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                              friendnum);
-            return;
+            break;
         }
+    }
 
-        gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
-        gchar *safemsg = g_strndup((const char *)string, length);
-        serv_got_im(gc, buddy_key, safemsg, PURPLE_MESSAGE_RECV, time(NULL));
-        g_free(buddy_key);
-        g_free(safemsg);
+    if (i == fdata->receipt_count)
+    {
+        toxprpl_log_misc("untracked read receipt %u from friend #%u\n",
+                         message_id, fnum);
+        return;
     }
-    else if (type == TOX_MESSAGE_TYPE_ACTION)
+
+    toxprpl_receipt receipt = fdata->receipts[
+            (fdata->receipt_head + i) % RECEIPT_RING_SIZE];
+    for (; i + 1 < fdata->receipt_count; i++)
     {
-        purple_debug_info("toxprpl", "action received\n");
-        PurpleConnection *gc = (PurpleConnection *)user_data;
+        fdata->receipts[(fdata->receipt_head + i) % RECEIPT_RING_SIZE] =
+            fdata->receipts[(fdata->receipt_head + i + 1) % RECEIPT_RING_SIZE];
+    }
+    fdata->receipt_count--;
 
-        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
-        TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
-        /*TODO: Handle err_back */
-        if (tox_friend_get_public_key(tox, friendnum, public_key,
-                                      &err_back) != true )
-        {
-            purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                              friendnum);
-            return;
-        }
+    guint64 latency_ms = (g_get_monotonic_time() - receipt.sent) / 1000;
+    toxprpl_histogram_add(&plugin->receipt_latency, latency_ms);
+    if (receipt.outbox_seq != 0)
+    {
+        toxprpl_outbox_done(plugin, receipt.outbox_seq);
+    }
 
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
+    if (tox_friend_get_public_key(tox, fnum, public_key, &err_back))
+    {
         gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
-        gchar *safemsg = g_strndup((const char *)string, length);
-        gchar *message = g_strdup_printf("/me %s", safemsg);
-        g_free(safemsg);
+        purple_signal_emit(toxprpl_plugin, "message-delivered", gc,
+                           buddy_key, receipt.message, (guint)latency_ms);
 
-        serv_got_im(gc, buddy_key, message, PURPLE_MESSAGE_RECV, time(NULL));
+        /* libpurple can't mark a single message, so only point out the ones
+         * the user may have been waiting for */
+        if ((receipt.retransmits > 0) ||
+            (latency_ms >= RECEIPT_NOTICE_LATENCY))
+        {
+            PurpleAccount *account = purple_connection_get_account(gc);
+            PurpleConversation *conv = purple_find_conversation_with_account(
+                    PURPLE_CONV_TYPE_IM, buddy_key, account);
+            if (conv != NULL)
+            {
+                gchar *notice = g_strdup_printf(
+                        _("Message delivered after %.1f seconds."),
+                        latency_ms / 1000.0);
+                purple_conversation_write(conv, NULL, notice,
+                        PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG,
+                        time(NULL));
+                g_free(notice);
+            }
+        }
         g_free(buddy_key);
-        g_free(message);
     }
+    g_free(receipt.message);
 }
 
-static void on_nick_change(Tox *tox, uint32_t friendnum, const uint8_t *data,
-                           size_t length, void *user_data)
+/* resend everything that was not acknowledged before the friend went away */
+static void toxprpl_receipts_retransmit(toxprpl_plugin_data *plugin,
+                                        uint32_t fnum)
 {
-    purple_debug_info("toxprpl", "Nick change!\n");
-
-    PurpleConnection *gc = (PurpleConnection *)user_data;
-
-    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
-    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
-    // ToDo: Hanndle err_back
-    if (tox_friend_get_public_key(tox, friendnum, public_key,
-                                  &err_back) != true)
+    toxprpl_friend_data *fdata = g_hash_table_lookup(plugin->friends,
+                                                     GUINT_TO_POINTER(fnum));
+    if ((fdata == NULL) || (fdata->receipt_count == 0))
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnum);
         return;
     }
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
-    PurpleAccount *account = purple_connection_get_account(gc);
-    PurpleBuddy *buddy = purple_find_buddy(account, buddy_key);
-    if (buddy == NULL)
+    guint count = fdata->receipt_count;
+    toxprpl_receipt pending[RECEIPT_RING_SIZE];
+    guint i;
+    for (i = 0; i < count; i++)
     {
-        purple_debug_info("toxprpl", "Ignoring nick change because buddy %s "
-                          "was not found\n", buddy_key);
-        g_free(buddy_key);
-        return;
+        pending[i] = fdata->receipts[
+                (fdata->receipt_head + i) % RECEIPT_RING_SIZE];
     }
+    fdata->receipt_head = 0;
+    fdata->receipt_count = 0;
 
-    g_free(buddy_key);
-    gchar *safedata = g_strndup((const char *)data, length);
-    purple_blist_alias_buddy(buddy, safedata);
-    g_free(safedata);
-}
-
-static void on_status_change(struct Tox *tox, uint32_t friendnum,
-                             TOX_USER_STATUS userstatus,
-                             void *user_data)
-{
-    purple_debug_info("toxprpl", "Status change: %d\n", userstatus);
-    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
-    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
-    // ToDo: Hanndle err_back
-    if (tox_friend_get_public_key(tox, friendnum, public_key,
-                                  &err_back) != true)
+    toxprpl_log_misc("retransmitting %u unacknowledged messages "
+                     "to friend #%u\n", count, fnum);
+    for (i = 0; i < count; i++)
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnum);
-        return;
+        TOX_ERR_FRIEND_SEND_MESSAGE err_back;
+        toxprpl_send_message_full(plugin, fnum, pending[i].type,
+                                  pending[i].message, pending[i].sent,
+                                  pending[i].retransmits + 1,
+                                  pending[i].outbox_seq, &err_back);
+        if (err_back == TOX_ERR_FRIEND_SEND_MESSAGE_OK)
+        {
+            plugin->retransmits++;
+        }
+        else
+        {
+            /* keep it around for the next reconnect */
+            toxprpl_receipt_track(plugin, fdata, pending[i].message_id,
+                                  pending[i].type, pending[i].message,
+                                  pending[i].sent, pending[i].retransmits,
+                                  pending[i].outbox_seq);
+        }
+        g_free(pending[i].message);
     }
+}
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
+/* offline message outbox */
 
-    PurpleConnection *gc = (PurpleConnection *)user_data;
-    PurpleAccount *account = purple_connection_get_account(gc);
+/*
+ * The outbox is kept in memory and mirrored to an append-only log in the
+ * account directory. Every queued message is written as an "A" record:
+ *
+ *   A <seq> <buddy key> <message type> <mtime> <length>\n<message>\n
+ *
+ * and every delivered message as a "D <seq>\n" record once its read
+ * receipt arrives, so messages sent but not acknowledged before a crash
+ * are sent again on the next login. The log is compacted (rewritten with
+ * the pending messages only) on login and whenever the delivered records
+ * outnumber the pending ones.
+ */
+static void toxprpl_offline_message_free(GOfflineMessage *msg)
+{
+    g_free(msg->message);
+    g_free(msg);
+}
 
-    char* status = toxprpl_statuses[
-            toxprpl_get_status_index(tox, friendnum, userstatus)].id;
-    purple_debug_info("toxprpl", "Setting user status for user %s to %s\n",
-                      buddy_key, status);
-    purple_prpl_got_user_status(account, buddy_key, status, NULL);
-    g_free(buddy_key);
+static void toxprpl_outbox_queue_free(gpointer data)
+{
+    g_queue_free_full((GQueue *)data,
+                      (GDestroyNotify)toxprpl_offline_message_free);
 }
 
-/* TODO: create an inverted table to speed this up */
-static PurpleXfer *toxprpl_find_xfer(PurpleConnection *gc,
-                                     uint32_t friendnumber, uint32_t filenumber)
+static gboolean toxprpl_outbox_write_record(FILE *fp, const char *buddy_key,
+                                            GOfflineMessage *msg)
 {
-    PurpleAccount *account = purple_connection_get_account(gc);
-    toxprpl_return_val_if_fail(account != NULL, NULL);
-    GList *xfers = purple_xfers_get_all();
-    toxprpl_return_val_if_fail(xfers != NULL, NULL);
+    size_t len = strlen(msg->message);
+    if (fprintf(fp, "A %" G_GUINT64_FORMAT " %s %d %" G_GINT64_FORMAT
+                " %" G_GSIZE_FORMAT "\n", msg->seq, buddy_key, msg->type,
+                (gint64)msg->mtime, len) < 0)
+    {
+        return FALSE;
+    }
 
-    while (xfers != NULL && xfers->data != NULL)
+    if ((fwrite(msg->message, 1, len, fp) != len) || (fputc('\n', fp) == EOF))
     {
-        PurpleXfer *xfer = xfers->data;
-        toxprpl_xfer_data *xfer_data = xfer->data;
-        if (xfer_data != NULL &&
-            xfer_data->friendnumber == friendnumber &&
-            xfer_data->filenumber == filenumber)
-        {
-            return xfer;
-        }
-        xfers = g_list_next(xfers);
+        return FALSE;
     }
-    return NULL;
+    return TRUE;
 }
 
-void on_file_chunk_request(Tox *m, uint32_t friendnum, uint32_t filenum,
-                           uint64_t position, size_t length, void *userdata)
+static void toxprpl_outbox_compact(toxprpl_plugin_data *plugin)
 {
-    //purple_debug_info("toxprpl", "on_file_chunk_request\n");
-    PurpleConnection *gc = userdata;
-    toxprpl_return_if_fail(gc != NULL);
-
-    PurpleXfer* xfer = toxprpl_find_xfer(gc, friendnum, filenum);
-    if (length == 0)
-    {
-        purple_debug_info("toxprpl", "file successfully sent.\n");
-        purple_xfer_set_completed(xfer, TRUE);
-        purple_xfer_end(xfer);
-        return;
-    }
+    toxprpl_return_if_fail(plugin->outbox_path != NULL);
 
-    FILE* fp = fopen(xfer->local_filename, "r");
+    gchar *tmp_path = g_strconcat(plugin->outbox_path, ".tmp", NULL);
+    FILE *fp = g_fopen(tmp_path, "wb");
     if (fp == NULL)
     {
-        purple_debug_info("toxprpl", "file could not be opened.\n");
+        toxprpl_log_warning("could not compact outbox %s: %s\n",
+                            tmp_path, strerror(errno));
+        g_free(tmp_path);
         return;
     }
 
-    if (ftello(fp) != position)
+    /* messages waiting for their receipt were sent before the queued ones */
+    gboolean ok = TRUE;
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, plugin->friends);
+    while (ok && g_hash_table_iter_next(&iter, NULL, &value))
     {
-        while (fseeko(fp, position, SEEK_SET) == -1)
+        toxprpl_friend_data *fdata = value;
+        const char *buddy_key = toxprpl_friend_buddy_key(plugin, fdata);
+        guint i;
+        for (i = 0; ok && (buddy_key != NULL) && (i < fdata->receipt_count);
+             i++)
         {
-            if (errno != EAGAIN)
+            toxprpl_receipt *receipt = &fdata->receipts[
+                    (fdata->receipt_head + i) % RECEIPT_RING_SIZE];
+            if (receipt->outbox_seq != 0)
             {
-                perror("toxprpl: file");
-                return;
+                GOfflineMessage msg = { receipt->outbox_seq, receipt->type,
+                                        receipt->message, time(NULL) };
+                ok = toxprpl_outbox_write_record(fp, buddy_key, &msg);
             }
         }
     }
-    xfer->bytes_sent = position;
 
-    uint8_t send_data[length];
-    size_t send_length = fread(send_data, 1, sizeof(send_data), fp);
-    if (send_length != length)
+    g_hash_table_iter_init(&iter, plugin->outbox);
+    while (ok && g_hash_table_iter_next(&iter, &key, &value))
     {
-        purple_debug_info("toxprpl", "file read fail\n");
-        fclose(fp);
-        return;
+        GList *l;
+        for (l = g_queue_peek_head_link(value); ok && (l != NULL); l = l->next)
+        {
+            ok = toxprpl_outbox_write_record(fp, key, l->data);
+        }
     }
-    fclose(fp);
 
-    TOX_ERR_FILE_SEND_CHUNK err;
-    tox_file_send_chunk(m, friendnum, filenum, position, send_data,
-                        send_length, &err);
-    if (err != TOX_ERR_FILE_SEND_CHUNK_OK)
+    if ((fclose(fp) != 0) || !ok)
     {
-        purple_debug_info("toxprpl", "file chunk send fail\n");
+        toxprpl_log_warning("could not write outbox %s\n", tmp_path);
+        g_unlink(tmp_path);
+        g_free(tmp_path);
+        return;
     }
-    xfer->bytes_sent += send_length;
-    purple_xfer_update_progress(xfer);
-}
-
-void on_file_recv_chunk(Tox *m, uint32_t friendnum, uint32_t filenum,
-                        uint64_t position, const uint8_t* data, 
-                        size_t length, void *userdata)
-{
-    /* purple_debug_info("toxprpl", "on_file_recv_chunk\n"); */
-    PurpleConnection *gc = userdata;
-    toxprpl_return_if_fail(gc != NULL);
 
-    PurpleXfer* xfer = toxprpl_find_xfer(gc, friendnum, filenum);
-    if (length == 0)
+    if (plugin->outbox_log != NULL)
     {
-        purple_debug_info("toxprpl", "file successfully received.\n");
-        purple_xfer_set_completed(xfer, TRUE);
-        purple_xfer_end(xfer);
-        return;
+        fclose(plugin->outbox_log);
+        plugin->outbox_log = NULL;
     }
 
-    FILE* fp = fopen(xfer->local_filename, "a");
-    if (fp == NULL)
+    /* rename() does not replace existing files on Windows */
+    g_unlink(plugin->outbox_path);
+    if (g_rename(tmp_path, plugin->outbox_path) != 0)
     {
-        purple_debug_info("toxprpl", "file could not be opened for writing.\n");
-        return;
+        toxprpl_log_warning("could not replace outbox %s: %s\n",
+                            plugin->outbox_path, strerror(errno));
+    }
+    else
+    {
+        toxprpl_log_info("compacted outbox: %u pending, %u "
+                         "delivered records dropped\n", plugin->outbox_live,
+                         plugin->outbox_dead);
+        plugin->outbox_dead = 0;
     }
+    g_free(tmp_path);
+
+    plugin->outbox_log = g_fopen(plugin->outbox_path, "ab");
+}
 
-    while (fwrite(data, length, 1, fp) == -1)
+static void toxprpl_outbox_remove_seq(GQueue *queue, guint64 seq)
+{
+    /* delivery happens in order, so this is almost always the head */
+    GList *l;
+    for (l = g_queue_peek_head_link(queue); l != NULL; l = l->next)
     {
-        if (errno != EAGAIN)
+        GOfflineMessage *msg = l->data;
+        if (msg->seq == seq)
         {
-            perror("toxprpl: file");
-            fclose(fp);
+            toxprpl_offline_message_free(msg);
+            g_queue_delete_link(queue, l);
             return;
         }
     }
-    fclose(fp);
-
-    xfer->bytes_sent += length;
-    purple_xfer_update_progress(xfer);
 }
 
-static void on_file_control(Tox *tox, uint32_t friendnumber,
-                            uint32_t filenumber, TOX_FILE_CONTROL control_type,
-                            void *userdata)
+static void toxprpl_outbox_load(PurpleAccount *account,
+                                toxprpl_plugin_data *plugin)
 {
-    PurpleConnection *gc = userdata;
-    toxprpl_return_if_fail(gc != NULL);
-
-    PurpleXfer* xfer = toxprpl_find_xfer(gc, friendnumber, filenumber);
-    toxprpl_return_if_fail(xfer != NULL);
+    const char *key = purple_account_get_string(account, "account_path",
+                                                DEFAULT_ACCOUNT_PATH);
+    plugin->outbox = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           toxprpl_outbox_queue_free);
+    plugin->outbox_flush = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+    plugin->outbox_path = g_build_filename(purple_user_dir(), "tox", key,
+                                           OUTBOX_FILENAME, NULL);
+
+    FILE *fp = g_fopen(plugin->outbox_path, "rb");
+    if (fp == NULL)
+    {
+        plugin->outbox_log = g_fopen(plugin->outbox_path, "ab");
+        return;
+    }
 
-    switch(control_type)
+    /* maps sequence numbers to their queue, only needed while loading */
+    GHashTable *by_seq = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                               g_free, NULL);
+    guint records = 0;
+    char line[PATH_MAX_STRING_SIZE];
+    while (fgets(line, sizeof(line), fp) != NULL)
     {
-        case TOX_FILE_CONTROL_CANCEL:
-            purple_xfer_cancel_remote(xfer);
+        guint64 seq;
+        records++;
+        if (line[0] == 'D')
+        {
+            if (sscanf(line, "D %" G_GUINT64_FORMAT, &seq) != 1)
+            {
+                break;
+            }
+
+            GQueue *queue = g_hash_table_lookup(by_seq, &seq);
+            if (queue != NULL)
+            {
+                toxprpl_outbox_remove_seq(queue, seq);
+                plugin->outbox_live--;
+            }
+            continue;
+        }
+
+        char buddy_key[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        int type;
+        gint64 mtime;
+        gsize len;
+        if ((sscanf(line, "A %" G_GUINT64_FORMAT " %64s %d %" G_GINT64_FORMAT
+                    " %" G_GSIZE_FORMAT, &seq, buddy_key, &type, &mtime,
+                    &len) != 5) || (len > MAX_ACCOUNT_DATA_SIZE))
+        {
             break;
-        default:
-            /* TODO: handle TOX_FILE_CONTROL_RESUME / TOX_FILE_CONTROL_PAUSE */
+        }
+
+        gchar *message = g_malloc(len + 1);
+        if ((fread(message, 1, len, fp) != len) || (fgetc(fp) != '\n'))
+        {
+            /* record was truncated by a crash while appending */
+            g_free(message);
             break;
-    }
-}
+        }
+        message[len] = '\0';
 
-static void on_file_recv(Tox *tox, uint32_t friendnumber,
-                         uint32_t filenumber, uint32_t kind,
-                         uint64_t filesize, const uint8_t *filename,
-                         size_t filename_length, void *userdata)
-{
-    purple_debug_info("toxprpl", "file_send_request: %i %i\n", friendnumber,
-                      filenumber);
+        GOfflineMessage *msg = g_new0(GOfflineMessage, 1);
+        msg->seq = seq;
+        msg->type = (TOX_MESSAGE_TYPE)type;
+        msg->message = message;
+        msg->mtime = (time_t)mtime;
 
-    PurpleConnection *gc = userdata;
+        GQueue *queue = g_hash_table_lookup(plugin->outbox, buddy_key);
+        if (queue == NULL)
+        {
+            queue = g_queue_new();
+            g_hash_table_insert(plugin->outbox, g_strdup(buddy_key), queue);
+        }
+        g_queue_push_tail(queue, msg);
+        g_hash_table_insert(by_seq, g_memdup(&seq, sizeof(seq)), queue);
+        plugin->outbox_live++;
+        plugin->outbox_seq = MAX(plugin->outbox_seq, seq);
+    }
+    fclose(fp);
+    g_hash_table_destroy(by_seq);
 
-    /* TCS: Avatar 2.3.2 */
-    /* As we do not support avatars, we cancel the file as soon as possible.  */
-    if (kind == TOX_FILE_KIND_AVATAR)
+    /* drop queues of friends that have no pending messages left */
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, plugin->outbox);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
     {
-        TOX_ERR_FILE_CONTROL err_back;
-        tox_file_control(tox, friendnumber, filenumber, TOX_FILE_CONTROL_CANCEL,
-                         &err_back);
-        // we really don't care about the return code from tox_file_control
-        // since we wanted to cancel the transfer anyway
-        return;
+        if (g_queue_is_empty(value))
+        {
+            g_hash_table_iter_remove(&iter);
+        }
     }
 
-    toxprpl_return_if_fail(gc != NULL);
-    toxprpl_return_if_fail(filename != NULL);
-    toxprpl_return_if_fail(tox != NULL);
+    toxprpl_log_info("loaded outbox with %u pending messages\n",
+                     plugin->outbox_live);
 
-    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
-    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
-    /* ToDo: Hanndle err_back */
-    if (tox_friend_get_public_key(tox, friendnumber, public_key,
-                                  &err_back) != true)
+    /* start every session with a log that holds pending messages only */
+    plugin->outbox_dead = records - plugin->outbox_live;
+    if (plugin->outbox_dead > 0)
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnumber);
-        return;
+        toxprpl_outbox_compact(plugin);
     }
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
-
-    PurpleXfer *xfer = toxprpl_new_xfer_receive(gc, buddy_key, friendnumber,
-                                                filenumber, filesize, 
-                                                (const char*) filename);
-    if (xfer == NULL)
+    else
     {
-        purple_debug_warning("toxprpl", "could not create xfer\n");
-        g_free(buddy_key);
-        return;
+        plugin->outbox_log = g_fopen(plugin->outbox_path, "ab");
     }
-    toxprpl_return_if_fail(xfer != NULL);
-    toxprpl_xfer_data *xfer_data = xfer->data;
-    purple_debug_warning("toxprpl", "xfer fn/fn: %d %d %d %d\n",
-                         xfer_data->friendnumber, xfer_data->filenumber,
-                         friendnumber, filenumber);
-    purple_xfer_request(xfer);
-    g_free(buddy_key);
 }
 
-static void on_typing_change(Tox *tox, uint32_t friendnum, bool is_typing,
-                             void *userdata)
+static void toxprpl_outbox_free(toxprpl_plugin_data *plugin)
 {
-    purple_debug_info("toxprpl", "Friend typing status change: %d", friendnum);
-
-    PurpleConnection *gc = userdata;
-    toxprpl_return_if_fail(gc != NULL);
-
-    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
-    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
-    /* ToDo: Hanndle err_back */
-    if (tox_friend_get_public_key(tox, friendnum, public_key,
-                                  &err_back) != true)
+    if (plugin->outbox_timer != 0)
     {
-        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
-                          friendnum);
-        return;
+        purple_timeout_remove(plugin->outbox_timer);
+        plugin->outbox_timer = 0;
     }
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
-    PurpleAccount *account = purple_connection_get_account(gc);
-    PurpleBuddy *buddy = purple_find_buddy(account, buddy_key);
-    if (buddy == NULL)
+    if (plugin->outbox_log != NULL)
     {
-        purple_debug_info("toxprpl", "Ignoring typing change because buddy %s "
-                          "was not found\n", buddy_key);
-        g_free(buddy_key);
-        return;
+        fclose(plugin->outbox_log);
+        plugin->outbox_log = NULL;
     }
-    g_free(buddy_key);
 
-    if (is_typing)
+    if (plugin->outbox != NULL)
     {
-        serv_got_typing(gc, buddy->name, 5, PURPLE_TYPING);
-        /*                               ^ timeout for typing status
-         *                               (0 = disabled) */
+        g_hash_table_destroy(plugin->outbox);
+        plugin->outbox = NULL;
     }
-    else
+
+    if (plugin->outbox_flush != NULL)
     {
-        serv_got_typing_stopped(gc, buddy->name);
+        g_hash_table_destroy(plugin->outbox_flush);
+        plugin->outbox_flush = NULL;
     }
+
+    g_free(plugin->outbox_path);
+    plugin->outbox_path = NULL;
 }
 
-static gboolean tox_messenger_loop(gpointer data)
+static void toxprpl_outbox_add(toxprpl_plugin_data *plugin,
+                               const char *buddy_key, TOX_MESSAGE_TYPE type,
+                               const char *message)
 {
-    PurpleConnection *gc = (PurpleConnection *)data;
-    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
-    if ((plugin != NULL) && (plugin->tox != NULL))
+    GOfflineMessage *msg = g_new0(GOfflineMessage, 1);
+    msg->seq = ++plugin->outbox_seq;
+    msg->type = type;
+    msg->message = g_strdup(message);
+    msg->mtime = time(NULL);
+
+    GQueue *queue = g_hash_table_lookup(plugin->outbox, buddy_key);
+    if (queue == NULL)
     {
-        tox_iterate(plugin->tox);
+        queue = g_queue_new();
+        g_hash_table_insert(plugin->outbox, g_strdup(buddy_key), queue);
     }
-    return TRUE;
+    g_queue_push_tail(queue, msg);
+    plugin->outbox_live++;
+
+    if ((plugin->outbox_log == NULL) ||
+        !toxprpl_outbox_write_record(plugin->outbox_log, buddy_key, msg) ||
+        (fflush(plugin->outbox_log) != 0))
+    {
+        toxprpl_log_warning("could not append to outbox %s, "
+                            "message will be lost on exit\n",
+                            plugin->outbox_path);
+    }
+
+    toxprpl_log_misc("queued offline message #%" G_GUINT64_FORMAT
+                     " for %s\n", msg->seq, buddy_key);
 }
 
-static void toxprpl_set_nick_action(PurpleConnection *gc, const char *nickname)
+/* closes the log record of a message that needs no delivery anymore */
+static void toxprpl_outbox_done(toxprpl_plugin_data *plugin, guint64 seq)
 {
-    PurpleAccount *account = purple_connection_get_account(gc);
-    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
-    if (nickname != NULL)
+    if ((plugin->outbox_log == NULL) ||
+        (fprintf(plugin->outbox_log, "D %" G_GUINT64_FORMAT "\n", seq) < 0) ||
+        (fflush(plugin->outbox_log) != 0))
     {
-        purple_connection_set_display_name(gc, nickname);
-        TOX_ERR_SET_INFO err_back;
-        /* TODO: Handle err_back */
-        tox_self_set_name(plugin->tox, (uint8_t *)nickname,
-                          strlen(nickname) + 1, &err_back);
-        purple_account_set_string(account, "nickname", nickname);
+        toxprpl_log_misc("could not mark outbox message #%" G_GUINT64_FORMAT
+                         " delivered\n", seq);
     }
+    plugin->outbox_live--;
+    plugin->outbox_dead++;
 }
 
-static gboolean tox_connection_check(gpointer gc)
+static gboolean toxprpl_outbox_flush_cb(gpointer data)
 {
+    PurpleConnection *gc = (PurpleConnection *)data;
     toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_val_if_fail(plugin != NULL && plugin->tox != NULL, FALSE);
 
-    if ((plugin->connected == 0) && tox_self_get_connection_status(plugin->tox))
+    guint budget = OUTBOX_FLUSH_BATCH;
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, plugin->outbox_flush);
+    while ((budget > 0) && g_hash_table_iter_next(&iter, &key, &value))
     {
-        plugin->connected = 1;
-        purple_connection_update_progress(gc, _("Connected"),
-                1,   /* which connection step this is */
-                2);  /* total number of steps */
-        purple_connection_set_state(gc, PURPLE_CONNECTED);
-        purple_debug_info("toxprpl", "DHT connected!\n");
-
-        /* query status of all buddies */
-        PurpleAccount *account = purple_connection_get_account(gc);
-        GSList *buddy_list = purple_find_buddies(account, NULL);
-        g_slist_foreach(buddy_list, toxprpl_query_buddy_info, gc);
-        g_slist_free(buddy_list);
+        uint32_t fnum = GPOINTER_TO_UINT(value);
+        GQueue *queue = g_hash_table_lookup(plugin->outbox, key);
+        gboolean done = TRUE;
 
-        uint8_t our_name[TOX_MAX_NAME_LENGTH + 1];
-        tox_self_get_name(plugin->tox, our_name);
-        size_t name_len = tox_self_get_name_size(plugin->tox);
-        /* bug in the library? */
-        if (name_len == 0)
+        while ((queue != NULL) && !g_queue_is_empty(queue) && (budget > 0))
         {
-            our_name[0] = '\0';
+            GOfflineMessage *msg = g_queue_peek_head(queue);
+            TOX_ERR_FRIEND_SEND_MESSAGE err_back;
+            toxprpl_send_message_full(plugin, fnum, msg->type, msg->message,
+                                      g_get_monotonic_time(), 0, msg->seq,
+                                      &err_back);
+            if (err_back == TOX_ERR_FRIEND_SEND_MESSAGE_SENDQ)
+            {
+                /* try again on the next tick, keep the order */
+                done = FALSE;
+                budget = 0;
+                break;
+            }
+            else if (err_back == TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_CONNECTED)
+            {
+                /* gone again, flush will restart on the next connect */
+                break;
+            }
+            else if (err_back != TOX_ERR_FRIEND_SEND_MESSAGE_OK)
+            {
+                toxprpl_log_warning("dropping undeliverable "
+                                    "offline message #%" G_GUINT64_FORMAT
+                                    " for %s (%d)\n", msg->seq,
+                                    (const char *)key, err_back);
+                toxprpl_outbox_done(plugin, msg->seq);
+            }
+            /* a sent message stays in the log until its read receipt */
+            toxprpl_offline_message_free(g_queue_pop_head(queue));
+            budget--;
+        }
+
+        if ((queue != NULL) && g_queue_is_empty(queue))
+        {
+            g_hash_table_remove(plugin->outbox, key);
+        }
+        else if ((queue != NULL) && (budget == 0))
+        {
+            done = FALSE;
+        }
+
+        if (done)
+        {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+
+    if ((plugin->outbox_dead >= OUTBOX_COMPACT_MIN_DEAD) &&
+        (plugin->outbox_dead > plugin->outbox_live))
+    {
+        toxprpl_outbox_compact(plugin);
+    }
+
+    if (g_hash_table_size(plugin->outbox_flush) == 0)
+    {
+        plugin->outbox_timer = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* called when a friend comes online, delivers the outbox in the background */
+static void toxprpl_outbox_schedule_flush(PurpleConnection *gc,
+                                          const char *buddy_key, uint32_t fnum)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL && plugin->outbox != NULL);
+
+    if (!g_hash_table_lookup(plugin->outbox, buddy_key))
+    {
+        return;
+    }
+
+    toxprpl_log_misc("flushing outbox of %s\n", buddy_key);
+    g_hash_table_replace(plugin->outbox_flush, g_strdup(buddy_key),
+                         GUINT_TO_POINTER(fnum));
+    if (plugin->outbox_timer == 0)
+    {
+        plugin->outbox_timer = purple_timeout_add(OUTBOX_FLUSH_INTERVAL,
+                                                  toxprpl_outbox_flush_cb, gc);
+    }
+}
+
+/* keep unacknowledged messages across restarts by moving them to the outbox */
+static void toxprpl_receipts_to_outbox(toxprpl_plugin_data *plugin)
+{
+    GHashTableIter iter;
+    gpointer value;
+    guint moved = 0;
+    g_hash_table_iter_init(&iter, plugin->friends);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_friend_data *fdata = value;
+        if (fdata->receipt_count == 0)
+        {
+            continue;
+        }
+
+        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+        TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
+        if (!tox_friend_get_public_key(plugin->tox, fdata->friendnumber,
+                                       public_key, &err_back))
+        {
+            continue;
+        }
+
+        gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
+        GQueue *queue = g_hash_table_lookup(plugin->outbox, buddy_key);
+        if (queue == NULL)
+        {
+            queue = g_queue_new();
+            g_hash_table_insert(plugin->outbox, g_strdup(buddy_key), queue);
+        }
+
+        /* newest first, so they end up in front of the outbox in order */
+        while (fdata->receipt_count > 0)
+        {
+            fdata->receipt_count--;
+            toxprpl_receipt *receipt = &fdata->receipts[
+                (fdata->receipt_head + fdata->receipt_count)
+                    % RECEIPT_RING_SIZE];
+
+            GOfflineMessage *msg = g_new0(GOfflineMessage, 1);
+            msg->seq = receipt->outbox_seq;
+            msg->type = receipt->type;
+            msg->message = receipt->message;
+            msg->mtime = time(NULL);
+            receipt->message = NULL;
+            if (msg->seq == 0)
+            {
+                /* sent directly, not in the log yet */
+                msg->seq = ++plugin->outbox_seq;
+                plugin->outbox_live++;
+            }
+            g_queue_push_head(queue, msg);
+            moved++;
+        }
+        g_free(buddy_key);
+    }
+
+    if (moved > 0)
+    {
+        toxprpl_log_info("moved %u unacknowledged messages to "
+                         "the outbox\n", moved);
+        toxprpl_outbox_compact(plugin);
+    }
+}
+
+/* tox specific stuff */
+/* custom packets */
+
+/*
+ * tox-prpl instances tell each other what they support with a
+ * TOXPRPL_PACKET_CAPS lossless packet when a friend comes online, and
+ * answer one they receive if they did not send theirs yet. Other clients
+ * ignore the packet, so anything optional has to wait for the answer.
+ */
+static void toxprpl_send_caps(toxprpl_plugin_data *plugin, uint32_t fnum)
+{
+    uint8_t packet[] =
+    {
+        TOXPRPL_PACKET_CAPS,
+        TOXPRPL_PACKET_VERSION,
+        TOXPRPL_CAP_FRAMES | TOXPRPL_CAP_PING |
+            ((plugin->compression_level > 0) ? TOXPRPL_CAP_ZLIB : 0)
+    };
+
+    toxprpl_friend_data *fdata = toxprpl_get_friend_data(plugin, fnum);
+    TOX_ERR_FRIEND_CUSTOM_PACKET err_back;
+    fdata->caps_sent = tox_friend_send_lossless_packet(plugin->tox, fnum,
+                                                       packet, sizeof(packet),
+                                                       &err_back);
+}
+
+/* raw packets */
+
+/*
+ * send_raw() gives bots a way around the IM path: the buffer is the
+ * friend's public key followed by a complete Tox custom packet, whose id
+ * has to be in one of the TOXPRPL_PACKET_RAW or TOXPRPL_PACKET_LOSSY
+ * ranges and decides whether it is sent lossless or lossy. Received ones
+ * are handed to raw-received subscribers straight from toxcore's buffer.
+ *
+ * Records for friends that run tox-prpl are collected into one frame per
+ * friend and kind until the next scheduler tick, so many small requests
+ * cost one packet. Other clients get one plain packet per record.
+ */
+static void toxprpl_scheduler_wake(toxprpl_plugin_data *plugin);
+
+static void toxprpl_raw_emit(PurpleConnection *gc, uint32_t fnum, guint id,
+                             const uint8_t *data, size_t length)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    /* looked up every time, a subscriber may have removed the buddy */
+    toxprpl_friend_data *fdata = toxprpl_get_friend_data(plugin, fnum);
+    const char *buddy_key = toxprpl_friend_buddy_key(plugin, fdata);
+    toxprpl_return_if_fail(buddy_key != NULL);
+
+    plugin->stats.raw_records_in++;
+    purple_signal_emit(toxprpl_plugin, "raw-received", gc, buddy_key, data,
+                       (guint)length, id);
+}
+
+static void toxprpl_raw_receive(PurpleConnection *gc, uint32_t fnum,
+                                const uint8_t *data, size_t length)
+{
+    if ((data[0] != TOXPRPL_PACKET_FRAME) &&
+        (data[0] != TOXPRPL_PACKET_LOSSY_FRAME))
+    {
+        toxprpl_raw_emit(gc, fnum, data[0], data + 1, length - 1);
+        return;
+    }
+
+    size_t offset = 1;
+    while (offset + RAW_RECORD_HEADER <= length)
+    {
+        size_t record = (data[offset + 1] << 8) | data[offset + 2];
+        if (offset + RAW_RECORD_HEADER + record > length)
+        {
+            toxprpl_log_misc("truncated raw frame from friend #%u\n", fnum);
+            break;
+        }
+        toxprpl_raw_emit(gc, fnum, data[offset],
+                         data + offset + RAW_RECORD_HEADER, record);
+        offset += RAW_RECORD_HEADER + record;
+    }
+}
+
+static TOX_ERR_FRIEND_CUSTOM_PACKET toxprpl_raw_send_packet(
+        toxprpl_plugin_data *plugin, uint32_t fnum, const uint8_t *packet,
+        size_t length)
+{
+    TOX_ERR_FRIEND_CUSTOM_PACKET err_back;
+    if (packet[0] >= TOXPRPL_PACKET_LOSSY_FRAME)
+    {
+        tox_friend_send_lossy_packet(plugin->tox, fnum, packet, length,
+                                     &err_back);
+    }
+    else
+    {
+        tox_friend_send_lossless_packet(plugin->tox, fnum, packet, length,
+                                        &err_back);
+    }
+    if (err_back == TOX_ERR_FRIEND_CUSTOM_PACKET_OK)
+    {
+        plugin->stats.raw_packets_out++;
+    }
+    return err_back;
+}
+
+/* sends the collected lossless or lossy frame of a friend, returns FALSE
+ * if toxcore's send queue was full and it has to be tried again */
+static gboolean toxprpl_raw_flush_frame(toxprpl_plugin_data *plugin,
+                                        toxprpl_friend_data *fdata,
+                                        guint lossy)
+{
+    uint8_t *frame = fdata->raw_frames[lossy];
+    size_t length = fdata->raw_length[lossy];
+    if (length == 0)
+    {
+        return TRUE;
+    }
+
+    TOX_ERR_FRIEND_CUSTOM_PACKET err_back;
+    if (fdata->raw_records[lossy] == 1)
+    {
+        /* a single record goes out as a plain packet */
+        uint8_t saved = frame[RAW_RECORD_HEADER];
+        frame[RAW_RECORD_HEADER] = frame[1];
+        err_back = toxprpl_raw_send_packet(plugin, fdata->friendnumber,
+                                           frame + RAW_RECORD_HEADER,
+                                           length - RAW_RECORD_HEADER);
+        frame[RAW_RECORD_HEADER] = saved;
+    }
+    else
+    {
+        err_back = toxprpl_raw_send_packet(plugin, fdata->friendnumber,
+                                           frame, length);
+    }
+
+    if ((err_back == TOX_ERR_FRIEND_CUSTOM_PACKET_SENDQ) && !lossy)
+    {
+        return FALSE;
+    }
+    if (err_back != TOX_ERR_FRIEND_CUSTOM_PACKET_OK)
+    {
+        toxprpl_log_misc("dropping %u raw record(s) for friend #%u (%d)\n",
+                         fdata->raw_records[lossy], fdata->friendnumber,
+                         err_back);
+        plugin->stats.raw_dropped += fdata->raw_records[lossy];
+    }
+    fdata->raw_length[lossy] = 0;
+    fdata->raw_records[lossy] = 0;
+    return TRUE;
+}
+
+/* sends all collected frames, called before each tox_iterate() */
+static void toxprpl_raw_flush(toxprpl_plugin_data *plugin)
+{
+    GList *pending = plugin->raw_pending;
+    GList *l;
+    plugin->raw_pending = NULL;
+
+    for (l = pending; l != NULL; l = g_list_next(l))
+    {
+        toxprpl_friend_data *fdata = g_hash_table_lookup(plugin->friends,
+                                                         l->data);
+        if (fdata == NULL)
+        {
+            continue;
+        }
+        gboolean lossless_sent = toxprpl_raw_flush_frame(plugin, fdata, 0);
+        toxprpl_raw_flush_frame(plugin, fdata, 1);
+        if (!lossless_sent)
+        {
+            plugin->raw_pending = g_list_prepend(plugin->raw_pending,
+                                                 l->data);
+        }
+    }
+    g_list_free(pending);
+}
+
+static int toxprpl_send_raw(PurpleConnection *gc, const char *buf, int len)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_val_if_fail(plugin != NULL && buf != NULL, -1);
+    if ((len <= TOX_PUBLIC_KEY_SIZE) ||
+        (len > TOX_PUBLIC_KEY_SIZE + TOX_MAX_CUSTOM_PACKET_SIZE))
+    {
+        return -1;
+    }
+
+    TOX_ERR_FRIEND_BY_PUBLIC_KEY err_friend;
+    uint32_t fnum = tox_friend_by_public_key(plugin->tox,
+                                             (const uint8_t *)buf,
+                                             &err_friend);
+    if (err_friend != TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK)
+    {
+        return -1;
+    }
+
+    const uint8_t *packet = (const uint8_t *)buf + TOX_PUBLIC_KEY_SIZE;
+    size_t length = len - TOX_PUBLIC_KEY_SIZE;
+    guint lossy;
+    if ((packet[0] >= TOXPRPL_PACKET_RAW_FIRST) &&
+        (packet[0] <= TOXPRPL_PACKET_RAW_LAST))
+    {
+        lossy = 0;
+    }
+    else if ((packet[0] >= TOXPRPL_PACKET_LOSSY_FIRST) &&
+             (packet[0] <= TOXPRPL_PACKET_LOSSY_LAST))
+    {
+        lossy = 1;
+    }
+    else
+    {
+        toxprpl_log_misc("raw packet id %u is reserved\n", packet[0]);
+        return -1;
+    }
+
+    toxprpl_friend_data *fdata = toxprpl_get_friend_data(plugin, fnum);
+    size_t record = length - 1;
+    if (!(fdata->peer_caps & TOXPRPL_CAP_FRAMES) ||
+        (record > RAW_RECORD_MAX))
+    {
+        /* records collected before this one go first, lossless ones
+         * would arrive out of order otherwise */
+        if (!toxprpl_raw_flush_frame(plugin, fdata, lossy))
+        {
+            plugin->stats.raw_dropped++;
+            return -1;
+        }
+        /* straight from the caller's buffer */
+        if (toxprpl_raw_send_packet(plugin, fnum, packet, length) !=
+            TOX_ERR_FRIEND_CUSTOM_PACKET_OK)
+        {
+            plugin->stats.raw_dropped++;
+            return -1;
+        }
+        plugin->stats.raw_records_out++;
+        return len;
+    }
+
+    if ((fdata->raw_length[lossy] + RAW_RECORD_HEADER + record >
+         TOX_MAX_CUSTOM_PACKET_SIZE) &&
+        !toxprpl_raw_flush_frame(plugin, fdata, lossy))
+    {
+        /* the caller has to try again later */
+        plugin->stats.raw_dropped++;
+        return -1;
+    }
+
+    if (fdata->raw_frames[lossy] == NULL)
+    {
+        fdata->raw_frames[lossy] = g_malloc(TOX_MAX_CUSTOM_PACKET_SIZE);
+    }
+    uint8_t *frame = fdata->raw_frames[lossy];
+    if (fdata->raw_length[lossy] == 0)
+    {
+        frame[0] = lossy ? TOXPRPL_PACKET_LOSSY_FRAME : TOXPRPL_PACKET_FRAME;
+        fdata->raw_length[lossy] = 1;
+    }
+    uint8_t *header = frame + fdata->raw_length[lossy];
+    header[0] = packet[0];
+    header[1] = record >> 8;
+    header[2] = record & 0xff;
+    memcpy(header + RAW_RECORD_HEADER, packet + 1, record);
+    fdata->raw_length[lossy] += RAW_RECORD_HEADER + record;
+    fdata->raw_records[lossy]++;
+    plugin->stats.raw_records_out++;
+
+    if (g_list_find(plugin->raw_pending, GUINT_TO_POINTER(fnum)) == NULL)
+    {
+        plugin->raw_pending = g_list_prepend(plugin->raw_pending,
+                                             GUINT_TO_POINTER(fnum));
+    }
+    toxprpl_scheduler_wake(plugin);
+    return len;
+}
+
+/* link telemetry */
+
+/*
+ * toxcore tells on_connectionstatus whether a friend is reached directly
+ * over UDP or relayed over TCP, the time spent on each path is summed up
+ * per friend. Online friends running tox-prpl are also probed for the
+ * round trip time with lossy TOXPRPL_PACKET_PING packets they answer with
+ * a TOXPRPL_PACKET_PONG. Both show up in the buddy tooltip and /toxping
+ * sends a probe right away.
+ */
+static void toxprpl_link_update(toxprpl_plugin_data *plugin, uint32_t fnum,
+                                TOX_CONNECTION connection)
+{
+    toxprpl_friend_data *fdata = toxprpl_get_friend_data(plugin, fnum);
+    gint64 now = g_get_monotonic_time();
+
+    if ((fdata->connection_since != 0) &&
+        (fdata->connection < TOXPRPL_PATH_COUNT))
+    {
+        fdata->path_usec[fdata->connection] += now - fdata->connection_since;
+    }
+    fdata->connection = connection;
+    fdata->connection_since = now;
+
+    /* a changed path makes the last measurements meaningless */
+    fdata->ping_sent = 0;
+    fdata->ping_report = FALSE;
+    fdata->rtt_usec = 0;
+    fdata->rtt_avg_usec = 0;
+    /* give the capability handshake some time */
+    fdata->next_ping = now + PING_TIMEOUT * 1000;
+}
+
+/* time the friend spent on a path including the current stretch */
+static gint64 toxprpl_link_path_usec(const toxprpl_friend_data *fdata,
+                                     TOX_CONNECTION path, gint64 now)
+{
+    gint64 usec = fdata->path_usec[path];
+    if ((fdata->connection == path) && (fdata->connection_since != 0))
+    {
+        usec += now - fdata->connection_since;
+    }
+    return usec;
+}
+
+static gboolean toxprpl_link_ping(toxprpl_plugin_data *plugin,
+                                  toxprpl_friend_data *fdata)
+{
+    uint8_t packet[PING_PACKET_SIZE];
+    guint32 seq = GUINT32_TO_BE(fdata->ping_seq + 1);
+    packet[0] = TOXPRPL_PACKET_PING;
+    memcpy(packet + 1, &seq, sizeof(seq));
+
+    TOX_ERR_FRIEND_CUSTOM_PACKET err_back;
+    if (!tox_friend_send_lossy_packet(plugin->tox, fdata->friendnumber,
+                                      packet, sizeof(packet), &err_back))
+    {
+        toxprpl_log_misc("could not ping friend #%u (%d)\n",
+                         fdata->friendnumber, err_back);
+        return FALSE;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    fdata->ping_seq++;
+    fdata->ping_sent = now;
+    fdata->next_ping = now + PING_INTERVAL * 1000;
+    return TRUE;
+}
+
+/* writes the result of a /toxping to the conversation with the friend */
+static void toxprpl_link_report(PurpleConnection *gc,
+                                toxprpl_friend_data *fdata,
+                                const char *message)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    const char *buddy_key = toxprpl_friend_buddy_key(plugin, fdata);
+    fdata->ping_report = FALSE;
+    if (buddy_key == NULL)
+    {
+        return;
+    }
+
+    PurpleConversation *conv = purple_find_conversation_with_account(
+            PURPLE_CONV_TYPE_IM, buddy_key,
+            purple_connection_get_account(gc));
+    if (conv != NULL)
+    {
+        purple_conversation_write(conv, NULL, message,
+                                  PURPLE_MESSAGE_SYSTEM |
+                                  PURPLE_MESSAGE_NO_LOG, time(NULL));
+    }
+}
+
+static void toxprpl_link_pong(PurpleConnection *gc, uint32_t fnum,
+                              const uint8_t *data, size_t length)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_friend_data *fdata = g_hash_table_lookup(plugin->friends,
+                                                     GUINT_TO_POINTER(fnum));
+    guint32 seq;
+    if ((fdata == NULL) || (length != PING_PACKET_SIZE))
+    {
+        return;
+    }
+    memcpy(&seq, data + 1, sizeof(seq));
+    if ((fdata->ping_sent == 0) || (GUINT32_FROM_BE(seq) != fdata->ping_seq))
+    {
+        toxprpl_log_trace("late pong from friend #%u\n", fnum);
+        return;
+    }
+
+    fdata->rtt_usec = g_get_monotonic_time() - fdata->ping_sent;
+    fdata->ping_sent = 0;
+    if (fdata->rtt_avg_usec == 0)
+    {
+        fdata->rtt_avg_usec = fdata->rtt_usec;
+    }
+    else
+    {
+        fdata->rtt_avg_usec += (fdata->rtt_usec - fdata->rtt_avg_usec) /
+                               RTT_AVERAGE_WEIGHT;
+    }
+    toxprpl_histogram_add(&plugin->stats.rtt_msec, fdata->rtt_usec / 1000);
+
+    if (fdata->ping_report)
+    {
+        gchar *message = g_strdup_printf(
+                _("Round trip time over %s: %u ms (average %u ms)"),
+                (fdata->connection == TOX_CONNECTION_UDP) ? "UDP" : "TCP",
+                (guint)(fdata->rtt_usec / 1000),
+                (guint)(fdata->rtt_avg_usec / 1000));
+        toxprpl_link_report(gc, fdata, message);
+        g_free(message);
+    }
+}
+
+/* sends due probes and expires unanswered ones, called with the
+ * connection check */
+static void toxprpl_link_probe(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    gint64 now = g_get_monotonic_time();
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, plugin->friends);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_friend_data *fdata = value;
+        if ((fdata->connection == TOX_CONNECTION_NONE) ||
+            !(fdata->peer_caps & TOXPRPL_CAP_PING))
+        {
+            continue;
+        }
+
+        if ((fdata->ping_sent != 0) &&
+            (now - fdata->ping_sent > PING_TIMEOUT * 1000))
+        {
+            fdata->ping_sent = 0;
+            fdata->pings_lost++;
+            if (fdata->ping_report)
+            {
+                toxprpl_link_report(gc, fdata, _("No answer to the ping"));
+            }
+        }
+        if ((fdata->ping_sent == 0) && (now >= fdata->next_ping))
+        {
+            toxprpl_link_ping(plugin, fdata);
+        }
+    }
+}
+
+static void on_lossless_packet(Tox *tox, uint32_t fnum, const uint8_t *data,
+                               size_t length, void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_FRIEND_LOSSLESS_PACKET);
+    PurpleConnection *gc = user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL && length > 0);
+    toxprpl_friend_data *fdata = toxprpl_get_friend_data(plugin, fnum);
+
+    switch (data[0])
+    {
+        case TOXPRPL_PACKET_CAPS:
+            if ((length < 3) || (data[1] < TOXPRPL_PACKET_VERSION))
+            {
+                break;
+            }
+            toxprpl_log_misc("friend #%u capabilities 0x%02x\n", fnum,
+                             data[2]);
+            fdata->peer_caps = data[2];
+            if (!fdata->caps_sent)
+            {
+                toxprpl_send_caps(plugin, fnum);
+            }
+            break;
+
+        case TOXPRPL_PACKET_COMPRESSED_FILE:
+        {
+            if (length != 1 + TOX_FILE_ID_LENGTH + sizeof(guint64))
+            {
+                break;
+            }
+            guint64 size;
+            memcpy(&size, data + 1 + TOX_FILE_ID_LENGTH, sizeof(size));
+            size = GUINT64_FROM_BE(size);
+            if (size == 0)
+            {
+                /* the offer failed, see toxprpl_xfer_offer() */
+                toxprpl_take_compressed_file(plugin, fnum, data + 1);
+                break;
+            }
+            toxprpl_compressed_file *file = g_new(toxprpl_compressed_file,
+                                                  1);
+            memcpy(file->file_id, data + 1, TOX_FILE_ID_LENGTH);
+            file->size = size;
+            fdata->compressed_files = g_slist_prepend(fdata->compressed_files,
+                                                      file);
+            break;
+        }
+
+        case TOXPRPL_PACKET_FRAME:
+            toxprpl_raw_receive(gc, fnum, data, length);
+            break;
+
+        default:
+            if ((data[0] >= TOXPRPL_PACKET_RAW_FIRST) &&
+                (data[0] <= TOXPRPL_PACKET_RAW_LAST))
+            {
+                toxprpl_raw_receive(gc, fnum, data, length);
+                break;
+            }
+            toxprpl_log_trace("ignoring lossless packet %u from friend #%u\n",
+                              data[0], fnum);
+            break;
+    }
+}
+
+static void on_lossy_packet(Tox *tox, uint32_t fnum, const uint8_t *data,
+                            size_t length, void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_FRIEND_LOSSY_PACKET);
+    PurpleConnection *gc = user_data;
+    toxprpl_return_if_fail(length > 0);
+
+    switch (data[0])
+    {
+        case TOXPRPL_PACKET_PING:
+        {
+            if (length != PING_PACKET_SIZE)
+            {
+                break;
+            }
+            uint8_t pong[PING_PACKET_SIZE];
+            memcpy(pong, data, sizeof(pong));
+            pong[0] = TOXPRPL_PACKET_PONG;
+            TOX_ERR_FRIEND_CUSTOM_PACKET err_back;
+            tox_friend_send_lossy_packet(tox, fnum, pong, sizeof(pong),
+                                         &err_back);
+            break;
+        }
+
+        case TOXPRPL_PACKET_PONG:
+            toxprpl_link_pong(gc, fnum, data, length);
+            break;
+
+        case TOXPRPL_PACKET_LOSSY_FRAME:
+            toxprpl_raw_receive(gc, fnum, data, length);
+            break;
+
+        default:
+            if (data[0] >= TOXPRPL_PACKET_LOSSY_FIRST)
+            {
+                toxprpl_raw_receive(gc, fnum, data, length);
+                break;
+            }
+            toxprpl_log_trace("ignoring lossy packet %u from friend #%u\n",
+                              data[0], fnum);
+            break;
+    }
+}
+
+/* returns the uncompressed size if the friend announced file_id as a
+ * compressed transfer, 0 otherwise */
+static guint64 toxprpl_take_compressed_file(toxprpl_plugin_data *plugin,
+                                            uint32_t fnum,
+                                            const uint8_t *file_id)
+{
+    toxprpl_friend_data *fdata = g_hash_table_lookup(plugin->friends,
+                                                     GUINT_TO_POINTER(fnum));
+    GSList *l;
+    for (l = (fdata != NULL) ? fdata->compressed_files : NULL; l != NULL;
+         l = g_slist_next(l))
+    {
+        toxprpl_compressed_file *file = l->data;
+        if (memcmp(file->file_id, file_id, TOX_FILE_ID_LENGTH) == 0)
+        {
+            guint64 size = file->size;
+            fdata->compressed_files = g_slist_delete_link(
+                    fdata->compressed_files, l);
+            g_free(file);
+            return size;
+        }
+    }
+    return 0;
+}
+
+/* presence */
+/*
+ * Friend status, connection and name changes are not written to the buddy
+ * list right away. Many friends connecting at once or one flapping friend
+ * would otherwise cause a UI update and a blist.xml write per event. The
+ * latest state of each friend is kept in its friend data and applied after
+ * PRESENCE_COALESCE_DELAY, skipping what libpurple already shows.
+ */
+static int toxprpl_presence_status(const toxprpl_friend_data *fdata)
+{
+    if (fdata->connection == TOX_CONNECTION_NONE)
+    {
+        return TOXPRPL_STATUS_OFFLINE;
+    }
+    switch (fdata->user_status)
+    {
+        case TOX_USER_STATUS_AWAY:
+            return TOXPRPL_STATUS_AWAY;
+        case TOX_USER_STATUS_BUSY:
+            return TOXPRPL_STATUS_BUSY;
+        default:
+            return TOXPRPL_STATUS_ONLINE;
+    }
+}
+
+static gboolean toxprpl_presence_flush(gpointer data)
+{
+    PurpleConnection *gc = data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    PurpleAccount *account = purple_connection_get_account(gc);
+    GList *l;
+
+    plugin->presence_timer = 0;
+    plugin->presence_pending = g_list_reverse(plugin->presence_pending);
+    for (l = plugin->presence_pending; l != NULL; l = g_list_next(l))
+    {
+        toxprpl_friend_data *fdata = g_hash_table_lookup(plugin->friends,
+                                                         l->data);
+        if (fdata == NULL)
+        {
+            continue;
+        }
+        fdata->presence_pending = FALSE;
+
+        const char *buddy_key = toxprpl_friend_buddy_key(plugin, fdata);
+        PurpleBuddy *buddy = (buddy_key != NULL) ?
+            purple_find_buddy(account, buddy_key) : NULL;
+        if (buddy == NULL)
+        {
+            continue;
+        }
+
+        const char *status = toxprpl_statuses[
+                toxprpl_presence_status(fdata)].id;
+        if (!purple_presence_is_status_active(purple_buddy_get_presence(buddy),
+                                              status))
+        {
+            toxprpl_log_trace("Setting user status for user %s to %s\n",
+                              buddy_key, status);
+            purple_prpl_got_user_status(account, buddy_key, status, NULL);
+            plugin->stats.presence_writes++;
+        }
+
+        if ((fdata->alias != NULL) &&
+            (g_strcmp0(purple_buddy_get_alias_only(buddy), fdata->alias) != 0))
+        {
+            purple_blist_alias_buddy(buddy, fdata->alias);
+            plugin->stats.presence_writes++;
+        }
+        g_free(fdata->alias);
+        fdata->alias = NULL;
+    }
+    g_list_free(plugin->presence_pending);
+    plugin->presence_pending = NULL;
+    return FALSE;
+}
+
+/* remembers that the friend changed and starts the timer */
+static toxprpl_friend_data *toxprpl_presence_changed(PurpleConnection *gc,
+                                                     uint32_t fnum)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_friend_data *fdata = toxprpl_get_friend_data(plugin, fnum);
+
+    plugin->stats.presence_changes++;
+    if (!fdata->presence_pending)
+    {
+        fdata->presence_pending = TRUE;
+        plugin->presence_pending = g_list_prepend(plugin->presence_pending,
+                                                  GUINT_TO_POINTER(fnum));
+    }
+    if (plugin->presence_timer == 0)
+    {
+        plugin->presence_timer = purple_timeout_add(PRESENCE_COALESCE_DELAY,
+                toxprpl_presence_flush, gc);
+    }
+    return fdata;
+}
+
+static void on_connectionstatus(Tox *tox, uint32_t fnum, TOX_CONNECTION status,
+                                void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_FRIEND_CONNECTION);
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+
+    toxprpl_log_trace("Friend status change: %d\n", status);
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
+    // ToDo: Hanndle err_back
+    if (tox_friend_get_public_key(tox, fnum, public_key, &err_back) != true)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend #%d\n",
+                          fnum);
+        return;
+    }
+
+    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    TOX_CONNECTION previous = toxprpl_get_friend_data(plugin, fnum)->connection;
+    toxprpl_link_update(plugin, fnum, status);
+    toxprpl_friend_data *fdata = toxprpl_presence_changed(gc, fnum);
+    if (status != TOX_CONNECTION_NONE)
+    {
+        /* toxcore also reports a switch between UDP and TCP, the session
+         * and what was sent in it survive that */
+        if (previous == TOX_CONNECTION_NONE)
+        {
+            /* unacknowledged messages are older than anything in the
+             * outbox */
+            toxprpl_receipts_retransmit(plugin, fnum);
+            toxprpl_outbox_schedule_flush(gc, buddy_key, fnum);
+            toxprpl_avatar_send(gc, fnum);
+        }
+        toxprpl_send_caps(plugin, fnum);
+    }
+    else
+    {
+        /* the status is sent again after reconnecting */
+        fdata->user_status = TOX_USER_STATUS_NONE;
+        /* the friend may come back with another client */
+        fdata->caps_sent = FALSE;
+        fdata->peer_caps = 0;
+        g_slist_free_full(fdata->compressed_files, g_free);
+        fdata->compressed_files = NULL;
+        plugin->stats.raw_dropped += fdata->raw_records[0] +
+                                     fdata->raw_records[1];
+        fdata->raw_length[0] = fdata->raw_length[1] = 0;
+        fdata->raw_records[0] = fdata->raw_records[1] = 0;
+
+        /* a reconnecting friend starts with us not typing */
+        if (fdata->typing_timer != 0)
+        {
+            purple_timeout_remove(fdata->typing_timer);
+            fdata->typing_timer = 0;
+        }
+        fdata->typing_sent = FALSE;
+        fdata->typing_wanted = FALSE;
+    }
+    g_free(buddy_key);
+}
+
+/* friend requests */
+
+/*
+ * A published ID can receive floods of friend requests, so requests are
+ * not turned into dialogs as they come in. They wait in a bounded queue,
+ * one entry per public key, and at most REQUEST_DIALOGS_MAX dialogs are
+ * open at a time, a new one every REQUEST_DIALOG_INTERVAL.
+ *
+ * The account's rules are applied first: requests whose message matches
+ * the reject or accept pattern are decided right away, the remaining ones
+ * follow the policy of asking, accepting or rejecting. Accepted requests
+ * are collected for REQUEST_ACCEPT_DELAY and added in one go with a
+ * single save of the profile. Until then they stay in request_keys like
+ * waiting ones, so repeated requests are not accepted twice.
+ */
+
+static void toxprpl_friend_request_free(gpointer data)
+{
+    toxprpl_friend_request *request = data;
+    if (request->ui != NULL)
+    {
+        purple_account_request_close(request->ui);
+    }
+    g_free(request->buddy_key);
+    g_free(request->message);
+    g_free(request);
+}
+
+static gboolean toxprpl_requests_add(gpointer data)
+{
+    PurpleConnection *gc = data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    PurpleAccount *account = purple_connection_get_account(gc);
+    toxprpl_friend_request *request;
+    guint added = 0;
+
+    plugin->accept_timer = 0;
+    while ((request = g_queue_pop_head(plugin->accepted)) != NULL)
+    {
+        TOX_ERR_FRIEND_ADD err_back;
+        uint32_t fnum = tox_friend_add_norequest(plugin->tox,
+                                                 request->public_key,
+                                                 &err_back);
+        if (err_back == TOX_ERR_FRIEND_ADD_OK)
+        {
+            toxprpl_sync_add_buddy(account, plugin->tox, fnum);
+            added++;
+        }
+        else
+        {
+            toxprpl_log_warning("could not add friend (%d)\n", err_back);
+        }
+        g_hash_table_remove(plugin->request_keys, request->buddy_key);
+    }
+
+    if (added > 0)
+    {
+        toxprpl_log_info("added %u friend(s) from requests\n", added);
+        toxprpl_save_account(account, plugin->tox);
+    }
+    return FALSE;
+}
+
+/* request has to be in request_keys, toxprpl_requests_add() removes it */
+static void toxprpl_request_accept(toxprpl_plugin_data *plugin,
+                                   PurpleConnection *gc,
+                                   toxprpl_friend_request *request)
+{
+    plugin->stats.requests_accepted++;
+    g_queue_push_tail(plugin->accepted, request);
+    if (plugin->accept_timer == 0)
+    {
+        plugin->accept_timer = purple_timeout_add(REQUEST_ACCEPT_DELAY,
+                                                  toxprpl_requests_add, gc);
+    }
+}
+
+static gboolean toxprpl_requests_show(gpointer data);
+
+/* keeps the dialog timer running while requests wait */
+static void toxprpl_requests_schedule(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    if ((plugin->request_timer == 0) &&
+        !g_queue_is_empty(plugin->requests) &&
+        (plugin->requests_shown < REQUEST_DIALOGS_MAX))
+    {
+        toxprpl_requests_show(gc);
+        /* a request answered right away may have started it already */
+        if ((plugin->request_timer == 0) &&
+            !g_queue_is_empty(plugin->requests))
+        {
+            plugin->request_timer = purple_timeout_add(
+                    REQUEST_DIALOG_INTERVAL, toxprpl_requests_show, gc);
+        }
+    }
+}
+
+/* a dialog was answered, frees request */
+static void toxprpl_request_closed(toxprpl_friend_request *request,
+                                   gboolean accepted)
+{
+    PurpleConnection *gc = request->gc;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+
+    /* libpurple closes the dialog itself */
+    request->ui = NULL;
+    if (request == plugin->request_showing)
+    {
+        /* answered before purple_account_request_authorization()
+         * returned, it was not counted yet */
+        plugin->request_showing = NULL;
+    }
+    else
+    {
+        plugin->requests_shown--;
+    }
+    if (accepted)
+    {
+        toxprpl_request_accept(plugin, gc, request);
+    }
+    else
+    {
+        plugin->stats.requests_rejected++;
+        g_hash_table_remove(plugin->request_keys, request->buddy_key);
+    }
+    toxprpl_requests_schedule(gc);
+}
+
+static void toxprpl_request_authorized(void *data)
+{
+    toxprpl_request_closed(data, TRUE);
+}
+
+static void toxprpl_request_denied(void *data)
+{
+    toxprpl_request_closed(data, FALSE);
+}
+
+static gboolean toxprpl_requests_show(gpointer data)
+{
+    PurpleConnection *gc = data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+
+    if (plugin->requests_shown < REQUEST_DIALOGS_MAX)
+    {
+        toxprpl_friend_request *request = g_queue_pop_head(plugin->requests);
+        if (request != NULL)
+        {
+            /* another plugin may answer it right away, which frees
+             * request, toxprpl_request_closed() then clears this */
+            plugin->request_showing = request;
+            /* on_list as we add the buddy ourselves */
+            gpointer ui = purple_account_request_authorization(
+                    purple_connection_get_account(gc), request->buddy_key,
+                    NULL, NULL, request->message, TRUE,
+                    toxprpl_request_authorized, toxprpl_request_denied,
+                    request);
+            if (plugin->request_showing != NULL)
+            {
+                plugin->request_showing = NULL;
+                if (ui != NULL)
+                {
+                    plugin->requests_shown++;
+                    request->ui = ui;
+                }
+                else
+                {
+                    /* ignored or there is no UI, nothing will answer it */
+                    g_hash_table_remove(plugin->request_keys,
+                                        request->buddy_key);
+                }
+            }
+        }
+    }
+
+    if (g_queue_is_empty(plugin->requests) ||
+        (plugin->requests_shown >= REQUEST_DIALOGS_MAX))
+    {
+        /* toxprpl_request_closed() restarts it */
+        plugin->request_timer = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean toxprpl_request_matches(PurpleAccount *account,
+                                        const char *setting,
+                                        const char *message)
+{
+    const char *pattern = purple_account_get_string(account, setting, "");
+    return (pattern != NULL) && (*pattern != '\0') &&
+           g_pattern_match_simple(pattern, (message != NULL) ? message : "");
+}
+
+static void on_request(struct Tox *tox, const uint8_t *public_key,
+                       const uint8_t *data, size_t length, void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_FRIEND_REQUEST);
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    plugin->stats.requests_in++;
+
+    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
+    toxprpl_log_misc("Buddy request from %s\n", buddy_key);
+
+    PurpleAccount *account = purple_connection_get_account(gc);
+    if ((purple_find_buddy(account, buddy_key) != NULL) ||
+        (g_hash_table_lookup(plugin->request_keys, buddy_key) != NULL))
+    {
+        /* toxcore passes repeated requests on */
+        plugin->stats.requests_duplicate++;
+        g_free(buddy_key);
+        return;
+    }
+
+    gchar *message = NULL;
+    if (length > 0)
+    {
+        gchar *raw = g_strndup((const gchar *)data, length);
+        message = purple_utf8_salvage(raw);
+        g_free(raw);
+    }
+    const char *policy = purple_account_get_string(account,
+            "request_policy", DEFAULT_REQUEST_POLICY);
+
+    gboolean accept = toxprpl_request_matches(account,
+                                              "request_accept_pattern",
+                                              message) ||
+                      (g_strcmp0(policy, "accept") == 0);
+
+    if (toxprpl_request_matches(account, "request_reject_pattern", message) ||
+        (!accept && (g_strcmp0(policy, "reject") == 0)))
+    {
+        plugin->stats.requests_rejected++;
+    }
+    else if (!accept &&
+             (g_queue_get_length(plugin->requests) >= REQUEST_QUEUE_SIZE))
+    {
+        plugin->stats.requests_dropped++;
+    }
+    else
+    {
+        toxprpl_friend_request *request = g_new0(toxprpl_friend_request, 1);
+        request->gc = gc;
+        request->buddy_key = buddy_key;
+        memcpy(request->public_key, public_key, TOX_PUBLIC_KEY_SIZE);
+        request->message = message;
+        g_hash_table_insert(plugin->request_keys, buddy_key, request);
+        if (accept)
+        {
+            toxprpl_request_accept(plugin, gc, request);
+        }
+        else
+        {
+            g_queue_push_tail(plugin->requests, request);
+            toxprpl_requests_schedule(gc);
+        }
+        return;
+    }
+    g_free(message);
+    g_free(buddy_key);
+}
+
+/* text messages */
+/*
+ * Tox limits a text message to TOX_MAX_MESSAGE_LENGTH bytes, so both
+ * directions prepare the text in a scratch buffer on the stack instead of
+ * copying it to the heap. Outgoing text only goes through libpurple's HTML
+ * stripping when it contains markup, and incoming text is checked for valid
+ * UTF-8 before libpurple gets it, since a peer can send anything.
+ */
+#define MESSAGE_SCRATCH_SIZE    (TOX_MAX_MESSAGE_LENGTH + sizeof("/me "))
+
+/* high bit or zero byte in any byte of a word */
+#define UTF8_WORD_ONES          ((uintptr_t)-1 / 0xff)
+#define UTF8_WORD_SPECIAL(w) \
+    (((w) | ((w) - UTF8_WORD_ONES)) & (UTF8_WORD_ONES * 0x80))
+
+/* like g_utf8_validate() but skips ASCII a word at a time, which is what
+ * almost every message consists of */
+static gboolean toxprpl_utf8_validate(const char *text, size_t length)
+{
+    const char *p = text;
+    const char *end = text + length;
+
+    while ((size_t)(end - p) >= sizeof(uintptr_t))
+    {
+        uintptr_t word;
+        memcpy(&word, p, sizeof(word));
+        if (UTF8_WORD_SPECIAL(word) != 0)
+        {
+            break;
+        }
+        p += sizeof(uintptr_t);
+    }
+    return (p == end) || g_utf8_validate(p, end - p, NULL);
+}
+
+/* NUL terminates a received message in scratch, with the /me of actions,
+ * returns a salvaged heap copy in salvaged if it was no valid UTF-8 */
+static const char *toxprpl_incoming_text(char *scratch, TOX_MESSAGE_TYPE type,
+                                         const uint8_t *string, size_t length,
+                                         gchar **salvaged)
+{
+    size_t offset = 0;
+    if (type == TOX_MESSAGE_TYPE_ACTION)
+    {
+        memcpy(scratch, "/me ", 4);
+        offset = 4;
+    }
+    length = MIN(length, TOX_MAX_MESSAGE_LENGTH);
+    memcpy(scratch + offset, string, length);
+    scratch[offset + length] = '\0';
+
+    *salvaged = NULL;
+    if (!toxprpl_utf8_validate(scratch + offset, length))
+    {
+        *salvaged = purple_utf8_salvage(scratch);
+        return *salvaged;
+    }
+    return scratch;
+}
+
+/* anything purple_markup_strip_html() would change */
+static gboolean toxprpl_has_markup(const char *message)
+{
+    return strpbrk(message, "<>&") != NULL;
+}
+
+/* plain text of an outgoing message with /me removed, in scratch unless it
+ * has markup or does not fit, then the heap copy is also put in allocated */
+static char *toxprpl_outgoing_text(const char *message, char *scratch,
+                                   TOX_MESSAGE_TYPE *type, char **allocated)
+{
+    char *text;
+    size_t length;
+
+    *allocated = NULL;
+    if (toxprpl_has_markup(message))
+    {
+        text = *allocated = purple_markup_strip_html(message);
+    }
+    else if ((length = strlen(message)) < MESSAGE_SCRATCH_SIZE)
+    {
+        text = memcpy(scratch, message, length + 1);
+    }
+    else
+    {
+        text = *allocated = g_strdup(message);
+    }
+
+    *type = purple_message_meify(text, -1) ? TOX_MESSAGE_TYPE_ACTION :
+                                             TOX_MESSAGE_TYPE_NORMAL;
+    return text;
+}
+
+/* writes the messages of a tick to the conversations in arrival order */
+static void toxprpl_inbound_flush(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_inbound *in;
+
+    g_hash_table_remove_all(plugin->inbound_open);
+    while ((in = g_queue_pop_head(plugin->inbound)) != NULL)
+    {
+        const char *buddy_key = toxprpl_friend_buddy_key(plugin,
+                toxprpl_get_friend_data(plugin, in->friendnumber));
+        if (buddy_key != NULL)
+        {
+            gchar *salvaged = NULL;
+            if (!toxprpl_utf8_validate(in->text->str, in->text->len))
+            {
+                salvaged = purple_utf8_salvage(in->text->str);
+            }
+            plugin->stats.im_writes++;
+            serv_got_im(gc, buddy_key, salvaged != NULL ? salvaged :
+                        in->text->str, PURPLE_MESSAGE_RECV, in->received);
+            g_free(salvaged);
+        }
+        g_string_free(in->text, TRUE);
+        g_free(in);
+    }
+}
+
+/* adds a message to the friend's batch of this tick, actions can't share
+ * a write as /me only works at the start, they close the batch */
+static void toxprpl_inbound_add(toxprpl_plugin_data *plugin, uint32_t fnum,
+                                TOX_MESSAGE_TYPE type, const uint8_t *string,
+                                size_t length)
+{
+    toxprpl_inbound *in = NULL;
+    if (type == TOX_MESSAGE_TYPE_NORMAL)
+    {
+        in = g_hash_table_lookup(plugin->inbound_open, GUINT_TO_POINTER(fnum));
+    }
+
+    if ((in != NULL) && (in->text->len + 1 + length <= INBOUND_BATCH_MAX))
+    {
+        plugin->stats.messages_coalesced++;
+        g_string_append_c(in->text, '\n');
+    }
+    else
+    {
+        in = g_new0(toxprpl_inbound, 1);
+        in->friendnumber = fnum;
+        in->text = g_string_sized_new(length + 1);
+        in->received = time(NULL);
+        g_queue_push_tail(plugin->inbound, in);
+        if (type == TOX_MESSAGE_TYPE_ACTION)
+        {
+            g_string_append(in->text, "/me ");
+            g_hash_table_remove(plugin->inbound_open, GUINT_TO_POINTER(fnum));
+        }
+        else
+        {
+            g_hash_table_insert(plugin->inbound_open, GUINT_TO_POINTER(fnum),
+                                in);
+        }
+    }
+    g_string_append_len(in->text, (const gchar *)string, length);
+}
+
+static void on_incoming_message(Tox *tox, uint32_t friendnum,
+                                TOX_MESSAGE_TYPE type,
+                                const uint8_t *string,
+                                size_t length, void *user_data)
+{
+    toxprpl_stats *stats = toxprpl_stats_callback(user_data,
+                                                  TOXPRPL_CB_FRIEND_MESSAGE);
+    if (stats != NULL)
+    {
+        stats->messages_in++;
+        stats->bytes_in += length;
+    }
+
+    /* written to the conversation at the end of the tick */
+    toxprpl_plugin_data *plugin =
+        purple_connection_get_protocol_data((PurpleConnection *)user_data);
+    if ((plugin != NULL) && plugin->coalesce_messages &&
+        ((type == TOX_MESSAGE_TYPE_NORMAL) ||
+         (type == TOX_MESSAGE_TYPE_ACTION)))
+    {
+        toxprpl_inbound_add(plugin, friendnum, type, string, length);
+        return;
+    }
+
+    if ((plugin == NULL) || ((type != TOX_MESSAGE_TYPE_NORMAL) &&
+                             (type != TOX_MESSAGE_TYPE_ACTION)))
+    {
+        return;
+    }
+    toxprpl_log_trace("%s received\n", type == TOX_MESSAGE_TYPE_ACTION ?
+                      "action" : "message");
+
+    const char *buddy_key = toxprpl_friend_buddy_key(plugin,
+            toxprpl_get_friend_data(plugin, friendnum));
+    if (buddy_key == NULL)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnum);
+        return;
+    }
+
+    char scratch[MESSAGE_SCRATCH_SIZE];
+    gchar *salvaged;
+    const char *message = toxprpl_incoming_text(scratch, type, string, length,
+                                                &salvaged);
+    if (stats != NULL)
+    {
+        stats->im_writes++;
+    }
+    serv_got_im((PurpleConnection *)user_data, buddy_key, message,
+                PURPLE_MESSAGE_RECV, time(NULL));
+    g_free(salvaged);
+}
+
+static void on_nick_change(Tox *tox, uint32_t friendnum, const uint8_t *data,
+                           size_t length, void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_FRIEND_NAME);
+    toxprpl_log_trace("Nick change!\n");
+
+    toxprpl_friend_data *fdata =
+        toxprpl_presence_changed((PurpleConnection *)user_data, friendnum);
+    g_free(fdata->alias);
+    fdata->alias = g_strndup((const char *)data, length);
+}
+
+static void on_status_change(struct Tox *tox, uint32_t friendnum,
+                             TOX_USER_STATUS userstatus,
+                             void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_FRIEND_STATUS);
+    toxprpl_log_trace("Status change: %d\n", userstatus);
+
+    toxprpl_friend_data *fdata =
+        toxprpl_presence_changed((PurpleConnection *)user_data, friendnum);
+    fdata->user_status = userstatus;
+}
+
+/* TODO: create an inverted table to speed this up */
+static PurpleXfer *toxprpl_find_xfer(PurpleConnection *gc,
+                                     uint32_t friendnumber, uint32_t filenumber)
+{
+    PurpleAccount *account = purple_connection_get_account(gc);
+    toxprpl_return_val_if_fail(account != NULL, NULL);
+    GList *xfers = purple_xfers_get_all();
+    toxprpl_return_val_if_fail(xfers != NULL, NULL);
+
+    while (xfers != NULL && xfers->data != NULL)
+    {
+        PurpleXfer *xfer = xfers->data;
+        toxprpl_xfer_data *xfer_data = xfer->data;
+        if (xfer_data != NULL &&
+            xfer_data->friendnumber == friendnumber &&
+            xfer_data->filenumber == filenumber)
+        {
+            return xfer;
+        }
+        xfers = g_list_next(xfers);
+    }
+    return NULL;
+}
+
+/* avatars */
+
+/*
+ * Avatars are exchanged as TOX_FILE_KIND_AVATAR transfers whose file id is
+ * the tox_hash() of the image. Received images are cached by that hash in
+ * a directory shared by all accounts, so an avatar is downloaded once and
+ * any later offer of the same hash is cancelled and served from the cache.
+ * The hash of the avatar last sent to each friend is remembered in the
+ * buddy list, so our own avatar is only offered again after it changed.
+ */
+static guint64 toxprpl_file_key(uint32_t friendnumber, uint32_t filenumber)
+{
+    return ((guint64)friendnumber << 32) | filenumber;
+}
+
+static void toxprpl_avatar_transfer_free(gpointer data)
+{
+    toxprpl_avatar_transfer *transfer = data;
+    g_free(transfer->data);
+    g_free(transfer);
+}
+
+static gchar *toxprpl_avatar_cache_path(const char *hash_hex)
+{
+    return g_build_filename(purple_user_dir(), "tox", AVATAR_CACHE_DIR,
+                            hash_hex, NULL);
+}
+
+static PurpleBuddy *toxprpl_find_buddy_by_friend(PurpleConnection *gc,
+                                                 Tox *tox, uint32_t fnum)
+{
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    char buddy_key[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
+    if (tox_friend_get_public_key(tox, fnum, public_key, &err_back) != true)
+    {
+        return NULL;
+    }
+    toxprpl_data_to_hex_buf(public_key, TOX_PUBLIC_KEY_SIZE, buddy_key);
+    return purple_find_buddy(purple_connection_get_account(gc), buddy_key);
+}
+
+/* returns TRUE if the avatar was taken from the cache or was already set */
+static gboolean toxprpl_avatar_from_cache(PurpleBuddy *buddy,
+                                          const char *hash_hex)
+{
+    const char *checksum = purple_buddy_icons_get_checksum_for_user(buddy);
+    if ((checksum != NULL) && (strcmp(checksum, hash_hex) == 0))
+    {
+        return TRUE;
+    }
+
+    gchar *path = toxprpl_avatar_cache_path(hash_hex);
+    gchar *contents;
+    gsize length;
+    gboolean found = g_file_get_contents(path, &contents, &length, NULL);
+    g_free(path);
+    if (!found)
+    {
+        return FALSE;
+    }
+
+    toxprpl_log_misc("avatar %s of %s found in cache\n", hash_hex, buddy->name);
+    /* takes ownership of contents */
+    purple_buddy_icons_set_for_user(purple_buddy_get_account(buddy),
+                                    buddy->name, contents, length, hash_hex);
+    return TRUE;
+}
+
+static void toxprpl_avatar_recv(PurpleConnection *gc, Tox *tox,
+                                uint32_t friendnumber, uint32_t filenumber,
+                                uint64_t filesize)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    TOX_ERR_FILE_CONTROL err_back;
+    PurpleBuddy *buddy = toxprpl_find_buddy_by_friend(gc, tox, friendnumber);
+
+    if ((plugin == NULL) || (buddy == NULL) || (filesize > AVATAR_MAX_SIZE))
+    {
+        tox_file_control(tox, friendnumber, filenumber,
+                         TOX_FILE_CONTROL_CANCEL, &err_back);
+        return;
+    }
+
+    if (filesize == 0)
+    {
+        /* friend removed the avatar */
+        purple_buddy_icons_set_for_user(purple_buddy_get_account(buddy),
+                                        buddy->name, NULL, 0, NULL);
+        tox_file_control(tox, friendnumber, filenumber,
+                         TOX_FILE_CONTROL_CANCEL, &err_back);
+        return;
+    }
+
+    uint8_t file_id[TOX_FILE_ID_LENGTH];
+    char hash_hex[TOX_FILE_ID_LENGTH * 2 + 1];
+    TOX_ERR_FILE_GET err_file_get;
+    if (!tox_file_get_file_id(tox, friendnumber, filenumber, file_id,
+                              &err_file_get))
+    {
+        tox_file_control(tox, friendnumber, filenumber,
+                         TOX_FILE_CONTROL_CANCEL, &err_back);
+        return;
+    }
+    toxprpl_data_to_hex_buf(file_id, TOX_FILE_ID_LENGTH, hash_hex);
+
+    if (toxprpl_avatar_from_cache(buddy, hash_hex))
+    {
+        tox_file_control(tox, friendnumber, filenumber,
+                         TOX_FILE_CONTROL_CANCEL, &err_back);
+        return;
+    }
+
+    toxprpl_log_misc("downloading avatar %s of %s\n", hash_hex, buddy->name);
+    toxprpl_avatar_transfer *transfer = g_new0(toxprpl_avatar_transfer, 1);
+    transfer->key = toxprpl_file_key(friendnumber, filenumber);
+    transfer->incoming = TRUE;
+    memcpy(transfer->hash, file_id, TOX_FILE_ID_LENGTH);
+    transfer->size = filesize;
+    transfer->data = g_malloc(filesize);
+    g_hash_table_insert(plugin->avatar_transfers, &transfer->key, transfer);
+
+    if (!tox_file_control(tox, friendnumber, filenumber,
+                          TOX_FILE_CONTROL_RESUME, &err_back))
+    {
+        g_hash_table_remove(plugin->avatar_transfers, &transfer->key);
+    }
+}
+
+static void toxprpl_avatar_recv_done(PurpleConnection *gc, Tox *tox,
+                                     uint32_t friendnumber,
+                                     toxprpl_avatar_transfer *transfer)
+{
+    uint8_t hash[TOX_HASH_LENGTH];
+    char hash_hex[TOX_HASH_LENGTH * 2 + 1];
+    tox_hash(hash, transfer->data, transfer->offset);
+    if ((transfer->offset != transfer->size) ||
+        (memcmp(hash, transfer->hash, TOX_HASH_LENGTH) != 0))
+    {
+        toxprpl_log_warning("discarding avatar of friend #%u, "
+                            "hash mismatch\n", friendnumber);
+        return;
+    }
+    toxprpl_data_to_hex_buf(hash, TOX_HASH_LENGTH, hash_hex);
+
+    gchar *path = toxprpl_avatar_cache_path(hash_hex);
+    gchar *dirname = g_path_get_dirname(path);
+    g_mkdir_with_parents(dirname, 0700);
+    if (!g_file_set_contents(path, (const gchar *)transfer->data,
+                             transfer->size, NULL))
+    {
+        toxprpl_log_warning("could not cache avatar %s\n", path);
+    }
+    g_free(dirname);
+    g_free(path);
+
+    PurpleBuddy *buddy = toxprpl_find_buddy_by_friend(gc, tox, friendnumber);
+    if (buddy != NULL)
+    {
+        /* libpurple takes ownership of the image data */
+        purple_buddy_icons_set_for_user(purple_buddy_get_account(buddy),
+                                        buddy->name, transfer->data,
+                                        transfer->size, hash_hex);
+        transfer->data = NULL;
+    }
+}
+
+/* offers our avatar to a friend, unless they already got this one */
+static void toxprpl_avatar_send(PurpleConnection *gc, uint32_t friendnumber)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL && plugin->tox != NULL);
+
+    PurpleBuddy *buddy = toxprpl_find_buddy_by_friend(gc, plugin->tox,
+                                                      friendnumber);
+    toxprpl_return_if_fail(buddy != NULL);
+
+    char hash_hex[TOX_HASH_LENGTH * 2 + 1] = "";
+    if (plugin->avatar_size > 0)
+    {
+        toxprpl_data_to_hex_buf(plugin->avatar_hash, TOX_HASH_LENGTH,
+                                hash_hex);
+    }
+
+    const char *sent = purple_blist_node_get_string(PURPLE_BLIST_NODE(buddy),
+                                                    AVATAR_SENT_SETTING);
+    if (g_strcmp0(sent, hash_hex) == 0)
+    {
+        return;
+    }
+
+    TOX_ERR_FILE_SEND err_back;
+    uint32_t filenumber = tox_file_send(plugin->tox, friendnumber,
+                                        TOX_FILE_KIND_AVATAR,
+                                        plugin->avatar_size,
+                                        (plugin->avatar_size > 0) ?
+                                            plugin->avatar_hash : NULL,
+                                        NULL, 0, &err_back);
+    if (err_back != TOX_ERR_FILE_SEND_OK)
+    {
+        toxprpl_log_info("could not send avatar to friend #%u "
+                         "(%d)\n", friendnumber, err_back);
+        return;
+    }
+
+    if (plugin->avatar_size == 0)
+    {
+        /* nothing to transfer, the empty offer tells them it was removed */
+        purple_blist_node_set_string(PURPLE_BLIST_NODE(buddy),
+                                     AVATAR_SENT_SETTING, hash_hex);
+        return;
+    }
+
+    toxprpl_log_misc("offering avatar %s to %s\n", hash_hex, buddy->name);
+    toxprpl_avatar_transfer *transfer = g_new0(toxprpl_avatar_transfer, 1);
+    transfer->key = toxprpl_file_key(friendnumber, filenumber);
+    transfer->incoming = FALSE;
+    memcpy(transfer->hash, plugin->avatar_hash, TOX_HASH_LENGTH);
+    transfer->size = plugin->avatar_size;
+    transfer->data = g_memdup(plugin->avatar, plugin->avatar_size);
+    g_hash_table_insert(plugin->avatar_transfers, &transfer->key, transfer);
+}
+
+/* the friend either has the avatar now or cancelled because it is cached */
+static void toxprpl_avatar_send_done(PurpleConnection *gc, Tox *tox,
+                                     uint32_t friendnumber,
+                                     toxprpl_avatar_transfer *transfer)
+{
+    PurpleBuddy *buddy = toxprpl_find_buddy_by_friend(gc, tox, friendnumber);
+    if (buddy != NULL)
+    {
+        char hash_hex[TOX_HASH_LENGTH * 2 + 1];
+        toxprpl_data_to_hex_buf(transfer->hash, TOX_HASH_LENGTH, hash_hex);
+        purple_blist_node_set_string(PURPLE_BLIST_NODE(buddy),
+                                     AVATAR_SENT_SETTING, hash_hex);
+    }
+}
+
+static void toxprpl_set_buddy_icon(PurpleConnection *gc,
+                                   PurpleStoredImage *img)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL && plugin->tox != NULL);
+
+    g_free(plugin->avatar);
+    plugin->avatar = NULL;
+    plugin->avatar_size = 0;
+    if (img != NULL)
+    {
+        plugin->avatar_size = purple_imgstore_get_size(img);
+        plugin->avatar = g_memdup(purple_imgstore_get_data(img),
+                                  plugin->avatar_size);
+        tox_hash(plugin->avatar_hash, plugin->avatar, plugin->avatar_size);
+    }
+
+    /* friends that are offline get it when they connect */
+    uint32_t fl_len = tox_self_get_friend_list_size(plugin->tox);
+    uint32_t *friendlist = g_malloc0(fl_len * sizeof(uint32_t));
+    tox_self_get_friend_list(plugin->tox, friendlist);
+    uint32_t i;
+    for (i = 0; i < fl_len; i++)
+    {
+        TOX_ERR_FRIEND_QUERY err_back;
+        if (tox_friend_get_connection_status(plugin->tox, friendlist[i],
+                                             &err_back) != TOX_CONNECTION_NONE)
+        {
+            toxprpl_avatar_send(gc, friendlist[i]);
+        }
+    }
+    g_free(friendlist);
+}
+
+/* file digests */
+
+/*
+ * Every transfer keeps a BLAKE2b state that is fed with the chunks as they
+ * are sent or written, so the digest is ready the moment the transfer
+ * completes without reading the file again. When an incoming transfer is
+ * interrupted the state is saved with the number of received bytes in a
+ * partial-transfer record, which lets a new offer of the same file id
+ * continue where it stopped, digest included.
+ *
+ * libsodium declares the state CRYPTO_ALIGN(64), which g_malloc() does
+ * not guarantee, and sodium_malloc() costs guard pages and an mlock per
+ * transfer, so the states get an aligned allocation of their own.
+ */
+#define DIGEST_ALIGNMENT            64
+
+/* returns an initialized state or NULL */
+static crypto_generichash_state *toxprpl_digest_new(void)
+{
+    void *state;
+#ifdef __WIN32__
+    state = _aligned_malloc(crypto_generichash_statebytes(),
+                            DIGEST_ALIGNMENT);
+#else
+    if (posix_memalign(&state, DIGEST_ALIGNMENT,
+                       crypto_generichash_statebytes()) != 0)
+    {
+        state = NULL;
+    }
+#endif
+    if (state != NULL)
+    {
+        crypto_generichash_init(state, NULL, 0, crypto_generichash_BYTES);
+    }
+    return state;
+}
+
+static void toxprpl_digest_free(crypto_generichash_state *state)
+{
+#ifdef __WIN32__
+    _aligned_free(state);
+#else
+    free(state);
+#endif
+}
+
+static void toxprpl_xfer_digest_init(toxprpl_xfer_data *xfer_data)
+{
+    xfer_data->digest = toxprpl_digest_new();
+    xfer_data->digest_offset = 0;
+}
+
+static void toxprpl_xfer_digest_free(toxprpl_xfer_data *xfer_data)
+{
+    if (xfer_data->digest != NULL)
+    {
+        toxprpl_digest_free(xfer_data->digest);
+        xfer_data->digest = NULL;
+    }
+}
+
+static void toxprpl_xfer_digest_update(toxprpl_xfer_data *xfer_data,
+                                       uint64_t position, const uint8_t *data,
+                                       size_t length)
+{
+    if (xfer_data->digest == NULL)
+    {
+        return;
+    }
+    if (position != xfer_data->digest_offset)
+    {
+        /* a seek or a chunk out of order, the digest can't be computed in
+         * passing anymore */
+        toxprpl_log_misc("giving up digest of file %u at %" G_GUINT64_FORMAT
+                         "\n", xfer_data->filenumber, position);
+        toxprpl_xfer_digest_free(xfer_data);
+        return;
+    }
+    crypto_generichash_update(xfer_data->digest, data, length);
+    xfer_data->digest_offset += length;
+}
+
+/* writes the digest of a completed transfer into the conversation */
+static void toxprpl_xfer_digest_show(PurpleXfer *xfer)
+{
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    if ((xfer_data->digest == NULL) ||
+        (xfer_data->digest_offset != purple_xfer_get_size(xfer)))
+    {
+        return;
+    }
+
+    uint8_t hash[crypto_generichash_BYTES];
+    char hash_hex[crypto_generichash_BYTES * 2 + 1];
+    crypto_generichash_final(xfer_data->digest, hash, sizeof(hash));
+    toxprpl_xfer_digest_free(xfer_data);
+    toxprpl_data_to_hex_buf(hash, sizeof(hash), hash_hex);
+
+    gchar *message = g_strdup_printf(_("BLAKE2b-256 of %s: %s"),
+                                     purple_xfer_get_filename(xfer),
+                                     hash_hex);
+    purple_xfer_conversation_write(xfer, message, FALSE);
+    g_free(message);
+}
+
+static gsize toxprpl_partial_record_size(void)
+{
+    return PARTIAL_MAGIC_LENGTH + TOX_FILE_ID_LENGTH + sizeof(guint64) +
+           crypto_generichash_statebytes();
+}
+
+/* stores the progress of an interrupted incoming transfer */
+static void toxprpl_xfer_save_partial(PurpleXfer *xfer)
+{
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    const char *local_filename = purple_xfer_get_local_filename(xfer);
+    if ((purple_xfer_get_type(xfer) != PURPLE_XFER_RECEIVE) ||
+        (xfer_data->inflate != NULL) ||
+        purple_xfer_is_completed(xfer) || (local_filename == NULL) ||
+        (xfer_data->digest == NULL) || (xfer_data->digest_offset == 0))
+    {
+        return;
+    }
+
+    gsize size = toxprpl_partial_record_size();
+    guint8 *record = g_malloc(size);
+    guint8 *p = record;
+    guint64 offset = GUINT64_TO_BE(xfer_data->digest_offset);
+
+    memcpy(p, PARTIAL_MAGIC, PARTIAL_MAGIC_LENGTH);
+    p += PARTIAL_MAGIC_LENGTH;
+    memcpy(p, xfer_data->file_id, TOX_FILE_ID_LENGTH);
+    p += TOX_FILE_ID_LENGTH;
+    memcpy(p, &offset, sizeof(offset));
+    p += sizeof(offset);
+    memcpy(p, xfer_data->digest, crypto_generichash_statebytes());
+
+    gchar *filename = g_strconcat(local_filename, PARTIAL_SUFFIX, NULL);
+    GError *error = NULL;
+    if (!g_file_set_contents(filename, (const gchar *)record, size, &error))
+    {
+        toxprpl_log_warning("could not save %s: %s\n", filename,
+                            error->message);
+        g_error_free(error);
+    }
+    else
+    {
+        toxprpl_log_info("saved partial transfer %s at %"
+                         G_GUINT64_FORMAT "\n", filename,
+                         xfer_data->digest_offset);
+    }
+    g_free(filename);
+    g_free(record);
+}
+
+/* Continues an incoming transfer from its partial-transfer record if the
+ * record belongs to the same file id and matches the file on disk. Must
+ * be called before the transfer is accepted. */
+static void toxprpl_xfer_resume_partial(PurpleXfer *xfer)
+{
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    const char *local_filename = purple_xfer_get_local_filename(xfer);
+    if ((local_filename == NULL) || (xfer_data->digest == NULL) ||
+        (xfer_data->inflate != NULL))
+    {
+        return;
+    }
+
+    gchar *filename = g_strconcat(local_filename, PARTIAL_SUFFIX, NULL);
+    gchar *record;
+    gsize size;
+    if (!g_file_get_contents(filename, &record, &size, NULL))
+    {
+        g_free(filename);
+        return;
+    }
+    /* a record is used at most once, an interrupted resume writes a new
+     * one */
+    g_remove(filename);
+    g_free(filename);
+
+    const guint8 *p = (const guint8 *)record;
+    guint64 offset;
+    GStatBuf sb;
+    if ((size != toxprpl_partial_record_size()) ||
+        (memcmp(p, PARTIAL_MAGIC, PARTIAL_MAGIC_LENGTH) != 0) ||
+        (memcmp(p + PARTIAL_MAGIC_LENGTH, xfer_data->file_id,
+                TOX_FILE_ID_LENGTH) != 0))
+    {
+        g_free(record);
+        return;
+    }
+    p += PARTIAL_MAGIC_LENGTH + TOX_FILE_ID_LENGTH;
+    memcpy(&offset, p, sizeof(offset));
+    offset = GUINT64_FROM_BE(offset);
+    p += sizeof(offset);
+
+    if ((offset >= purple_xfer_get_size(xfer)) ||
+        (g_stat(local_filename, &sb) != 0) || (sb.st_size != offset))
+    {
+        g_free(record);
+        return;
+    }
+
+    /* purple_xfer_start() opens the file with "wb" itself, which truncates
+     * it, so the received part is kept aside until it has done so */
+    gchar *resume_path = g_strconcat(local_filename, RESUME_SUFFIX, NULL);
+    if (g_rename(local_filename, resume_path) != 0)
+    {
+        toxprpl_log_warning("could not move %s aside: %s\n",
+                            local_filename, g_strerror(errno));
+        g_free(resume_path);
+        g_free(record);
+        return;
+    }
+
+    TOX_ERR_FILE_SEEK err_back;
+    if (!tox_file_seek(xfer_data->tox, xfer_data->friendnumber,
+                       xfer_data->filenumber, offset, &err_back))
+    {
+        toxprpl_log_warning("could not resume %s at %"
+                            G_GUINT64_FORMAT " (%d)\n", local_filename,
+                            offset, err_back);
+        g_rename(resume_path, local_filename);
+        g_free(resume_path);
+        g_free(record);
+        return;
+    }
+
+    memcpy(xfer_data->digest, p, crypto_generichash_statebytes());
+    xfer_data->digest_offset = offset;
+    xfer_data->resume_path = resume_path;
+    g_free(record);
+    toxprpl_log_info("resuming %s at %" G_GUINT64_FORMAT "\n",
+                     local_filename, offset);
+}
+
+/* Puts the received part of a resumed transfer back in place once
+ * purple_xfer_start() created the file, and opens it for
+ * toxprpl_xfer_write(). Returns FALSE if the file on disk doesn't end
+ * where the transfer continues. */
+static gboolean toxprpl_xfer_resume_finish(PurpleXfer *xfer)
+{
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    if ((xfer_data == NULL) || (xfer_data->resume_path == NULL))
+    {
+        return TRUE;
+    }
+
+    const char *local_filename = purple_xfer_get_local_filename(xfer);
+    gboolean ok = (g_rename(xfer_data->resume_path, local_filename) == 0);
+    g_free(xfer_data->resume_path);
+    xfer_data->resume_path = NULL;
+
+    GStatBuf sb;
+    if (ok)
+    {
+        xfer_data->recv_fp = g_fopen(local_filename, "r+b");
+        ok = (xfer_data->recv_fp != NULL) &&
+             (g_stat(local_filename, &sb) == 0) &&
+             (sb.st_size == xfer_data->digest_offset);
+    }
+    if (!ok)
+    {
+        toxprpl_log_warning("could not resume %s\n", local_filename);
+        return FALSE;
+    }
+    xfer->bytes_sent = xfer_data->digest_offset;
+    purple_xfer_update_progress(xfer);
+    return TRUE;
+}
+
+/* writes data at the end of the received part of an incoming transfer */
+static gboolean toxprpl_xfer_write(gpointer user_data, const uint8_t *data,
+                                   size_t length)
+{
+    PurpleXfer *xfer = user_data;
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    if (length == 0)
+    {
+        return TRUE;
+    }
+    /* a compressed transfer could otherwise inflate to any size */
+    if (purple_xfer_get_bytes_sent(xfer) + length > purple_xfer_get_size(xfer))
+    {
+        toxprpl_log_warning("%s is larger than announced\n",
+                            purple_xfer_get_filename(xfer));
+        return FALSE;
+    }
+
+    /* libpurple's own stream is not used, it has no say in where chunks
+     * go and is reopened truncated on start */
+    if (xfer_data->recv_fp == NULL)
+    {
+        xfer_data->recv_fp = g_fopen(xfer->local_filename, "r+b");
+        if (xfer_data->recv_fp == NULL)
+        {
+            xfer_data->recv_fp = g_fopen(xfer->local_filename, "w+b");
+        }
+        if (xfer_data->recv_fp == NULL)
+        {
+            purple_debug_info("toxprpl", "file could not be opened for "
+                              "writing.\n");
+            return FALSE;
+        }
+    }
+
+    FILE *fp = xfer_data->recv_fp;
+    off_t position = purple_xfer_get_bytes_sent(xfer);
+    if (((ftello(fp) != position) &&
+         (fseeko(fp, position, SEEK_SET) == -1)) ||
+        (fwrite(data, 1, length, fp) != length))
+    {
+        perror("toxprpl: file");
+        return FALSE;
+    }
+
+    toxprpl_xfer_digest_update(xfer->data, purple_xfer_get_bytes_sent(xfer),
+                               data, length);
+    xfer->bytes_sent += length;
+    purple_xfer_update_progress(xfer);
+    return TRUE;
+}
+
+/* compressed transfers */
+
+/*
+ * When a friend runs tox-prpl with compression enabled too, files of at
+ * least COMPRESS_MIN_SIZE bytes are sent as a zlib stream. The file is
+ * compressed as toxcore requests chunks, a few blocks ahead at most, and
+ * the digest of the original data is computed on the way. Whether that is
+ * worth it is judged from the first COMPRESS_BUFFER_SIZE bytes before the
+ * offer. The random file id and the original size are announced with a
+ * TOXPRPL_PACKET_COMPRESSED_FILE packet right before the file is offered
+ * as a stream of unknown size, which ends with the first chunk shorter
+ * than requested. Custom packets and file offers travel in order over the
+ * same connection, so the receiver knows the file is compressed when the
+ * offer arrives and inflates the chunks as they come in. An announcement
+ * whose offer failed is withdrawn with a size of 0. Everybody else gets
+ * the plain file.
+ */
+
+/* returns TRUE if the start of the file at path shrinks enough at level */
+static gboolean toxprpl_compress_worthwhile(const char *path, gint level)
+{
+    FILE *in = g_fopen(path, "rb");
+    if (in == NULL)
+    {
+        return FALSE;
+    }
+    guint8 *inbuf = g_malloc(COMPRESS_BUFFER_SIZE);
+    guint8 *outbuf = g_malloc(COMPRESS_BUFFER_SIZE);
+    size_t in_size = fread(inbuf, 1, COMPRESS_BUFFER_SIZE, in);
+    fclose(in);
+
+    GConverter *zlib = G_CONVERTER(g_zlib_compressor_new(
+            G_ZLIB_COMPRESSOR_FORMAT_ZLIB, level));
+    gsize bytes_read;
+    gsize bytes_written;
+    GConverterResult result = g_converter_convert(zlib, inbuf, in_size,
+            outbuf, COMPRESS_BUFFER_SIZE, G_CONVERTER_INPUT_AT_END,
+            &bytes_read, &bytes_written, NULL);
+    g_object_unref(zlib);
+    g_free(outbuf);
+    g_free(inbuf);
+
+    /* output that doesn't fit the buffer didn't shrink anyway */
+    return (in_size > 0) && (result == G_CONVERTER_FINISHED) &&
+           (bytes_written * 100 < in_size * COMPRESS_MAX_RATIO);
+}
+
+/* opens the file at path for reading as a zlib stream, NULL on error */
+static toxprpl_deflate_stream *toxprpl_deflate_new(const char *path,
+                                                   gint level)
+{
+    FILE *in = g_fopen(path, "rb");
+    if (in == NULL)
+    {
+        return NULL;
+    }
+    toxprpl_deflate_stream *stream = g_new0(toxprpl_deflate_stream, 1);
+    stream->in = in;
+    stream->zlib = G_CONVERTER(g_zlib_compressor_new(
+            G_ZLIB_COMPRESSOR_FORMAT_ZLIB, level));
+    stream->out = g_byte_array_new();
+    return stream;
+}
+
+static void toxprpl_deflate_free(toxprpl_deflate_stream *stream)
+{
+    g_byte_array_free(stream->out, TRUE);
+    g_object_unref(stream->zlib);
+    fclose(stream->in);
+    g_free(stream);
+}
+
+/* position in the zlib stream of the next byte toxprpl_deflate_read()
+ * returns */
+static guint64 toxprpl_deflate_position(toxprpl_deflate_stream *stream)
+{
+    return stream->out_size - (stream->out->len - stream->taken);
+}
+
+/* compresses one more block of input into stream->out, returns FALSE on
+ * errors */
+static gboolean toxprpl_deflate_refill(toxprpl_deflate_stream *stream,
+                                       crypto_generichash_state *digest)
+{
+    guint8 inbuf[COMPRESS_READ_SIZE];
+    guint8 outbuf[COMPRESS_BUFFER_SIZE];
+
+    size_t n = fread(inbuf, 1, sizeof(inbuf), stream->in);
+    if (ferror(stream->in))
+    {
+        return FALSE;
+    }
+    gboolean at_end = feof(stream->in);
+    if (digest != NULL)
+    {
+        crypto_generichash_update(digest, inbuf, n);
+    }
+    stream->in_size += n;
+
+    /* drop what was handed out before the array grows again */
+    g_byte_array_remove_range(stream->out, 0, stream->taken);
+    stream->taken = 0;
+
+    gsize offset = 0;
+    do
+    {
+        gsize bytes_read;
+        gsize bytes_written;
+        GError *error = NULL;
+        GConverterResult result = g_converter_convert(stream->zlib,
+                inbuf + offset, n - offset, outbuf, sizeof(outbuf),
+                at_end ? G_CONVERTER_INPUT_AT_END : G_CONVERTER_NO_FLAGS,
+                &bytes_read, &bytes_written, &error);
+        if (result == G_CONVERTER_ERROR)
+        {
+            toxprpl_log_warning("deflate: %s\n", error->message);
+            g_error_free(error);
+            return FALSE;
+        }
+        offset += bytes_read;
+        g_byte_array_append(stream->out, outbuf, bytes_written);
+        stream->out_size += bytes_written;
+        stream->finished = (result == G_CONVERTER_FINISHED);
+    } while ((offset < n) || (at_end && !stream->finished));
+    return TRUE;
+}
+
+/* Fills data with the next length bytes of the zlib stream, feeding the
+ * input to digest. Returns the number of bytes, less than length only at
+ * the end of the stream, or -1 on errors. */
+static gssize toxprpl_deflate_read(toxprpl_deflate_stream *stream,
+                                   crypto_generichash_state *digest,
+                                   uint8_t *data, size_t length)
+{
+    while ((stream->out->len - stream->taken < length) && !stream->finished)
+    {
+        if (!toxprpl_deflate_refill(stream, digest))
+        {
+            return -1;
+        }
+    }
+    size_t n = MIN(length, stream->out->len - stream->taken);
+    memcpy(data, stream->out->data + stream->taken, n);
+    stream->taken += n;
+    return n;
+}
+
+typedef gboolean (*toxprpl_inflate_sink)(gpointer user_data,
+                                         const uint8_t *data, size_t length);
+
+/* decompresses one chunk of a zlib stream and passes the output on */
+static gboolean toxprpl_inflate(GConverter *inflate, const uint8_t *data,
+                                size_t length, toxprpl_inflate_sink sink,
+                                gpointer user_data)
+{
+    guint8 outbuf[COMPRESS_BUFFER_SIZE];
+    gsize offset = 0;
+
+    do
+    {
+        gsize bytes_read;
+        gsize bytes_written;
+        GError *error = NULL;
+        GConverterResult result = g_converter_convert(inflate,
+                data + offset, length - offset, outbuf, sizeof(outbuf),
+                G_CONVERTER_NO_FLAGS, &bytes_read, &bytes_written, &error);
+        if (result == G_CONVERTER_ERROR)
+        {
+            toxprpl_log_warning("inflate: %s\n", error->message);
+            g_error_free(error);
+            return FALSE;
+        }
+        offset += bytes_read;
+        if (!sink(user_data, outbuf, bytes_written))
+        {
+            return FALSE;
+        }
+        if (result == G_CONVERTER_FINISHED)
+        {
+            break;
+        }
+    } while (offset < length);
+    return TRUE;
+}
+
+/* passes on what the decompressor still holds once all input arrived,
+ * returns FALSE unless the zlib stream ended properly */
+static gboolean toxprpl_inflate_finish(GConverter *inflate,
+                                       toxprpl_inflate_sink sink,
+                                       gpointer user_data)
+{
+    guint8 outbuf[COMPRESS_BUFFER_SIZE];
+    GConverterResult result;
+
+    do
+    {
+        gsize bytes_read;
+        gsize bytes_written;
+        GError *error = NULL;
+        result = g_converter_convert(inflate, NULL, 0, outbuf, sizeof(outbuf),
+                                     G_CONVERTER_INPUT_AT_END, &bytes_read,
+                                     &bytes_written, &error);
+        if (result == G_CONVERTER_ERROR)
+        {
+            toxprpl_log_warning("inflate: %s\n", error->message);
+            g_error_free(error);
+            return FALSE;
+        }
+        if (!sink(user_data, outbuf, bytes_written))
+        {
+            return FALSE;
+        }
+        if ((result != G_CONVERTER_FINISHED) && (bytes_written == 0))
+        {
+            /* no progress without more input, the stream is cut short */
+            return FALSE;
+        }
+    } while (result != G_CONVERTER_FINISHED);
+    return TRUE;
+}
+
+/* offers an outgoing transfer to the friend, as a zlib stream if it is
+ * compressed */
+static void toxprpl_xfer_offer(PurpleXfer *xfer)
+{
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    const char *filename = purple_xfer_get_filename(xfer);
+    uint64_t size = purple_xfer_get_size(xfer);
+    const uint8_t *file_id = NULL;
+    uint8_t packet[1 + TOX_FILE_ID_LENGTH + sizeof(guint64)];
+    TOX_ERR_FRIEND_CUSTOM_PACKET err_packet;
+
+    if (xfer_data->deflate != NULL)
+    {
+        guint64 original = GUINT64_TO_BE(size);
+        packet[0] = TOXPRPL_PACKET_COMPRESSED_FILE;
+        randombytes_buf(packet + 1, TOX_FILE_ID_LENGTH);
+        memcpy(packet + 1 + TOX_FILE_ID_LENGTH, &original, sizeof(original));
+
+        if (tox_friend_send_lossless_packet(xfer_data->tox,
+                                            xfer_data->friendnumber, packet,
+                                            sizeof(packet), &err_packet))
+        {
+            file_id = packet + 1;
+            /* the compressed size is known once the stream ends */
+            size = UINT64_MAX;
+        }
+        else
+        {
+            toxprpl_deflate_free(xfer_data->deflate);
+            xfer_data->deflate = NULL;
+        }
+    }
+
+    purple_debug_info("toxprpl", "sending xfer request for file '%s'.\n",
+        filename);
+    TOX_ERR_FILE_SEND err_back;
+    /* TODO: maybe parsing the file kind before is necessary */
+    uint32_t filenumber = tox_file_send(xfer_data->tox,
+                                        xfer_data->friendnumber,
+                                        TOX_FILE_KIND_DATA, size, file_id,
+                                        (const uint8_t *)filename,
+                                        strlen(filename) + 1, &err_back);
+    /* TODO: Handle err_back */
+    if (err_back != TOX_ERR_FILE_SEND_OK)
+    {
+        if (file_id != NULL)
+        {
+            /* withdraw the announcement, compressed files are never empty */
+            memset(packet + 1 + TOX_FILE_ID_LENGTH, 0, sizeof(guint64));
+            tox_friend_send_lossless_packet(xfer_data->tox,
+                                            xfer_data->friendnumber, packet,
+                                            sizeof(packet), &err_packet);
+        }
+        toxprpl_return_if_fail(err_back == TOX_ERR_FILE_SEND_OK);
+    }
+
+    xfer_data->filenumber = filenumber;
+
+    TOX_ERR_FILE_GET err_file_get;
+    /* TODO: Return type is bool */
+    tox_file_get_file_id(xfer_data->tox, xfer_data->friendnumber, filenumber,
+                         xfer_data->file_id, &err_file_get);
+    /* TODO: Handle err_file_get */
+}
+
+/* sends xfer as a zlib stream if the friend can take it and it pays off */
+static void toxprpl_xfer_compress(PurpleXfer *xfer,
+                                  toxprpl_plugin_data *plugin)
+{
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    toxprpl_friend_data *fdata = g_hash_table_lookup(plugin->friends,
+            GUINT_TO_POINTER(xfer_data->friendnumber));
+    gint level = MIN(plugin->compression_level, 9);
+    const char *path = purple_xfer_get_local_filename(xfer);
+    if ((level <= 0) || (fdata == NULL) ||
+        !(fdata->peer_caps & TOXPRPL_CAP_ZLIB) ||
+        (purple_xfer_get_size(xfer) < COMPRESS_MIN_SIZE) ||
+        !toxprpl_compress_worthwhile(path, level))
+    {
+        return;
+    }
+    xfer_data->deflate = toxprpl_deflate_new(path, level);
+}
+
+/* Reads a chunk of an outgoing file, returns FALSE if it can't be sent.
+ * A compressed transfer may return less than *length bytes at its end. */
+static gboolean toxprpl_xfer_read_chunk(PurpleXfer *xfer, uint64_t position,
+                                        uint8_t *data, size_t *length)
+{
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    toxprpl_deflate_stream *deflate = xfer_data->deflate;
+
+    if (deflate != NULL)
+    {
+        /* toxcore asks for the chunks of a stream in order */
+        if (position != toxprpl_deflate_position(deflate))
+        {
+            toxprpl_log_warning("compressed chunk requested out of order\n");
+            return FALSE;
+        }
+        gssize n = toxprpl_deflate_read(deflate, xfer_data->digest, data,
+                                        *length);
+        if (n < 0)
+        {
+            return FALSE;
+        }
+        *length = n;
+        xfer_data->digest_offset = deflate->in_size;
+        return TRUE;
+    }
+
+    FILE* fp = fopen(xfer->local_filename, "r");
+    if (fp == NULL)
+    {
+        toxprpl_log_warning("file could not be opened.\n");
+        return FALSE;
+    }
+
+    if (ftello(fp) != position)
+    {
+        while (fseeko(fp, position, SEEK_SET) == -1)
+        {
+            if (errno != EAGAIN)
+            {
+                perror("toxprpl: file");
+                fclose(fp);
+                return FALSE;
+            }
+        }
+    }
+
+    size_t read_length = fread(data, 1, *length, fp);
+    fclose(fp);
+    if (read_length != *length)
+    {
+        toxprpl_log_warning("file read fail\n");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Hands a chunk of an outgoing file to toxcore. Returns FALSE if the send
+ * queue was full and the chunk has to be sent again later, other errors
+ * are not retried. */
+static gboolean toxprpl_xfer_send_chunk(toxprpl_plugin_data *plugin,
+                                        PurpleXfer *xfer, uint64_t position,
+                                        const uint8_t *data, size_t length)
+{
+    toxprpl_xfer_data *xfer_data = xfer->data;
+
+    TOX_ERR_FILE_SEND_CHUNK err;
+    tox_file_send_chunk(xfer_data->tox, xfer_data->friendnumber,
+                        xfer_data->filenumber, position, data, length, &err);
+    if (err == TOX_ERR_FILE_SEND_CHUNK_SENDQ)
+    {
+        return FALSE;
+    }
+    if (err != TOX_ERR_FILE_SEND_CHUNK_OK)
+    {
+        toxprpl_log_warning("file chunk send fail (%d)\n", err);
+        return TRUE;
+    }
+
+    plugin->stats.file_bytes_out += length;
+    if (xfer_data->deflate == NULL)
+    {
+        toxprpl_xfer_digest_update(xfer_data, position, data, length);
+        xfer->bytes_sent = position + length;
+    }
+    else
+    {
+        /* progress of a compressed transfer in terms of the original */
+        xfer->bytes_sent = MIN(xfer_data->deflate->in_size,
+                               purple_xfer_get_size(xfer));
+    }
+    purple_xfer_update_progress(xfer);
+    return TRUE;
+}
+
+/* sends the queued chunks of xfer, returns TRUE while some are left */
+static gboolean toxprpl_xfer_flush_pending(toxprpl_plugin_data *plugin,
+                                           PurpleXfer *xfer)
+{
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    toxprpl_pending_chunk *chunk;
+
+    while ((chunk = g_queue_peek_head(&xfer_data->pending)) != NULL)
+    {
+        if (!toxprpl_xfer_send_chunk(plugin, xfer, chunk->position,
+                                     chunk->data, chunk->length))
+        {
+            return TRUE;
+        }
+        g_free(g_queue_pop_head(&xfer_data->pending));
+    }
+    return FALSE;
+}
+
+/* retries refused chunks of all transfers, once per tick after
+ * tox_iterate() had a chance to empty the send queue */
+static void toxprpl_xfer_retry_stalled(toxprpl_plugin_data *plugin)
+{
+    GList *l = plugin->stalled_xfers;
+    while (l != NULL)
+    {
+        GList *next = g_list_next(l);
+        if (!toxprpl_xfer_flush_pending(plugin, l->data))
+        {
+            plugin->stalled_xfers = g_list_delete_link(plugin->stalled_xfers,
+                                                       l);
+        }
+        l = next;
+    }
+}
+
+void on_file_chunk_request(Tox *m, uint32_t friendnum, uint32_t filenum,
+                           uint64_t position, size_t length, void *userdata)
+{
+    toxprpl_stats_callback(userdata, TOXPRPL_CB_FILE_CHUNK_REQUEST);
+    toxprpl_log_trace("on_file_chunk_request %u/%u at %" G_GUINT64_FORMAT
+                      ", %zu bytes\n", friendnum, filenum, position, length);
+    PurpleConnection *gc = userdata;
+    toxprpl_return_if_fail(gc != NULL);
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    guint64 key = toxprpl_file_key(friendnum, filenum);
+    toxprpl_avatar_transfer *avatar = (plugin != NULL) ?
+        g_hash_table_lookup(plugin->avatar_transfers, &key) : NULL;
+    if (avatar != NULL)
+    {
+        if (length == 0)
+        {
+            toxprpl_avatar_send_done(gc, m, friendnum, avatar);
+            g_hash_table_remove(plugin->avatar_transfers, &key);
+            plugin->stats.avatars_completed++;
+            return;
+        }
+        toxprpl_return_if_fail(position + length <= avatar->size);
+        TOX_ERR_FILE_SEND_CHUNK err;
+        if (tox_file_send_chunk(m, friendnum, filenum, position,
+                                avatar->data + position, length, &err))
+        {
+            plugin->stats.file_bytes_out += length;
+        }
+        return;
+    }
+
+    PurpleXfer* xfer = toxprpl_find_xfer(gc, friendnum, filenum);
+    toxprpl_return_if_fail(xfer != NULL && xfer->data != NULL);
+    if (length == 0)
+    {
+        purple_debug_info("toxprpl", "file successfully sent.\n");
+        toxprpl_deflate_stream *deflate = ((toxprpl_xfer_data *)
+                                           xfer->data)->deflate;
+        if (plugin != NULL)
+        {
+            plugin->stats.transfers_completed++;
+            if (deflate != NULL)
+            {
+                plugin->stats.compression_saved +=
+                    (gint64)deflate->in_size - (gint64)deflate->out_size;
+            }
+        }
+        purple_xfer_set_completed(xfer, TRUE);
+        toxprpl_xfer_digest_show(xfer);
+        purple_xfer_end(xfer);
+        return;
+    }
+    toxprpl_return_if_fail(plugin != NULL);
+
+    uint8_t data[length];
+    if (!toxprpl_xfer_read_chunk(xfer, position, data, &length))
+    {
+        purple_xfer_cancel_local(xfer);
+        return;
+    }
+
+    /* chunks go out in the order they were requested, new ones queue up
+     * behind refused ones until toxprpl_xfer_retry_stalled() */
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    if (g_queue_is_empty(&xfer_data->pending))
+    {
+        if (toxprpl_xfer_send_chunk(plugin, xfer, position, data, length))
+        {
+            return;
+        }
+        plugin->stats.sendq_full++;
+        plugin->stalled_xfers = g_list_prepend(plugin->stalled_xfers, xfer);
+    }
+
+    toxprpl_pending_chunk *chunk = g_malloc(sizeof(*chunk) + length);
+    chunk->position = position;
+    chunk->length = length;
+    memcpy(chunk->data, data, length);
+    g_queue_push_tail(&xfer_data->pending, chunk);
+}
+
+void on_file_recv_chunk(Tox *m, uint32_t friendnum, uint32_t filenum,
+                        uint64_t position, const uint8_t* data, 
+                        size_t length, void *userdata)
+{
+    toxprpl_stats *stats = toxprpl_stats_callback(userdata,
+                                                  TOXPRPL_CB_FILE_RECV_CHUNK);
+    if (stats != NULL)
+    {
+        stats->file_bytes_in += length;
+    }
+    toxprpl_log_trace("on_file_recv_chunk %u/%u at %" G_GUINT64_FORMAT
+                      ", %zu bytes\n", friendnum, filenum, position, length);
+    PurpleConnection *gc = userdata;
+    toxprpl_return_if_fail(gc != NULL);
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    guint64 key = toxprpl_file_key(friendnum, filenum);
+    toxprpl_avatar_transfer *avatar = (plugin != NULL) ?
+        g_hash_table_lookup(plugin->avatar_transfers, &key) : NULL;
+    if (avatar != NULL)
+    {
+        if (length == 0)
+        {
+            toxprpl_avatar_recv_done(gc, m, friendnum, avatar);
+            g_hash_table_remove(plugin->avatar_transfers, &key);
+            plugin->stats.avatars_completed++;
+            return;
+        }
+        if ((position != avatar->offset) ||
+            (position + length > avatar->size))
+        {
+            toxprpl_log_warning("unexpected avatar chunk from "
+                                "friend #%u\n", friendnum);
+            return;
+        }
+        memcpy(avatar->data + position, data, length);
+        avatar->offset += length;
+        return;
+    }
+
+    PurpleXfer* xfer = toxprpl_find_xfer(gc, friendnum, filenum);
+    toxprpl_return_if_fail(xfer != NULL && xfer->data != NULL);
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    if (length == 0)
+    {
+        if (((xfer_data->inflate != NULL) &&
+             !toxprpl_inflate_finish(xfer_data->inflate, toxprpl_xfer_write,
+                                     xfer)) ||
+            (purple_xfer_get_bytes_sent(xfer) != purple_xfer_get_size(xfer)))
+        {
+            toxprpl_log_warning("incomplete transfer from "
+                                "friend #%u\n", friendnum);
+            /* toxcore is done with the file number already */
+            xfer_data->tox = NULL;
+            purple_xfer_cancel_local(xfer);
+            return;
+        }
+        purple_debug_info("toxprpl", "file successfully received.\n");
+        if (stats != NULL)
+        {
+            stats->transfers_completed++;
+        }
+        if (xfer_data->recv_fp != NULL)
+        {
+            fclose(xfer_data->recv_fp);
+            xfer_data->recv_fp = NULL;
+        }
+        purple_xfer_set_completed(xfer, TRUE);
+        toxprpl_xfer_digest_show(xfer);
+        purple_xfer_end(xfer);
+        return;
+    }
+
+    if (xfer_data->inflate == NULL)
+    {
+        if (!toxprpl_xfer_write(xfer, data, length))
+        {
+            purple_xfer_cancel_local(xfer);
+        }
+        return;
+    }
+
+    if ((position != xfer_data->recv_offset) ||
+        !toxprpl_inflate(xfer_data->inflate, data, length,
+                         toxprpl_xfer_write, xfer))
+    {
+        toxprpl_log_warning("broken compressed transfer from "
+                            "friend #%u\n", friendnum);
+        purple_xfer_cancel_local(xfer);
+        return;
+    }
+    xfer_data->recv_offset += length;
+}
+
+static void on_file_control(Tox *tox, uint32_t friendnumber,
+                            uint32_t filenumber, TOX_FILE_CONTROL control_type,
+                            void *userdata)
+{
+    toxprpl_stats_callback(userdata, TOXPRPL_CB_FILE_CONTROL);
+    PurpleConnection *gc = userdata;
+    toxprpl_return_if_fail(gc != NULL);
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    guint64 key = toxprpl_file_key(friendnumber, filenumber);
+    toxprpl_avatar_transfer *avatar = (plugin != NULL) ?
+        g_hash_table_lookup(plugin->avatar_transfers, &key) : NULL;
+    if (avatar != NULL)
+    {
+        if (control_type == TOX_FILE_CONTROL_CANCEL)
+        {
+            /* a friend cancels our offer when the avatar is already cached */
+            if (!avatar->incoming)
+            {
+                toxprpl_avatar_send_done(gc, tox, friendnumber, avatar);
+            }
+            g_hash_table_remove(plugin->avatar_transfers, &key);
+        }
+        return;
+    }
+
+    PurpleXfer* xfer = toxprpl_find_xfer(gc, friendnumber, filenumber);
+    toxprpl_return_if_fail(xfer != NULL);
+
+    switch(control_type)
+    {
+        case TOX_FILE_CONTROL_CANCEL:
+            purple_xfer_cancel_remote(xfer);
+            break;
+        default:
+            /* TODO: handle TOX_FILE_CONTROL_RESUME / TOX_FILE_CONTROL_PAUSE */
+            break;
+    }
+}
+
+static void on_file_recv(Tox *tox, uint32_t friendnumber,
+                         uint32_t filenumber, uint32_t kind,
+                         uint64_t filesize, const uint8_t *filename,
+                         size_t filename_length, void *userdata)
+{
+    toxprpl_stats_callback(userdata, TOXPRPL_CB_FILE_RECV);
+    purple_debug_info("toxprpl", "file_send_request: %i %i\n", friendnumber,
+                      filenumber);
+
+    PurpleConnection *gc = userdata;
+    toxprpl_return_if_fail(gc != NULL);
+
+    /* TCS: Avatar 2.3.2 */
+    if (kind == TOX_FILE_KIND_AVATAR)
+    {
+        toxprpl_avatar_recv(gc, tox, friendnumber, filenumber, filesize);
+        return;
+    }
+
+    toxprpl_return_if_fail(filename != NULL);
+    toxprpl_return_if_fail(tox != NULL);
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
+    /* ToDo: Hanndle err_back */
+    if (tox_friend_get_public_key(tox, friendnumber, public_key,
+                                  &err_back) != true)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnumber);
+        return;
+    }
+    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
+
+    PurpleXfer *xfer = toxprpl_new_xfer_receive(gc, buddy_key, friendnumber,
+                                                filenumber, filesize, 
+                                                (const char*) filename);
+    if (xfer == NULL)
+    {
+        purple_debug_warning("toxprpl", "could not create xfer\n");
+        g_free(buddy_key);
+        return;
+    }
+    toxprpl_return_if_fail(xfer != NULL);
+    toxprpl_xfer_data *xfer_data = xfer->data;
+    purple_debug_warning("toxprpl", "xfer fn/fn: %d %d %d %d\n",
+                         xfer_data->friendnumber, xfer_data->filenumber,
+                         friendnumber, filenumber);
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    guint64 size = toxprpl_take_compressed_file(plugin, friendnumber,
+                                                xfer_data->file_id);
+    if (size > 0)
+    {
+        /* the user sees and gets the original file */
+        toxprpl_log_misc("receiving %" G_GUINT64_FORMAT " bytes "
+                         "compressed\n", size);
+        purple_xfer_set_size(xfer, size);
+        xfer_data->inflate = G_CONVERTER(g_zlib_decompressor_new(
+                G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+    }
+    purple_xfer_request(xfer);
+    g_free(buddy_key);
+}
+
+static void on_typing_change(Tox *tox, uint32_t friendnum, bool is_typing,
+                             void *userdata)
+{
+    toxprpl_stats_callback(userdata, TOXPRPL_CB_FRIEND_TYPING);
+    toxprpl_log_trace("Friend typing status change: %d\n", friendnum);
+
+    PurpleConnection *gc = userdata;
+    toxprpl_return_if_fail(gc != NULL);
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
+    /* ToDo: Hanndle err_back */
+    if (tox_friend_get_public_key(tox, friendnum, public_key,
+                                  &err_back) != true)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnum);
+        return;
+    }
+
+    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
+    PurpleAccount *account = purple_connection_get_account(gc);
+    PurpleBuddy *buddy = purple_find_buddy(account, buddy_key);
+    if (buddy == NULL)
+    {
+        toxprpl_log_trace("Ignoring typing change because buddy %s "
+                          "was not found\n", buddy_key);
+        g_free(buddy_key);
+        return;
+    }
+    g_free(buddy_key);
+
+    if (is_typing)
+    {
+        serv_got_typing(gc, buddy->name, 5, PURPLE_TYPING);
+        /*                               ^ timeout for typing status
+         *                               (0 = disabled) */
+    }
+    else
+    {
+        serv_got_typing_stopped(gc, buddy->name);
+    }
+}
+
+/* conferences */
+
+static void toxprpl_conference_peer_free(gpointer data)
+{
+    toxprpl_conference_peer *peer = data;
+    g_free(peer->nick);
+    g_free(peer);
+}
+
+static void toxprpl_conference_free(gpointer data)
+{
+    toxprpl_conference_data *conf = data;
+    g_ptr_array_free(conf->by_number, TRUE);
+    g_hash_table_destroy(conf->nicks);
+    g_hash_table_destroy(conf->peers);
+    g_free(conf);
+}
+
+static toxprpl_conference_data *toxprpl_get_conference(
+                                                toxprpl_plugin_data *plugin,
+                                                uint32_t number)
+{
+    toxprpl_conference_data *conf = g_hash_table_lookup(plugin->conferences,
+                                                      GUINT_TO_POINTER(number));
+    if (conf == NULL)
+    {
+        conf = g_new0(toxprpl_conference_data, 1);
+        conf->conference_number = number;
+        conf->peers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            toxprpl_conference_peer_free);
+        conf->nicks = g_hash_table_new(g_str_hash, g_str_equal);
+        conf->by_number = g_ptr_array_new();
+        g_hash_table_insert(plugin->conferences, GUINT_TO_POINTER(number),
+                            conf);
+    }
+    return conf;
+}
+
+static toxprpl_conference_peer *toxprpl_conference_find_peer(
+                                                toxprpl_conference_data *conf,
+                                                uint32_t peer_number)
+{
+    if (peer_number >= conf->by_number->len)
+    {
+        return NULL;
+    }
+    return g_ptr_array_index(conf->by_number, peer_number);
+}
+
+/* chat user names must be unique, so clashing names get a key suffix */
+static gchar *toxprpl_conference_make_nick(toxprpl_conference_data *conf,
+                                           const uint8_t *name, size_t length,
+                                           const char *key_hex)
+{
+    gchar *nick;
+    if (length > 0)
+    {
+        nick = g_strndup((const char *)name, length);
+    }
+    else
+    {
+        nick = g_strndup(key_hex, 8);
+    }
+
+    if (g_hash_table_contains(conf->nicks, nick))
+    {
+        gchar *unique = g_strdup_printf("%s (%.8s)", nick, key_hex);
+        g_free(nick);
+        nick = unique;
+    }
+    return nick;
+}
+
+/*
+ * toxcore only tells us that the peer list changed, not how. Peers are
+ * matched against the cache by public key, so only peers that actually
+ * joined are queried for their name and only the difference is passed on
+ * to the chat.
+ */
+static void on_conference_peer_list_changed(Tox *tox, uint32_t number,
+                                            void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_CONFERENCE_PEER_LIST);
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    toxprpl_conference_data *conf = toxprpl_get_conference(plugin, number);
+    PurpleConversation *conv = purple_find_chat(gc, number);
+
+    TOX_ERR_CONFERENCE_PEER_QUERY err_back;
+    uint32_t count = tox_conference_peer_count(tox, number, &err_back);
+    if (err_back != TOX_ERR_CONFERENCE_PEER_QUERY_OK)
+    {
+        toxprpl_log_warning("could not get peers of conference "
+                            "%u (%d)\n", number, err_back);
+        return;
+    }
+
+    guint generation = ++conf->generation;
+    GList *joined = NULL;
+    GList *joined_flags = NULL;
+    GList *left = NULL;
+
+    g_ptr_array_set_size(conf->by_number, count);
+    uint32_t i;
+    for (i = 0; i < count; i++)
+    {
+        uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+        char key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        if (!tox_conference_peer_get_public_key(tox, number, i, public_key,
+                                                &err_back))
+        {
+            g_ptr_array_index(conf->by_number, i) = NULL;
+            continue;
+        }
+        toxprpl_data_to_hex_buf(public_key, TOX_PUBLIC_KEY_SIZE, key_hex);
+
+        toxprpl_conference_peer *peer = g_hash_table_lookup(conf->peers,
+                                                            key_hex);
+        if (peer == NULL)
+        {
+            uint8_t name[TOX_MAX_NAME_LENGTH];
+            size_t length = tox_conference_peer_get_name_size(tox, number, i,
+                                                              &err_back);
+            if ((err_back != TOX_ERR_CONFERENCE_PEER_QUERY_OK) ||
+                (length > TOX_MAX_NAME_LENGTH) ||
+                !tox_conference_peer_get_name(tox, number, i, name, &err_back))
+            {
+                length = 0;
+            }
+
+            peer = g_new0(toxprpl_conference_peer, 1);
+            peer->nick = toxprpl_conference_make_nick(conf, name, length,
+                                                      key_hex);
+            peer->ours = tox_conference_peer_number_is_ours(tox, number, i,
+                                                            &err_back);
+            g_hash_table_insert(conf->peers, g_strdup(key_hex), peer);
+            g_hash_table_insert(conf->nicks, peer->nick, peer);
+
+            joined = g_list_prepend(joined, peer->nick);
+            joined_flags = g_list_prepend(joined_flags,
+                                          GINT_TO_POINTER(PURPLE_CBFLAGS_NONE));
+            if (peer->ours && (conv != NULL))
+            {
+                purple_conv_chat_set_nick(PURPLE_CONV_CHAT(conv), peer->nick);
+            }
+        }
+        peer->generation = generation;
+        g_ptr_array_index(conf->by_number, i) = peer;
+    }
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, conf->peers);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_conference_peer *peer = value;
+        if (peer->generation != generation)
+        {
+            left = g_list_prepend(left, g_strdup(peer->nick));
+            g_hash_table_remove(conf->nicks, peer->nick);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+
+    toxprpl_log_misc("conference %u: %u peers, %u joined, %u left\n",
+                     number, count, g_list_length(joined),
+                     g_list_length(left));
+
+    if (conv != NULL)
+    {
+        if (joined != NULL)
+        {
+            purple_conv_chat_add_users(PURPLE_CONV_CHAT(conv), joined, NULL,
+                                       joined_flags, TRUE);
+        }
+        if (left != NULL)
+        {
+            purple_conv_chat_remove_users(PURPLE_CONV_CHAT(conv), left, NULL);
+        }
+    }
+    g_list_free(joined);
+    g_list_free(joined_flags);
+    g_list_free_full(left, g_free);
+}
+
+static void on_conference_peer_name(Tox *tox, uint32_t number,
+                                    uint32_t peer_number, const uint8_t *name,
+                                    size_t length, void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_CONFERENCE_PEER_NAME);
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    toxprpl_conference_data *conf = g_hash_table_lookup(plugin->conferences,
+                                                      GUINT_TO_POINTER(number));
+    toxprpl_return_if_fail(conf != NULL);
+
+    toxprpl_conference_peer *peer = toxprpl_conference_find_peer(conf,
+                                                                 peer_number);
+    if (peer == NULL)
+    {
+        /* not in the cache yet, the next list change will pick it up */
+        return;
+    }
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    char key_hex[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    TOX_ERR_CONFERENCE_PEER_QUERY err_back;
+    if (!tox_conference_peer_get_public_key(tox, number, peer_number,
+                                            public_key, &err_back))
+    {
+        return;
+    }
+    toxprpl_data_to_hex_buf(public_key, TOX_PUBLIC_KEY_SIZE, key_hex);
+
+    g_hash_table_remove(conf->nicks, peer->nick);
+    gchar *nick = toxprpl_conference_make_nick(conf, name, length, key_hex);
+    if (strcmp(nick, peer->nick) != 0)
+    {
+        PurpleConversation *conv = purple_find_chat(gc, number);
+        if (conv != NULL)
+        {
+            purple_conv_chat_rename_user(PURPLE_CONV_CHAT(conv), peer->nick,
+                                         nick);
+            if (peer->ours)
+            {
+                purple_conv_chat_set_nick(PURPLE_CONV_CHAT(conv), nick);
+            }
+        }
+        g_free(peer->nick);
+        peer->nick = nick;
+    }
+    else
+    {
+        g_free(nick);
+    }
+    g_hash_table_insert(conf->nicks, peer->nick, peer);
+}
+
+static void on_conference_message(Tox *tox, uint32_t number,
+                                  uint32_t peer_number, TOX_MESSAGE_TYPE type,
+                                  const uint8_t *message, size_t length,
+                                  void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_CONFERENCE_MESSAGE);
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    toxprpl_conference_data *conf = toxprpl_get_conference(plugin, number);
+    toxprpl_conference_peer *peer = toxprpl_conference_find_peer(conf,
+                                                                 peer_number);
+
+    PurpleMessageFlags flags = PURPLE_MESSAGE_RECV;
+    if ((peer != NULL) && peer->ours)
+    {
+        /* toxcore echoes our own messages back to us */
+        flags = PURPLE_MESSAGE_SEND;
+    }
+    else
+    {
+        plugin->stats.messages_in++;
+        plugin->stats.bytes_in += length;
+    }
+
+    gchar *safemsg;
+    if (type == TOX_MESSAGE_TYPE_ACTION)
+    {
+        safemsg = g_strdup_printf("/me %.*s", (int)length,
+                                  (const char *)message);
+    }
+    else
+    {
+        safemsg = g_strndup((const char *)message, length);
+    }
+
+    serv_got_chat_in(gc, number, (peer != NULL) ? peer->nick : _("Unknown"),
+                     flags, safemsg, time(NULL));
+    g_free(safemsg);
+}
+
+static void on_conference_title(Tox *tox, uint32_t number,
+                                uint32_t peer_number, const uint8_t *title,
+                                size_t length, void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_CONFERENCE_TITLE);
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL);
+
+    PurpleConversation *conv = purple_find_chat(gc, number);
+    toxprpl_return_if_fail(conv != NULL);
+
+    toxprpl_conference_data *conf = toxprpl_get_conference(plugin, number);
+    toxprpl_conference_peer *peer = toxprpl_conference_find_peer(conf,
+                                                                 peer_number);
+
+    gchar *topic = g_strndup((const char *)title, length);
+    purple_conv_chat_set_topic(PURPLE_CONV_CHAT(conv),
+                               (peer != NULL) ? peer->nick : NULL, topic);
+    purple_conversation_set_title(conv, topic);
+    g_free(topic);
+}
+
+static void on_conference_invite(Tox *tox, uint32_t friendnumber,
+                                 TOX_CONFERENCE_TYPE type,
+                                 const uint8_t *cookie, size_t length,
+                                 void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_CONFERENCE_INVITE);
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+
+    if (type != TOX_CONFERENCE_TYPE_TEXT)
+    {
+        toxprpl_log_misc("ignoring invite to audio conference "
+                         "from friend #%u\n", friendnumber);
+        return;
+    }
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
+    if (tox_friend_get_public_key(tox, friendnumber, public_key,
+                                  &err_back) != true)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend %d\n",
+                          friendnumber);
+        return;
+    }
+
+    GHashTable *components = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                   g_free, g_free);
+    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
+    g_hash_table_insert(components, g_strdup("friend"), g_strdup(buddy_key));
+    g_hash_table_insert(components, g_strdup("cookie"),
+                        toxprpl_data_to_hex_string(cookie, length));
+
+    toxprpl_log_misc("conference invite from %s\n", buddy_key);
+    serv_got_chat_invite(gc, _("Tox conference"), buddy_key, NULL, components);
+    g_free(buddy_key);
+}
+
+static GList *toxprpl_chat_info(PurpleConnection *gc)
+{
+    struct proto_chat_entry *pce = g_new0(struct proto_chat_entry, 1);
+    pce->label = _("_Title:");
+    pce->identifier = "title";
+    pce->required = FALSE;
+    return g_list_append(NULL, pce);
+}
+
+static GHashTable *toxprpl_chat_info_defaults(PurpleConnection *gc,
+                                              const char *chat_name)
+{
+    GHashTable *defaults = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 NULL, g_free);
+    if (chat_name != NULL)
+    {
+        g_hash_table_insert(defaults, "title", g_strdup(chat_name));
+    }
+    return defaults;
+}
+
+static char *toxprpl_get_chat_name(GHashTable *components)
+{
+    const char *title = g_hash_table_lookup(components, "title");
+    if ((title != NULL) && (strlen(title) > 0))
+    {
+        return g_strdup(title);
+    }
+    return g_strdup(_("Tox conference"));
+}
+
+static void toxprpl_join_chat(PurpleConnection *gc, GHashTable *components)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL && plugin->tox != NULL);
+
+    const char *friend_key = g_hash_table_lookup(components, "friend");
+    const char *cookie = g_hash_table_lookup(components, "cookie");
+    const char *title = g_hash_table_lookup(components, "title");
+    uint32_t number;
+
+    if ((friend_key != NULL) && (cookie != NULL))
+    {
+        /* accepting an invite */
+        unsigned char *bin_key = toxprpl_hex_string_to_data(friend_key);
+        TOX_ERR_FRIEND_BY_PUBLIC_KEY err_back_key;
+        uint32_t fnum = tox_friend_by_public_key(plugin->tox, bin_key,
+                                                 &err_back_key);
+        g_free(bin_key);
+        if (err_back_key != TOX_ERR_FRIEND_BY_PUBLIC_KEY_OK)
+        {
+            purple_notify_error(gc, _("Error"),
+                                _("Could not join conference: the inviting "
+                                  "friend is unknown."), NULL);
+            return;
+        }
+
+        unsigned char *bin_cookie = toxprpl_hex_string_to_data(cookie);
+        TOX_ERR_CONFERENCE_JOIN err_back_join;
+        number = tox_conference_join(plugin->tox, fnum, bin_cookie,
+                                     strlen(cookie) / 2, &err_back_join);
+        g_free(bin_cookie);
+        if (err_back_join != TOX_ERR_CONFERENCE_JOIN_OK)
+        {
+            purple_notify_error(gc, _("Error"),
+                                _("Could not join conference."), NULL);
+            return;
+        }
+    }
+    else
+    {
+        TOX_ERR_CONFERENCE_NEW err_back_new;
+        number = tox_conference_new(plugin->tox, &err_back_new);
+        if (err_back_new != TOX_ERR_CONFERENCE_NEW_OK)
+        {
+            purple_notify_error(gc, _("Error"),
+                                _("Could not create conference."), NULL);
+            return;
+        }
+
+        if ((title != NULL) && (strlen(title) > 0))
+        {
+            TOX_ERR_CONFERENCE_TITLE err_back_title;
+            tox_conference_set_title(plugin->tox, number,
+                                     (const uint8_t *)title, strlen(title),
+                                     &err_back_title);
+        }
+    }
+
+    toxprpl_log_info("joined conference %u\n", number);
+    gchar *name = toxprpl_get_chat_name(components);
+    serv_got_joined_chat(gc, number, name);
+    g_free(name);
+
+    /* fill the chat from the current peer list */
+    on_conference_peer_list_changed(plugin->tox, number, gc);
+}
+
+static void toxprpl_chat_invite(PurpleConnection *gc, int id,
+                                const char *message, const char *who)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL && plugin->tox != NULL);
+
+    PurpleAccount *account = purple_connection_get_account(gc);
+    PurpleBuddy *buddy = purple_find_buddy(account, who);
+    toxprpl_return_if_fail(buddy != NULL);
+
+    toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
+    toxprpl_return_if_fail(buddy_data != NULL);
+
+    TOX_ERR_CONFERENCE_INVITE err_back;
+    if (!tox_conference_invite(plugin->tox, buddy_data->tox_friendlist_number,
+                               id, &err_back))
+    {
+        purple_notify_error(gc, _("Error"),
+                            _("Could not invite friend to the conference."),
+                            NULL);
+    }
+}
+
+static void toxprpl_chat_leave(PurpleConnection *gc, int id)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL && plugin->tox != NULL);
+
+    toxprpl_log_info("leaving conference %d\n", id);
+    TOX_ERR_CONFERENCE_DELETE err_back;
+    tox_conference_delete(plugin->tox, id, &err_back);
+    g_hash_table_remove(plugin->conferences, GINT_TO_POINTER(id));
+}
+
+static int toxprpl_chat_send(PurpleConnection *gc, int id, const char *message,
+                             PurpleMessageFlags flags)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_val_if_fail(plugin != NULL && plugin->tox != NULL, -ENOTCONN);
+
+    char *no_html = purple_markup_strip_html(message);
+    TOX_MESSAGE_TYPE msg_type = TOX_MESSAGE_TYPE_NORMAL;
+    if (purple_message_meify(no_html, -1))
+    {
+        msg_type = TOX_MESSAGE_TYPE_ACTION;
+    }
+
+    TOX_ERR_CONFERENCE_SEND_MESSAGE err_back;
+    size_t length = strlen(no_html);
+    tox_conference_send_message(plugin->tox, id, msg_type,
+                                (const uint8_t *)no_html, length, &err_back);
+    g_free(no_html);
+
+    switch (err_back)
+    {
+        case TOX_ERR_CONFERENCE_SEND_MESSAGE_OK:
+            plugin->stats.messages_out++;
+            plugin->stats.bytes_out += length;
+            /* shown once toxcore echoes it, see on_conference_message() */
+            return 0;
+        case TOX_ERR_CONFERENCE_SEND_MESSAGE_TOO_LONG:
+            return -E2BIG;
+        case TOX_ERR_CONFERENCE_SEND_MESSAGE_NO_CONNECTION:
+            return -ENOTCONN;
+        default:
+            return -1;
+    }
+}
+
+static void toxprpl_set_chat_topic(PurpleConnection *gc, int id,
+                                   const char *topic)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL && plugin->tox != NULL);
+    toxprpl_return_if_fail(topic != NULL);
+
+    TOX_ERR_CONFERENCE_TITLE err_back;
+    if (!tox_conference_set_title(plugin->tox, id, (const uint8_t *)topic,
+                                  strlen(topic), &err_back))
+    {
+        purple_notify_error(gc, _("Error"),
+                            _("Could not change the conference title."), NULL);
+    }
+}
+
+static guint64 toxprpl_stats_file_bytes(const toxprpl_stats *stats)
+{
+    return stats->file_bytes_in + stats->file_bytes_out;
+}
+
+/* Calls tox_iterate() and keeps calling it as long as file data is sent
+ * or received, until the iterate budget is used up. Returns TRUE if the
+ * budget ran out with data still moving. Chunks waiting for room in the
+ * send queue don't count, iterating doesn't make room any faster. */
+static gboolean tox_messenger_loop(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    if ((plugin == NULL) || (plugin->tox == NULL))
+    {
+        return FALSE;
+    }
+
+    toxprpl_stats *stats = &plugin->stats;
+    gint64 now = g_get_monotonic_time();
+    gint64 deadline = now + (gint64)plugin->iterate_budget * 1000;
+    toxprpl_histogram_add(&stats->loop_lateness_msec,
+                          MAX(now - plugin->next_iterate, 0) / 1000);
+
+    gboolean busy;
+    guint iterations = 0;
+    do
+    {
+        guint64 moved = toxprpl_stats_file_bytes(stats);
+        gint64 start = now;
+
+        if (plugin->raw_pending != NULL)
+        {
+            toxprpl_raw_flush(plugin);
+        }
+        tox_iterate(plugin->tox);
+
+        now = g_get_monotonic_time();
+        toxprpl_histogram_add(&stats->iterate_usec, now - start);
+        busy = (toxprpl_stats_file_bytes(stats) != moved);
+        iterations++;
+    } while (busy && (now < deadline));
+
+    if (plugin->stalled_xfers != NULL)
+    {
+        toxprpl_xfer_retry_stalled(plugin);
+    }
+
+    if (!g_queue_is_empty(plugin->inbound))
+    {
+        toxprpl_inbound_flush(gc);
+    }
+    stats->extra_iterations += iterations - 1;
+    return busy && (plugin->iterate_budget > 0);
+}
+
+static void toxprpl_set_nick_action(PurpleConnection *gc, const char *nickname)
+{
+    PurpleAccount *account = purple_connection_get_account(gc);
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    if (nickname != NULL)
+    {
+        purple_connection_set_display_name(gc, nickname);
+        TOX_ERR_SET_INFO err_back;
+        /* TODO: Handle err_back */
+        tox_self_set_name(plugin->tox, (uint8_t *)nickname,
+                          strlen(nickname) + 1, &err_back);
+        purple_account_set_string(account, "nickname", nickname);
+    }
+}
+
+/* reconnecting */
+
+/*
+ * toxcore only finds its way back into the DHT through the nodes it still
+ * knows, which after a network change are mostly unreachable, so waiting
+ * for it can take minutes. Once the connection check sees the connection
+ * gone the nodes are bootstrapped again with exponential backoff until it
+ * is back, and right away whenever libpurple reports a network change.
+ *
+ * The nodes are the configured one plus the addresses its name resolved
+ * to on the last successful connection, cached in the account directory
+ * because a changed network often means a DNS server that is not up yet.
+ */
+
+static void toxprpl_node_free(gpointer data)
+{
+    toxprpl_node *node = data;
+    g_free(node->host);
+    g_free(node);
+}
+
+static gboolean toxprpl_node_add(toxprpl_plugin_data *plugin,
+                                 const char *host, uint16_t port,
+                                 const uint8_t *key)
+{
+    GList *l;
+    for (l = plugin->nodes; l != NULL; l = g_list_next(l))
+    {
+        toxprpl_node *node = l->data;
+        if ((node->port == port) && (strcmp(node->host, host) == 0) &&
+            (memcmp(node->key, key, TOX_PUBLIC_KEY_SIZE) == 0))
+        {
+            return FALSE;
+        }
+    }
+
+    toxprpl_node *node = g_new0(toxprpl_node, 1);
+    node->host = g_strdup(host);
+    node->port = port;
+    memcpy(node->key, key, TOX_PUBLIC_KEY_SIZE);
+    plugin->nodes = g_list_append(plugin->nodes, node);
+    return TRUE;
+}
+
+static void toxprpl_nodes_save(toxprpl_plugin_data *plugin)
+{
+    GString *out = g_string_new("");
+    char key[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+    GList *l;
+    /* the first one comes from the account settings */
+    for (l = g_list_nth(plugin->nodes, 1); l != NULL; l = g_list_next(l))
+    {
+        toxprpl_node *node = l->data;
+        toxprpl_data_to_hex_buf(node->key, TOX_PUBLIC_KEY_SIZE, key);
+        g_string_append_printf(out, "%s %u %s\n", node->host, node->port,
+                               key);
+    }
+
+    GError *error = NULL;
+    if (!g_file_set_contents(plugin->nodes_path, out->str, out->len, &error))
+    {
+        toxprpl_log_warning("could not save %s: %s\n",
+                            plugin->nodes_path, error->message);
+        g_error_free(error);
+    }
+    g_string_free(out, TRUE);
+}
+
+static void toxprpl_nodes_load(PurpleAccount *account,
+                               toxprpl_plugin_data *plugin)
+{
+    const char *key = purple_account_get_string(account, "dht_server_key",
+                                                DEFAULT_SERVER_KEY);
+    const char *host = purple_account_get_string(account, "dht_server",
+                                                 DEFAULT_SERVER_IP);
+    uint16_t port = (uint16_t)purple_account_get_int(account,
+            "dht_server_port", DEFAULT_SERVER_PORT);
+    if (strlen(key) == TOX_PUBLIC_KEY_SIZE * 2)
+    {
+        unsigned char *bin_key = toxprpl_hex_string_to_data(key);
+        toxprpl_node_add(plugin, host, port, bin_key);
+        free(bin_key);
+    }
+
+    plugin->nodes_path = g_build_filename(purple_user_dir(), "tox",
+            purple_account_get_string(account, "account_path",
+                                      DEFAULT_ACCOUNT_PATH),
+            NODES_FILENAME, NULL);
+    gchar *contents;
+    if (!g_file_get_contents(plugin->nodes_path, &contents, NULL, NULL))
+    {
+        return;
+    }
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    guint i;
+    for (i = 0; lines[i] != NULL; i++)
+    {
+        char cached_host[256];
+        char cached_key[TOX_PUBLIC_KEY_SIZE * 2 + 1];
+        guint cached_port;
+        if ((sscanf(lines[i], "%255s %u %64s", cached_host, &cached_port,
+                    cached_key) == 3) &&
+            (strlen(cached_key) == TOX_PUBLIC_KEY_SIZE * 2) &&
+            (cached_port > 0) && (cached_port <= G_MAXUINT16))
+        {
+            unsigned char *bin_key = toxprpl_hex_string_to_data(cached_key);
+            toxprpl_node_add(plugin, cached_host, cached_port, bin_key);
+            free(bin_key);
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+}
+
+static void toxprpl_nodes_resolved(GObject *resolver, GAsyncResult *result,
+                                   gpointer data)
+{
+    GError *error = NULL;
+    GList *addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(resolver),
+                                                        result, &error);
+    if (addresses == NULL)
+    {
+        /* a cancelled lookup means the account is gone */
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+            toxprpl_log_misc("not caching the DHT node: %s\n", error->message);
+        }
+        g_error_free(error);
+        return;
+    }
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(data);
+    toxprpl_node *configured = plugin->nodes->data;
+    gboolean changed = FALSE;
+    GList *l;
+    for (l = addresses; l != NULL; l = g_list_next(l))
+    {
+        gchar *address = g_inet_address_to_string(l->data);
+        changed |= toxprpl_node_add(plugin, address, configured->port,
+                                    configured->key);
+        g_free(address);
+    }
+    g_resolver_free_addresses(addresses);
+
+    /* the latest addresses were appended, drop the oldest */
+    while (g_list_length(plugin->nodes) > NODES_CACHE_SIZE + 1)
+    {
+        GList *oldest = g_list_nth(plugin->nodes, 1);
+        toxprpl_node_free(oldest->data);
+        plugin->nodes = g_list_delete_link(plugin->nodes, oldest);
+        changed = TRUE;
+    }
+    if (changed)
+    {
+        toxprpl_nodes_save(plugin);
+    }
+}
+
+/* the DHT connection is up, note how long recovering took and cache the
+ * addresses of the configured node */
+static void toxprpl_nodes_connected(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_stats *stats = &plugin->stats;
+
+    if (plugin->disconnected != 0)
+    {
+        guint64 msec = (g_get_monotonic_time() - plugin->disconnected) / 1000;
+        stats->reconnects++;
+        toxprpl_histogram_add(&stats->reconnect_msec, msec);
+        toxprpl_log_info("DHT reconnected after %" G_GUINT64_FORMAT
+                         " ms and %u bootstrap attempts\n", msec,
+                         plugin->bootstrap_attempts);
+    }
+    plugin->disconnected = 0;
+    plugin->next_bootstrap = 0;
+    plugin->bootstrap_attempts = 0;
+
+    toxprpl_node *configured = (plugin->nodes != NULL) ?
+        plugin->nodes->data : NULL;
+    if ((configured != NULL) && (plugin->nodes_resolve == NULL) &&
+        !g_hostname_is_ip_address(configured->host))
+    {
+        plugin->nodes_resolve = g_cancellable_new();
+        g_resolver_lookup_by_name_async(g_resolver_get_default(),
+                configured->host, plugin->nodes_resolve,
+                toxprpl_nodes_resolved, gc);
+    }
+}
+
+/* bootstraps from all nodes and schedules the next attempt if the
+ * connection is still down */
+static void toxprpl_rebootstrap(toxprpl_plugin_data *plugin)
+{
+    guint accepted = 0;
+    GList *l;
+    for (l = plugin->nodes; l != NULL; l = g_list_next(l))
+    {
+        toxprpl_node *node = l->data;
+        TOX_ERR_BOOTSTRAP err_back;
+        /* toxcore resolves names synchronously, which blocks the main loop
+         * up to the resolver timeout while the network is down, so names
+         * are only used until their addresses are cached */
+        if ((l == plugin->nodes) && (l->next != NULL) &&
+            !g_hostname_is_ip_address(node->host))
+        {
+            continue;
+        }
+        if (tox_bootstrap(plugin->tox, node->host, node->port, node->key,
+                          &err_back))
+        {
+            accepted++;
+            tox_add_tcp_relay(plugin->tox, node->host, node->port,
+                              node->key, &err_back);
+        }
+    }
+    plugin->stats.bootstraps++;
+    plugin->bootstrap_attempts++;
+
+    if (plugin->connected)
+    {
+        plugin->next_bootstrap = 0;
+        return;
+    }
+
+    gint64 delay = MIN((gint64)REBOOTSTRAP_BASE_DELAY <<
+                       MIN(plugin->bootstrap_attempts - 1, 16),
+                       REBOOTSTRAP_MAX_DELAY);
+    delay += delay * g_random_int_range(-REBOOTSTRAP_JITTER,
+                                        REBOOTSTRAP_JITTER + 1) / 100;
+    plugin->next_bootstrap = g_get_monotonic_time() + delay * 1000;
+    toxprpl_log_misc("bootstrapped from %u of %u nodes, next attempt in "
+                     "%" G_GINT64_FORMAT " ms\n", accepted,
+                     g_list_length(plugin->nodes), delay);
+}
+
+static void tox_connection_check(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+
+    if ((plugin->connected == 0) && tox_self_get_connection_status(plugin->tox))
+    {
+        plugin->connected = 1;
+        toxprpl_nodes_connected(gc);
+        purple_connection_update_progress(gc, _("Connected"),
+                1,   /* which connection step this is */
+                2);  /* total number of steps */
+        purple_connection_set_state(gc, PURPLE_CONNECTED);
+        purple_debug_info("toxprpl", "DHT connected!\n");
+
+        /* query status of all buddies */
+        PurpleAccount *account = purple_connection_get_account(gc);
+        GSList *buddy_list = purple_find_buddies(account, NULL);
+        g_slist_foreach(buddy_list, toxprpl_query_buddy_info, gc);
+        g_slist_free(buddy_list);
+
+        uint8_t our_name[TOX_MAX_NAME_LENGTH + 1];
+        tox_self_get_name(plugin->tox, our_name);
+        size_t name_len = tox_self_get_name_size(plugin->tox);
+        /* bug in the library? */
+        if (name_len == 0)
+        {
+            our_name[0] = '\0';
         }
         our_name[TOX_MAX_NAME_LENGTH] = '\0';
 
-        purple_debug_info("toxprpl", "checking for nickname\n");
+        purple_debug_info("toxprpl", "checking for nickname\n");
+
+        const char *nick = purple_account_get_string(account, "nickname", NULL);
+        if (strlen(nick) == 0)
+        {
+            if (strlen((const char *)our_name) > 0)
+            {
+                purple_connection_set_display_name(gc, (const char *)our_name);
+                purple_account_set_string(account, "nickname",
+                                                      (const char *)our_name);
+            }
+        }
+        else
+        {
+            toxprpl_set_nick_action(gc, nick);
+        }
+
+        PurpleStatus* status = purple_account_get_active_status(account);
+        if (status != NULL)
+        {
+            purple_debug_info("toxprpl", "(re)setting status\n");
+            toxprpl_set_status(account, status);
+        }
+    }
+    else if ((plugin->connected == 1) && !tox_self_get_connection_status(plugin->tox))
+    {
+        plugin->connected = 0;
+        plugin->disconnected = g_get_monotonic_time();
+        plugin->bootstrap_attempts = 0;
+        plugin->next_bootstrap = plugin->disconnected;
+        purple_debug_info("toxprpl", "DHT disconnected!\n");
+        purple_connection_notice(gc,
+                _("Connection to DHT server lost, attempging to reconnect..."));
+        purple_connection_update_progress(gc, _("Reconnecting..."),
+                0,   /* which connection step this is */
+                2);  /* total number of steps */
+    }
+
+    if ((plugin->next_bootstrap != 0) &&
+        (plugin->next_bootstrap <= g_get_monotonic_time()))
+    {
+        toxprpl_rebootstrap(plugin);
+    }
+}
+
+/* rounds a monotonic time up to the next multiple of granularity msec */
+static gint64 toxprpl_scheduler_align(gint64 when, guint granularity)
+{
+    gint64 step = (gint64)granularity * 1000;
+    return ((when + step - 1) / step) * step;
+}
+
+static void toxprpl_scheduler_arm(void);
+
+static gboolean toxprpl_scheduler_tick(gpointer data)
+{
+    scheduler.timer = 0;
+    gint64 now = g_get_monotonic_time();
+
+    GList *l = scheduler.connections;
+    while (l != NULL)
+    {
+        PurpleConnection *gc = l->data;
+        toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+        l = g_list_next(l);
+
+        if (plugin->next_iterate <= now)
+        {
+            /* with transfers still running give the main loop a chance and
+             * come back on the next tick */
+            guint interval = 0;
+            if (!tox_messenger_loop(gc))
+            {
+                interval = MIN(tox_iteration_interval(plugin->tox),
+                               MESSENGER_LOOP_INTERVAL);
+            }
+            plugin->next_iterate = toxprpl_scheduler_align(
+                    g_get_monotonic_time() + interval * 1000,
+                    SCHEDULER_GRANULARITY);
+        }
+
+        if (plugin->next_connection_check <= now)
+        {
+            tox_connection_check(gc);
+            toxprpl_link_probe(gc);
+#ifdef HAVE_TOXAV
+            toxprpl_av_adapt(gc);
+#endif
+            plugin->next_connection_check = toxprpl_scheduler_align(
+                    now + CONNECTION_CHECK_INTERVAL * 1000,
+                    CONNECTION_CHECK_GRANULARITY);
+        }
+    }
+
+    toxprpl_scheduler_arm();
+    return FALSE;
+}
+
+/* (re)starts the timer for the earliest deadline of all accounts */
+static void toxprpl_scheduler_arm(void)
+{
+    gint64 next = G_MAXINT64;
+    GList *l;
+    for (l = scheduler.connections; l != NULL; l = g_list_next(l))
+    {
+        toxprpl_plugin_data *plugin =
+                purple_connection_get_protocol_data(l->data);
+        next = MIN(next, MIN(plugin->next_iterate,
+                             plugin->next_connection_check));
+    }
+
+    if ((scheduler.timer != 0) && (next >= scheduler.next_tick))
+    {
+        return;
+    }
+    if (scheduler.timer != 0)
+    {
+        purple_timeout_remove(scheduler.timer);
+        scheduler.timer = 0;
+    }
+    if (next == G_MAXINT64)
+    {
+        return;
+    }
+
+    /* rounded up, firing early would find nothing due and spin */
+    gint64 delay = (MAX(next - g_get_monotonic_time(), 0) + 999) / 1000;
+    scheduler.next_tick = next;
+    scheduler.timer = purple_timeout_add(delay, toxprpl_scheduler_tick, NULL);
+}
+
+/* brings the next tick of an account forward to the next scheduler step,
+ * records queued until then share frames */
+static void toxprpl_scheduler_wake(toxprpl_plugin_data *plugin)
+{
+    gint64 soon = toxprpl_scheduler_align(g_get_monotonic_time(),
+                                          SCHEDULER_GRANULARITY);
+    if (soon < plugin->next_iterate)
+    {
+        plugin->next_iterate = soon;
+        toxprpl_scheduler_arm();
+    }
+}
+
+static void toxprpl_scheduler_add(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    gint64 now = g_get_monotonic_time();
+
+    plugin->next_iterate = toxprpl_scheduler_align(now,
+                                                   SCHEDULER_GRANULARITY);
+    plugin->next_connection_check = toxprpl_scheduler_align(
+            now + CONNECTION_CHECK_INTERVAL * 1000,
+            CONNECTION_CHECK_GRANULARITY);
+    scheduler.connections = g_list_prepend(scheduler.connections, gc);
+    toxprpl_scheduler_arm();
+    toxprpl_log_misc("scheduling %u account(s)\n",
+                     g_list_length(scheduler.connections));
+}
+
+static void toxprpl_scheduler_remove(PurpleConnection *gc)
+{
+    scheduler.connections = g_list_remove(scheduler.connections, gc);
+    if ((scheduler.connections == NULL) && (scheduler.timer != 0))
+    {
+        purple_timeout_remove(scheduler.timer);
+        scheduler.timer = 0;
+    }
+}
+
+/* libpurple saw an interface or address change, toxcore keeps talking
+ * to the old network until its timeouts run out */
+static void toxprpl_network_changed(void *data)
+{
+    gint64 now = g_get_monotonic_time();
+    GList *l;
+    for (l = scheduler.connections; l != NULL; l = g_list_next(l))
+    {
+        toxprpl_plugin_data *plugin =
+                purple_connection_get_protocol_data(l->data);
+        plugin->stats.network_changes++;
+        plugin->bootstrap_attempts = 0;
+        plugin->next_bootstrap = now;
+        plugin->next_connection_check = toxprpl_scheduler_align(now,
+                SCHEDULER_GRANULARITY);
+    }
+    toxprpl_scheduler_arm();
+}
+
+static void toxprpl_set_status(PurpleAccount *account, PurpleStatus *status)
+{
+    const char* status_id = purple_status_get_id(status);
+    const char *message = purple_status_get_attr_string(status, "message");
+
+    PurpleConnection *gc = purple_account_get_connection(account);
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+
+    purple_debug_info("toxprpl", "setting status %s\n", status_id);
+
+    TOX_USER_STATUS tox_status;
+    if (!toxprpl_get_tox_status_from_id(status_id, &tox_status))
+    {
+      purple_debug_info("toxprpl", "status %s is invalid\n", status_id);
+      return;
+    }
+
+    tox_self_set_status(plugin->tox, tox_status);
+    if ((message != NULL) && (strlen(message) > 0))
+    {
+        TOX_ERR_SET_INFO err_back;
+        /* TODO: Handle err_back */
+        tox_self_set_status_message(plugin->tox, (uint8_t *)message,
+                                    strlen(message) + 1, &err_back);
+    }
+}
+
+/* query buddy status */
+static void toxprpl_query_buddy_info(gpointer data, gpointer user_data)
+{
+    toxprpl_log_trace("toxprpl_query_buddy_info\n");
+    PurpleBuddy *buddy = (PurpleBuddy *)data;
+    PurpleConnection *gc = (PurpleConnection *)user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+
+    toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
+    if (buddy_data == NULL)
+    {
+        unsigned char *bin_key = toxprpl_hex_string_to_data(buddy->name);
+        TOX_ERR_FRIEND_BY_PUBLIC_KEY err_back;
+        /* TODO: Handle err_back */
+        uint32_t fnum = tox_friend_by_public_key(plugin->tox, bin_key,
+                                                 &err_back);
+        buddy_data = g_new0(toxprpl_buddy_data, 1);
+        buddy_data->tox_friendlist_number = fnum;
+        purple_buddy_set_protocol_data(buddy, buddy_data);
+        g_free(bin_key);
+    }
+
+    PurpleAccount *account = purple_connection_get_account(gc);
+    TOX_ERR_FRIEND_QUERY err_back_status;
+    TOX_USER_STATUS userstatus = tox_friend_get_status(plugin->tox,
+            buddy_data->tox_friendlist_number, &err_back_status);
+    const char *status = toxprpl_statuses[toxprpl_get_status_index(plugin->tox,
+            buddy_data->tox_friendlist_number, userstatus)].id;
+    toxprpl_log_trace("Setting user status for user %s to %s (%d)\n",
+                      buddy->name, status, err_back_status);
+    purple_prpl_got_user_status(account, buddy->name, status, NULL);
+
+    uint8_t alias[TOX_MAX_NAME_LENGTH + 1];
+    TOX_ERR_FRIEND_QUERY err_back;
+    /* TODO: handle err_back */
+    if (tox_friend_get_name(plugin->tox, buddy_data->tox_friendlist_number,
+                            alias, &err_back) == 0)
+    {
+        alias[TOX_MAX_NAME_LENGTH] = '\0';
+        purple_blist_alias_buddy(buddy, (const char*)alias);
+    }
+}
+
+static const char *toxprpl_list_icon(PurpleAccount *acct, PurpleBuddy *buddy)
+{
+    return "tox";
+}
+
+static void toxprpl_tooltip_text(PurpleBuddy *buddy,
+                                 PurpleNotifyUserInfo *user_info,
+                                 gboolean full)
+{
+    PurpleConnection *gc = purple_account_get_connection(
+            purple_buddy_get_account(buddy));
+    toxprpl_plugin_data *plugin = (gc != NULL) ?
+        purple_connection_get_protocol_data(gc) : NULL;
+    toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
+    if ((plugin == NULL) || (buddy_data == NULL))
+    {
+        return;
+    }
+    const toxprpl_friend_data *fdata = g_hash_table_lookup(plugin->friends,
+            GUINT_TO_POINTER(buddy_data->tox_friendlist_number));
+    if (fdata == NULL)
+    {
+        return;
+    }
+
+    if (fdata->connection == TOX_CONNECTION_UDP)
+    {
+        purple_notify_user_info_add_pair(user_info, _("Connection"),
+                                         _("UDP (direct)"));
+    }
+    else if (fdata->connection == TOX_CONNECTION_TCP)
+    {
+        purple_notify_user_info_add_pair(user_info, _("Connection"),
+                                         _("TCP (relayed)"));
+    }
+
+    if (fdata->rtt_avg_usec > 0)
+    {
+        gchar *rtt = g_strdup_printf(_("%u ms (average %u ms)"),
+                                     (guint)(fdata->rtt_usec / 1000),
+                                     (guint)(fdata->rtt_avg_usec / 1000));
+        purple_notify_user_info_add_pair(user_info, _("Round trip time"),
+                                         rtt);
+        g_free(rtt);
+    }
+
+    if (!full)
+    {
+        return;
+    }
+
+    gint64 now = g_get_monotonic_time();
+    guint udp = toxprpl_link_path_usec(fdata, TOX_CONNECTION_UDP, now) /
+                G_USEC_PER_SEC;
+    guint tcp = toxprpl_link_path_usec(fdata, TOX_CONNECTION_TCP, now) /
+                G_USEC_PER_SEC;
+    if (udp > 0)
+    {
+        gchar *time = purple_str_seconds_to_string(udp);
+        purple_notify_user_info_add_pair(user_info, _("Time on UDP"), time);
+        g_free(time);
+    }
+    if (tcp > 0)
+    {
+        gchar *time = purple_str_seconds_to_string(tcp);
+        purple_notify_user_info_add_pair(user_info, _("Time on TCP"), time);
+        g_free(time);
+    }
+    if (fdata->pings_lost > 0)
+    {
+        gchar *lost = g_strdup_printf("%u", fdata->pings_lost);
+        purple_notify_user_info_add_pair(user_info, _("Unanswered pings"),
+                                         lost);
+        g_free(lost);
+    }
+}
+
+static GList *toxprpl_status_types(PurpleAccount *acct)
+{
+    GList *types = NULL;
+    PurpleStatusType *type;
+    int i;
+
+    purple_debug_info("toxprpl", "setting up status types\n");
+
+    for (i = 0; i < TOXPRPL_MAX_STATUS; i++)
+    {
+        type = purple_status_type_new_with_attrs(toxprpl_statuses[i].primitive,
+            toxprpl_statuses[i].id, toxprpl_statuses[i].title, TRUE, TRUE,
+            FALSE,
+            "message", _("Message"), purple_value_new(PURPLE_TYPE_STRING),
+            NULL);
+        types = g_list_append(types, type);
+    }
+
+    return types;
+}
+
+static PurpleCmdRet toxprpl_myid_cmd_cb(PurpleConversation *conv,
+                                        const gchar *cmd, gchar **args,
+                                        gchar **error, void *data)
+{
+    purple_debug_info("toxprpl", "/myid command detected\n");
+    PurpleConnection *gc = (PurpleConnection *)data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+
+    uint8_t bin_id[TOX_ADDRESS_SIZE];
+    tox_self_get_address(plugin->tox, bin_id);
+    gchar *id = toxprpl_tox_friend_id_to_string(bin_id);
+
+    gchar *message = g_strdup_printf(_("If someone wants to add you, give them "
+                                       "this id: %s"), id);
+
+    purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_SYSTEM,
+                              time(NULL));
+    g_free(id);
+    g_free(message);
+    return PURPLE_CMD_RET_OK;
+}
+
+static PurpleCmdRet toxprpl_nick_cmd_cb(PurpleConversation *conv,
+                                        const gchar *cmd, gchar **args,
+                                        gchar **error, void *data)
+{
+    purple_debug_info("toxprpl", "/nick %s command detected\n", args[0]);
+    PurpleConnection *gc = (PurpleConnection *)data;
+    toxprpl_set_nick_action(gc, args[0]);
+    return PURPLE_CMD_RET_OK;
+}
+
+static PurpleCmdRet toxprpl_stats_cmd_cb(PurpleConversation *conv,
+                                         const gchar *cmd, gchar **args,
+                                         gchar **error, void *data)
+{
+    PurpleConnection *gc = (PurpleConnection *)data;
+    if (purple_conversation_get_gc(conv) != gc)
+    {
+        /* registered once per account */
+        return PURPLE_CMD_RET_CONTINUE;
+    }
+
+    gchar *text = toxprpl_stats_format(gc);
+    toxprpl_return_val_if_fail(text != NULL, PURPLE_CMD_RET_FAILED);
+
+    gchar *message = purple_strdup_withhtml(text);
+    purple_conversation_write(conv, NULL, message,
+                              PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG,
+                              time(NULL));
+    g_free(message);
+    g_free(text);
+    return PURPLE_CMD_RET_OK;
+}
+
+static PurpleCmdRet toxprpl_ping_cmd_cb(PurpleConversation *conv,
+                                        const gchar *cmd, gchar **args,
+                                        gchar **error, void *data)
+{
+    PurpleConnection *gc = (PurpleConnection *)data;
+    if (purple_conversation_get_gc(conv) != gc)
+    {
+        /* registered once per account */
+        return PURPLE_CMD_RET_CONTINUE;
+    }
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    PurpleBuddy *buddy = purple_find_buddy(purple_connection_get_account(gc),
+                                           purple_conversation_get_name(conv));
+    toxprpl_buddy_data *buddy_data = (buddy != NULL) ?
+        purple_buddy_get_protocol_data(buddy) : NULL;
+    toxprpl_friend_data *fdata = (buddy_data != NULL) ?
+        g_hash_table_lookup(plugin->friends,
+                GUINT_TO_POINTER(buddy_data->tox_friendlist_number)) : NULL;
+    if ((fdata == NULL) || (fdata->connection == TOX_CONNECTION_NONE))
+    {
+        *error = g_strdup(_("The buddy is offline"));
+        return PURPLE_CMD_RET_FAILED;
+    }
+    if (!(fdata->peer_caps & TOXPRPL_CAP_PING))
+    {
+        *error = g_strdup(_("The buddy's client does not answer pings"));
+        return PURPLE_CMD_RET_FAILED;
+    }
+    if ((fdata->ping_sent == 0) && !toxprpl_link_ping(plugin, fdata))
+    {
+        *error = g_strdup(_("Could not send the ping"));
+        return PURPLE_CMD_RET_FAILED;
+    }
+    fdata->ping_report = TRUE;
+    return PURPLE_CMD_RET_OK;
+}
+
+static void toxprpl_sync_add_buddy(PurpleAccount *account, Tox *tox,
+                                   int friend_number)
+{
+    uint8_t alias[TOX_MAX_NAME_LENGTH + 1];
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back_key;
+    /* TODO: Hanndle err_back */
+    if (tox_friend_get_public_key(tox, friend_number, public_key,
+                                  &err_back_key) != true)
+    {
+        purple_debug_info("toxprpl", "Could not get id of friend #%d\n",
+                          friend_number);
+        return;
+    }
+
+    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
+
+    PurpleBuddy *buddy;
+    TOX_ERR_FRIEND_QUERY err_back_name;
+    /* TODO: Handle err_back_name */
+    int ret = tox_friend_get_name(tox, friend_number, alias, &err_back_name);
+    alias[TOX_MAX_NAME_LENGTH] = '\0';
+    if ((ret == 0) && (strlen((const char *)alias) > 0))
+    {
+        purple_debug_info("toxprpl", "Got friend alias %s\n", alias);
+        buddy = purple_buddy_new(account, buddy_key, (const char*)alias);
+    }
+    else
+    {
+        purple_debug_info("toxprpl", "Adding [%s]\n", buddy_key);
+        buddy = purple_buddy_new(account, buddy_key, NULL);
+    }
+
+    toxprpl_buddy_data *buddy_data = g_new0(toxprpl_buddy_data, 1);
+    buddy_data->tox_friendlist_number = friend_number;
+    purple_buddy_set_protocol_data(buddy, buddy_data);
+    purple_blist_add_buddy(buddy, NULL, NULL, NULL);
+    TOX_ERR_FRIEND_QUERY err_back_status;
+    /* TODO: Handle err_back_status */
+    TOX_USER_STATUS userstatus = tox_friend_get_status(tox, friend_number,
+                                                       &err_back_status);
+    purple_debug_info("toxprpl", "Friend %s has status %d\n", buddy_key,
+                      userstatus);
+    purple_prpl_got_user_status(account, buddy_key,
+        toxprpl_statuses[
+            toxprpl_get_status_index(tox,friend_number,userstatus)].id,
+        NULL);
+    g_free(buddy_key);
+}
+
+static void toxprpl_sync_friends(PurpleAccount *acct, Tox *tox)
+{
+    uint32_t i;
+
+    uint32_t fl_len = tox_self_get_friend_list_size(tox);
+    uint32_t *friendlist = g_malloc0(fl_len * sizeof(uint32_t));
+
+    if (fl_len != 0)
+    {
+        tox_self_get_friend_list(tox, friendlist);
+        purple_debug_info("toxprpl", "got %u friends\n", fl_len);
+        GSList *buddies = purple_find_buddies(acct, NULL);
+        GSList *iterator;
+        for (i = 0; i < fl_len; i++)
+        {
+            iterator = buddies;
+            uint32_t fnum = friendlist[i];
+            uint8_t bin_id[TOX_PUBLIC_KEY_SIZE];
+            TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
+            /* TODO: Hanndle err_back */
+            if (tox_friend_get_public_key(tox, fnum, bin_id, &err_back) == 0)
+            {
+                gchar *str_id = toxprpl_tox_bin_id_to_string(bin_id);
+                while (iterator != NULL)
+                {
+                    PurpleBuddy *buddy = iterator->data;
+                    if (strcmp(buddy->name, str_id) == 0)
+                    {
+                        toxprpl_buddy_data *buddy_data =
+                                    g_new0(toxprpl_buddy_data, 1);
+                        buddy_data->tox_friendlist_number = fnum;
+                        purple_buddy_set_protocol_data(buddy, buddy_data);
+                        friendlist[i] = -1;
+                    }
+                    iterator = iterator->next;
+                }
+                g_free(str_id);
+            }
+        }
+
+        iterator = buddies;
+        /* all left without buddy_data were not present in Tox and must be */
+        /* removed */
+        while (iterator != NULL)
+        {
+            PurpleBuddy *buddy = iterator->data;
+            toxprpl_buddy_data *buddy_data =
+                purple_buddy_get_protocol_data(buddy);
+            if (buddy_data == NULL)
+            {
+                purple_blist_remove_buddy(buddy);
+            }
+            iterator = iterator->next;
+        }
+
+        g_slist_free(buddies);
+    }
+
+    /* all left in friendlist that were not reset are not yet in blist */
+    for (i = 0; i < fl_len; i++)
+    {
+        if (friendlist[i] != -1)
+        {
+            toxprpl_sync_add_buddy(acct, tox, friendlist[i]);
+        }
+    }
+
+    g_free(friendlist);
+}
+
+static gboolean toxprpl_save_account(PurpleAccount *account, Tox* tox)
+{
+    PurpleConnection *gc = purple_account_get_connection(account);
+    const char *key = purple_account_get_string(account, "account_path",
+                                          DEFAULT_ACCOUNT_PATH);
+    gchar* filename = g_build_filename(purple_user_dir(), "tox", key,
+                                       "tox_save.tox", NULL);
+    gchar* dirname = g_path_get_dirname(filename);
+    g_mkdir_with_parents(dirname, 0777);
+    gint64 start = g_get_monotonic_time();
+    toxprpl_user_export(gc, filename);
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    if (plugin != NULL)
+    {
+        toxprpl_histogram_add(&plugin->stats.save_usec,
+                              g_get_monotonic_time() - start);
+    }
+    g_free(dirname);
+    g_free(filename);
+    return TRUE;
+}
+
+#ifdef HAVE_TOXAV
+/* audio and video calls */
+
+/*
+ * Calls go through toxav, which brings its own transport, so instead of
+ * libpurple's farstream based media backend the plugin runs the media
+ * itself: GStreamer pipelines capture from and play to the devices, and
+ * calls are controlled from the buddy menu, an answer dialog and /hangup.
+ *
+ * toxav_iterate() runs on a thread of its own at toxav's interval, so
+ * neither the UI nor tox_iterate() with file I/O can delay audio frames.
+ * Received frames are decoded there and pushed into the playback
+ * pipelines, captured ones are sent from GStreamer's streaming threads.
+ * Only call setup and teardown happen on the main thread.
+ *
+ * toxav does not adapt to the link by itself, it only relays the loss its
+ * peer measures as lowered rate suggestions. Every connection check the
+ * main thread combines that with the jitter of the audio we receive, which
+ * over a shared TCP relay rises with the queue in both directions, and
+ * sets new bit rates, capping video while the friend is on a relay.
+ */
+
+/* GStreamer elements used for calls, NULL leaves that part out, the
+ * benchmarks replace them with generated sources */
+static const char *toxprpl_av_audio_source = "autoaudiosrc";
+static const char *toxprpl_av_audio_sink = "autoaudiosink";
+static const char *toxprpl_av_video_source = "autovideosrc";
+static const char *toxprpl_av_video_sink = "autovideosink";
 
-        const char *nick = purple_account_get_string(account, "nickname", NULL);
-        if (strlen(nick) == 0)
+static toxprpl_call *toxprpl_call_ref(toxprpl_call *call)
+{
+    g_atomic_int_inc(&call->ref);
+    return call;
+}
+
+static void toxprpl_call_unref(gpointer data)
+{
+    toxprpl_call *call = data;
+    if (!g_atomic_int_dec_and_test(&call->ref))
+    {
+        return;
+    }
+
+    GstElement *pipelines[] =
+    {
+        call->audio_in, call->audio_out, call->video_in, call->video_out
+    };
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS(pipelines); i++)
+    {
+        if (pipelines[i] != NULL)
         {
-            if (strlen((const char *)our_name) > 0)
+            gst_object_unref(pipelines[i]);
+        }
+    }
+    if (call->audio_src != NULL)
+    {
+        gst_object_unref(call->audio_src);
+    }
+    if (call->video_src != NULL)
+    {
+        gst_object_unref(call->video_src);
+    }
+    g_free(call->who);
+    g_free(call);
+}
+
+/* returns a new reference to the call with a friend or NULL */
+static toxprpl_call *toxprpl_call_lookup(toxprpl_plugin_data *plugin,
+                                         uint32_t fnum)
+{
+    g_mutex_lock(&plugin->av_lock);
+    toxprpl_call *call = g_hash_table_lookup(plugin->calls,
+                                             GUINT_TO_POINTER(fnum));
+    if (call != NULL)
+    {
+        toxprpl_call_ref(call);
+    }
+    g_mutex_unlock(&plugin->av_lock);
+    return call;
+}
+
+static gpointer toxprpl_av_thread(gpointer data)
+{
+    toxprpl_plugin_data *plugin = data;
+    toxprpl_stats *stats = &plugin->stats;
+    gint64 next = g_get_monotonic_time();
+
+    while (g_atomic_int_get(&plugin->av_running))
+    {
+        gint64 start = g_get_monotonic_time();
+        toxprpl_histogram_add(&stats->av_lateness_msec,
+                              MAX(start - next, 0) / 1000);
+        toxav_iterate(plugin->toxav);
+        gint64 now = g_get_monotonic_time();
+        toxprpl_histogram_add(&stats->av_iterate_usec, now - start);
+
+        next = start + (gint64)toxav_iteration_interval(plugin->toxav) * 1000;
+        if (next > now)
+        {
+            g_usleep(next - now);
+        }
+    }
+    return NULL;
+}
+
+static void toxprpl_av_notice(PurpleConnection *gc, const char *who,
+                              const char *message)
+{
+    PurpleConversation *conv = purple_conversation_new(PURPLE_CONV_TYPE_IM,
+            purple_connection_get_account(gc), who);
+    purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_SYSTEM,
+                              time(NULL));
+}
+
+static GstFlowReturn toxprpl_av_audio_captured(GstAppSink *sink,
+                                               gpointer data)
+{
+    toxprpl_call *call = data;
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (sample == NULL)
+    {
+        return GST_FLOW_EOS;
+    }
+
+    GstMapInfo map;
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    if ((buffer != NULL) && gst_buffer_map(buffer, &map, GST_MAP_READ))
+    {
+        /* toxav wants whole opus frames, GStreamer buffers are sized as
+         * the source likes */
+        const int16_t *pcm = (const int16_t *)map.data;
+        size_t samples = map.size / sizeof(int16_t);
+        while (samples > 0)
+        {
+            size_t length = MIN(samples, G_N_ELEMENTS(call->audio_frame) -
+                                         call->audio_buffered);
+            memcpy(call->audio_frame + call->audio_buffered, pcm,
+                   length * sizeof(int16_t));
+            call->audio_buffered += length;
+            pcm += length;
+            samples -= length;
+
+            if (call->audio_buffered == G_N_ELEMENTS(call->audio_frame))
             {
-                purple_connection_set_display_name(gc, (const char *)our_name);
-                purple_account_set_string(account, "nickname",
-                                                      (const char *)our_name);
+                TOXAV_ERR_SEND_FRAME err_back;
+                if (toxav_audio_send_frame(call->toxav, call->friendnumber,
+                                           call->audio_frame,
+                                           AV_AUDIO_FRAME_SAMPLES,
+                                           AV_AUDIO_CHANNELS, AV_AUDIO_RATE,
+                                           &err_back))
+                {
+                    g_atomic_int_inc(&call->stats->audio_frames_out);
+                }
+                call->audio_buffered = 0;
             }
         }
-        else
+        gst_buffer_unmap(buffer, &map);
+    }
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
+
+static GstFlowReturn toxprpl_av_video_captured(GstAppSink *sink,
+                                               gpointer data)
+{
+    toxprpl_call *call = data;
+    GstSample *sample = gst_app_sink_pull_sample(sink);
+    if (sample == NULL)
+    {
+        return GST_FLOW_EOS;
+    }
+
+    /* the capture caps fix the size to one without row padding */
+    GstMapInfo map;
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    if ((buffer != NULL) && gst_buffer_map(buffer, &map, GST_MAP_READ))
+    {
+        const size_t luma = AV_VIDEO_WIDTH * AV_VIDEO_HEIGHT;
+        if (map.size >= luma * 3 / 2)
         {
-            toxprpl_set_nick_action(gc, nick);
+            TOXAV_ERR_SEND_FRAME err_back;
+            if (toxav_video_send_frame(call->toxav, call->friendnumber,
+                                       AV_VIDEO_WIDTH, AV_VIDEO_HEIGHT,
+                                       map.data, map.data + luma,
+                                       map.data + luma + luma / 4,
+                                       &err_back))
+            {
+                g_atomic_int_inc(&call->stats->video_frames_out);
+            }
         }
+        gst_buffer_unmap(buffer, &map);
+    }
+    gst_sample_unref(sample);
+    return GST_FLOW_OK;
+}
 
-        PurpleStatus* status = purple_account_get_active_status(account);
-        if (status != NULL)
+static void on_audio_receive_frame(ToxAV *av, uint32_t fnum,
+                                   const int16_t *pcm, size_t sample_count,
+                                   uint8_t channels, uint32_t sampling_rate,
+                                   void *user_data)
+{
+    toxprpl_plugin_data *plugin = user_data;
+    toxprpl_call *call = toxprpl_call_lookup(plugin, fnum);
+    if (call == NULL)
+    {
+        return;
+    }
+    g_atomic_int_inc(&plugin->stats.audio_frames_in);
+
+    /* without RTP timestamps this is the deviation of the arrival spacing
+     * from the frame duration, smoothed like RFC 3550 does */
+    gint64 now = g_get_monotonic_time();
+    g_mutex_lock(&plugin->av_lock);
+    if ((call->audio_arrival != 0) && (sampling_rate > 0))
+    {
+        gint64 expected = (gint64)sample_count * G_USEC_PER_SEC /
+                          sampling_rate;
+        gint64 deviation = ABS((now - call->audio_arrival) - expected);
+        call->jitter_usec += (deviation - call->jitter_usec) /
+                             AV_JITTER_WEIGHT;
+    }
+    call->audio_arrival = now;
+    g_mutex_unlock(&plugin->av_lock);
+
+    if (call->audio_src != NULL)
+    {
+        if ((channels != call->audio_channels) ||
+            (sampling_rate != call->audio_rate))
         {
-            purple_debug_info("toxprpl", "(re)setting status\n");
-            toxprpl_set_status(account, status);
+            GstCaps *caps = gst_caps_new_simple("audio/x-raw",
+                    "format", G_TYPE_STRING, AV_AUDIO_FORMAT,
+                    "layout", G_TYPE_STRING, "interleaved",
+                    "channels", G_TYPE_INT, (gint)channels,
+                    "rate", G_TYPE_INT, (gint)sampling_rate, NULL);
+            gst_app_src_set_caps(call->audio_src, caps);
+            gst_caps_unref(caps);
+            call->audio_channels = channels;
+            call->audio_rate = sampling_rate;
         }
+
+        gsize size = sample_count * channels * sizeof(int16_t);
+        GstBuffer *buffer = gst_buffer_new_allocate(NULL, size, NULL);
+        gst_buffer_fill(buffer, 0, pcm, size);
+        gst_app_src_push_buffer(call->audio_src, buffer);
     }
-    else if ((plugin->connected == 1) && !tox_self_get_connection_status(plugin->tox))
+    toxprpl_call_unref(call);
+}
+
+/* copies a plane row by row, toxav's strides differ from GStreamer's */
+static void toxprpl_av_copy_plane(uint8_t *dst, gsize dst_stride,
+                                  const uint8_t *src, int32_t src_stride,
+                                  guint width, guint height)
+{
+    guint row;
+    for (row = 0; row < height; row++)
     {
-        plugin->connected = 0;
-        purple_debug_info("toxprpl", "DHT disconnected!\n");
-        purple_connection_notice(gc,
-                _("Connection to DHT server lost, attempging to reconnect..."));
-        purple_connection_update_progress(gc, _("Reconnecting..."),
-                0,   /* which connection step this is */
-                2);  /* total number of steps */
+        memcpy(dst + row * dst_stride, src + (gssize)row * src_stride,
+               width);
     }
-    return TRUE;
 }
 
-static void toxprpl_set_status(PurpleAccount *account, PurpleStatus *status)
+static void on_video_receive_frame(ToxAV *av, uint32_t fnum, uint16_t width,
+                                   uint16_t height, const uint8_t *y,
+                                   const uint8_t *u, const uint8_t *v,
+                                   int32_t ystride, int32_t ustride,
+                                   int32_t vstride, void *user_data)
 {
-    const char* status_id = purple_status_get_id(status);
-    const char *message = purple_status_get_attr_string(status, "message");
+    toxprpl_plugin_data *plugin = user_data;
+    toxprpl_call *call = toxprpl_call_lookup(plugin, fnum);
+    if (call == NULL)
+    {
+        return;
+    }
+    g_atomic_int_inc(&plugin->stats.video_frames_in);
 
-    PurpleConnection *gc = purple_account_get_connection(account);
-    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    if (call->video_src != NULL)
+    {
+        if ((width != call->video_width) || (height != call->video_height))
+        {
+            GstCaps *caps = gst_caps_new_simple("video/x-raw",
+                    "format", G_TYPE_STRING, "I420",
+                    "width", G_TYPE_INT, (gint)width,
+                    "height", G_TYPE_INT, (gint)height, NULL);
+            gst_app_src_set_caps(call->video_src, caps);
+            gst_caps_unref(caps);
+            call->video_width = width;
+            call->video_height = height;
+        }
 
-    purple_debug_info("toxprpl", "setting status %s\n", status_id);
+        /* GStreamer's default I420 layout */
+        guint chroma_width = GST_ROUND_UP_2(width) / 2;
+        guint chroma_height = GST_ROUND_UP_2(height) / 2;
+        gsize luma_stride = GST_ROUND_UP_4(width);
+        gsize chroma_stride = GST_ROUND_UP_4(chroma_width);
+        gsize u_offset = luma_stride * GST_ROUND_UP_2(height);
+        gsize v_offset = u_offset + chroma_stride * chroma_height;
+
+        GstBuffer *buffer = gst_buffer_new_allocate(NULL,
+                v_offset + chroma_stride * chroma_height, NULL);
+        GstMapInfo map;
+        if (gst_buffer_map(buffer, &map, GST_MAP_WRITE))
+        {
+            toxprpl_av_copy_plane(map.data, luma_stride, y, ystride, width,
+                                  height);
+            toxprpl_av_copy_plane(map.data + u_offset, chroma_stride, u,
+                                  ustride, chroma_width, chroma_height);
+            toxprpl_av_copy_plane(map.data + v_offset, chroma_stride, v,
+                                  vstride, chroma_width, chroma_height);
+            gst_buffer_unmap(buffer, &map);
+            gst_app_src_push_buffer(call->video_src, buffer);
+        }
+        else
+        {
+            gst_buffer_unref(buffer);
+        }
+    }
+    toxprpl_call_unref(call);
+}
 
-    TOX_USER_STATUS tox_status;
-    if (!toxprpl_get_tox_status_from_id(status_id, &tox_status))
+/* builds a pipeline around an element description, returns NULL and
+ * leaves that direction out if there is none or it does not work */
+static GstElement *toxprpl_av_pipeline(const char *format,
+                                       const char *element, ...)
+{
+    if ((element == NULL) || (*element == '\0'))
     {
-      purple_debug_info("toxprpl", "status %s is invalid\n", status_id);
-      return;
+        return NULL;
     }
 
-    tox_self_set_status(plugin->tox, tox_status);
-    if ((message != NULL) && (strlen(message) > 0))
+    va_list args;
+    va_start(args, element);
+    gchar *description = g_strdup_vprintf(format, args);
+    va_end(args);
+
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch(description, &error);
+    if (error != NULL)
     {
-        TOX_ERR_SET_INFO err_back;
-        /* TODO: Handle err_back */
-        tox_self_set_status_message(plugin->tox, (uint8_t *)message,
-                                    strlen(message) + 1, &err_back);
+        toxprpl_log_warning("pipeline \"%s\": %s\n", description,
+                            error->message);
+        g_error_free(error);
+        if (pipeline != NULL)
+        {
+            gst_object_unref(pipeline);
+            pipeline = NULL;
+        }
     }
+    g_free(description);
+    return pipeline;
 }
 
-/* query buddy status */
-static void toxprpl_query_buddy_info(gpointer data, gpointer user_data)
+static void toxprpl_call_start_media(toxprpl_call *call)
+{
+    static GstAppSinkCallbacks audio_callbacks =
+    {
+        NULL, NULL, toxprpl_av_audio_captured, { NULL }
+    };
+    static GstAppSinkCallbacks video_callbacks =
+    {
+        NULL, NULL, toxprpl_av_video_captured, { NULL }
+    };
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(
+            call->gc);
+
+    call->audio_out = toxprpl_av_pipeline("appsrc name=src is-live=true "
+            "format=time do-timestamp=true ! audioconvert ! audioresample ! "
+            "%s", toxprpl_av_audio_sink, toxprpl_av_audio_sink);
+    call->audio_in = toxprpl_av_pipeline("%s ! audioconvert ! "
+            "audioresample ! audio/x-raw,format=%s,layout=interleaved,"
+            "channels=%d,rate=%d ! appsink name=sink sync=false",
+            toxprpl_av_audio_source, toxprpl_av_audio_source,
+            AV_AUDIO_FORMAT, AV_AUDIO_CHANNELS, AV_AUDIO_RATE);
+    if (call->video)
+    {
+        call->video_out = toxprpl_av_pipeline("appsrc name=src is-live=true "
+                "format=time do-timestamp=true ! videoconvert ! %s",
+                toxprpl_av_video_sink, toxprpl_av_video_sink);
+        call->video_in = toxprpl_av_pipeline("%s ! videoconvert ! "
+                "videoscale ! video/x-raw,format=I420,width=%d,height=%d ! "
+                "appsink name=sink sync=false max-buffers=2 drop=true",
+                toxprpl_av_video_source, toxprpl_av_video_source,
+                AV_VIDEO_WIDTH, AV_VIDEO_HEIGHT);
+    }
+
+    /* the AV thread may push frames as soon as the sources are set */
+    g_mutex_lock(&plugin->av_lock);
+    if (call->audio_out != NULL)
+    {
+        call->audio_src = GST_APP_SRC(gst_bin_get_by_name(
+                GST_BIN(call->audio_out), "src"));
+    }
+    if (call->video_out != NULL)
+    {
+        call->video_src = GST_APP_SRC(gst_bin_get_by_name(
+                GST_BIN(call->video_out), "src"));
+    }
+    g_mutex_unlock(&plugin->av_lock);
+
+    if (call->audio_in != NULL)
+    {
+        GstElement *sink = gst_bin_get_by_name(GST_BIN(call->audio_in),
+                                               "sink");
+        gst_app_sink_set_callbacks(GST_APP_SINK(sink), &audio_callbacks,
+                                   call, NULL);
+        gst_object_unref(sink);
+    }
+    if (call->video_in != NULL)
+    {
+        GstElement *sink = gst_bin_get_by_name(GST_BIN(call->video_in),
+                                               "sink");
+        gst_app_sink_set_callbacks(GST_APP_SINK(sink), &video_callbacks,
+                                   call, NULL);
+        gst_object_unref(sink);
+    }
+
+    GstElement *pipelines[] =
+    {
+        call->audio_out, call->audio_in, call->video_out, call->video_in
+    };
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS(pipelines); i++)
+    {
+        if (pipelines[i] != NULL)
+        {
+            gst_element_set_state(pipelines[i], GST_STATE_PLAYING);
+        }
+    }
+    call->active = TRUE;
+}
+
+/* stops the pipelines, which waits for their streaming threads, the AV
+ * thread may still push into the stopped sources */
+static void toxprpl_call_stop_media(toxprpl_call *call)
+{
+    GstElement *pipelines[] =
+    {
+        call->audio_in, call->video_in, call->audio_out, call->video_out
+    };
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS(pipelines); i++)
+    {
+        if (pipelines[i] != NULL)
+        {
+            gst_element_set_state(pipelines[i], GST_STATE_NULL);
+        }
+    }
+    call->active = FALSE;
+}
+
+/* tears a call down on our side, call is invalid afterwards */
+static void toxprpl_call_end(toxprpl_call *call, const char *message)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(
+            call->gc);
+    if (call->request != NULL)
+    {
+        purple_request_close(PURPLE_REQUEST_ACTION, call->request);
+        call->request = NULL;
+    }
+    toxprpl_call_stop_media(call);
+    if (message != NULL)
+    {
+        toxprpl_av_notice(call->gc, call->who, message);
+    }
+
+    g_mutex_lock(&plugin->av_lock);
+    g_hash_table_remove(plugin->calls, GUINT_TO_POINTER(call->friendnumber));
+    g_mutex_unlock(&plugin->av_lock);
+}
+
+static toxprpl_call *toxprpl_call_new(PurpleConnection *gc, uint32_t fnum,
+                                      const char *who, gboolean video)
 {
-    purple_debug_info("toxprpl", "toxprpl_query_buddy_info\n");
-    PurpleBuddy *buddy = (PurpleBuddy *)data;
-    PurpleConnection *gc = (PurpleConnection *)user_data;
     toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_call *call = g_new0(toxprpl_call, 1);
+    call->ref = 1;
+    call->gc = gc;
+    call->toxav = plugin->toxav;
+    call->stats = &plugin->stats;
+    call->friendnumber = fnum;
+    call->who = g_strdup(who);
+    call->video = video;
+    call->audio_bit_rate = AV_AUDIO_BIT_RATE;
+    call->video_bit_rate = video ? AV_VIDEO_BIT_RATE : 0;
+
+    g_mutex_lock(&plugin->av_lock);
+    g_hash_table_insert(plugin->calls, GUINT_TO_POINTER(fnum), call);
+    g_mutex_unlock(&plugin->av_lock);
+
+    if (plugin->av_thread == NULL)
+    {
+        g_atomic_int_set(&plugin->av_running, 1);
+        plugin->av_thread = g_thread_new("toxav", toxprpl_av_thread, plugin);
+    }
+    return call;
+}
 
-    toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
-    if (buddy_data == NULL)
+static void toxprpl_call_answer(toxprpl_call *call, int action)
+{
+    call->request = NULL;
+    TOXAV_ERR_ANSWER err_back;
+    if (!toxav_answer(call->toxav, call->friendnumber, AV_AUDIO_BIT_RATE,
+                      call->video ? AV_VIDEO_BIT_RATE : 0, &err_back))
     {
-        unsigned char *bin_key = toxprpl_hex_string_to_data(buddy->name);
-        TOX_ERR_FRIEND_BY_PUBLIC_KEY err_back;
-        /* TODO: Handle err_back */
-        uint32_t fnum = tox_friend_by_public_key(plugin->tox, bin_key,
-                                                 &err_back);
-        buddy_data = g_new0(toxprpl_buddy_data, 1);
-        buddy_data->tox_friendlist_number = fnum;
-        purple_buddy_set_protocol_data(buddy, buddy_data);
-        g_free(bin_key);
+        toxprpl_log_warning("could not answer the call of "
+                            "friend #%u (%d)\n", call->friendnumber,
+                            err_back);
+        toxprpl_call_end(call, _("The call could not be answered"));
+        return;
     }
+    toxprpl_call_start_media(call);
+    toxprpl_av_notice(call->gc, call->who, _("Call started"));
+}
+
+static void toxprpl_call_reject(toxprpl_call *call, int action)
+{
+    call->request = NULL;
+    TOXAV_ERR_CALL_CONTROL err_back;
+    toxav_call_control(call->toxav, call->friendnumber,
+                       TOXAV_CALL_CONTROL_CANCEL, &err_back);
+    toxprpl_call_end(call, _("Call rejected"));
+}
 
+/* toxav's call signalling rides on lossless packets, so this and
+ * on_call_state run inside tox_iterate() on the main thread */
+static void on_call(ToxAV *av, uint32_t fnum, bool audio_enabled,
+                    bool video_enabled, void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_CALL);
+    PurpleConnection *gc = user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    const char *who = toxprpl_friend_buddy_key(plugin,
+            toxprpl_get_friend_data(plugin, fnum));
+    toxprpl_return_if_fail(who != NULL);
+
+    toxprpl_call *call = toxprpl_call_new(gc, fnum, who, video_enabled);
     PurpleAccount *account = purple_connection_get_account(gc);
-    TOX_ERR_FRIEND_QUERY err_back_status;
-    purple_debug_info("toxprpl", "Setting user status for user %s to %s\n",
-        buddy->name, toxprpl_statuses[toxprpl_get_status_index(plugin->tox,
-            buddy_data->tox_friendlist_number,
-            tox_friend_get_status(plugin->tox, buddy_data->tox_friendlist_number, &err_back_status))].id);
-    purple_prpl_got_user_status(account, buddy->name,
-        toxprpl_statuses[toxprpl_get_status_index(plugin->tox,
-            buddy_data->tox_friendlist_number,
-            tox_friend_get_status(plugin->tox, buddy_data->tox_friendlist_number, &err_back_status))].id,
-        NULL);
+    PurpleBuddy *buddy = purple_find_buddy(account, who);
+    gchar *message = g_strdup_printf(video_enabled ?
+            _("%s is calling you with video") : _("%s is calling you"),
+            (buddy != NULL) ? purple_buddy_get_alias(buddy) : who);
+    call->request = purple_request_action(gc, _("Incoming call"), message,
+            NULL, 0, account, who, NULL, call, 2,
+            _("_Answer"), G_CALLBACK(toxprpl_call_answer),
+            _("_Reject"), G_CALLBACK(toxprpl_call_reject));
+    g_free(message);
+}
 
-    purple_debug_info("toxprpl", "ERR_FRIEND_QUERY: %d\n", err_back_status);
+static void on_call_state(ToxAV *av, uint32_t fnum, uint32_t state,
+                          void *user_data)
+{
+    toxprpl_stats_callback(user_data, TOXPRPL_CB_CALL_STATE);
+    PurpleConnection *gc = user_data;
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_call *call = g_hash_table_lookup(plugin->calls,
+                                             GUINT_TO_POINTER(fnum));
+    if (call == NULL)
+    {
+        return;
+    }
 
-    uint8_t alias[TOX_MAX_NAME_LENGTH + 1];
-    TOX_ERR_FRIEND_QUERY err_back;
-    /* TODO: handle err_back */
-    if (tox_friend_get_name(plugin->tox, buddy_data->tox_friendlist_number,
-                            alias, &err_back) == 0)
+    toxprpl_log_misc("call state of friend #%u: 0x%x\n", fnum, state);
+    if (state & TOXAV_FRIEND_CALL_STATE_ERROR)
     {
-        alias[TOX_MAX_NAME_LENGTH] = '\0';
-        purple_blist_alias_buddy(buddy, (const char*)alias);
+        toxprpl_call_end(call, _("Call failed"));
+    }
+    else if ((state == TOXAV_FRIEND_CALL_STATE_NONE) ||
+             (state & TOXAV_FRIEND_CALL_STATE_FINISHED))
+    {
+        toxprpl_call_end(call, _("Call ended"));
+    }
+    else if (!call->active)
+    {
+        /* our outgoing call was answered */
+        toxprpl_call_start_media(call);
+        toxprpl_av_notice(gc, call->who, _("Call started"));
     }
 }
 
-static const char *toxprpl_list_icon(PurpleAccount *acct, PurpleBuddy *buddy)
+/* toxav turns the loss its peer reports into lowered rate suggestions,
+ * take the loss back out of them and leave the decision to the next
+ * adaptation step */
+static void on_bit_rate_status(ToxAV *av, uint32_t fnum,
+                               uint32_t audio_bit_rate,
+                               uint32_t video_bit_rate, void *user_data)
 {
-    return "tox";
+    toxprpl_plugin_data *plugin = user_data;
+    g_mutex_lock(&plugin->av_lock);
+    toxprpl_call *call = g_hash_table_lookup(plugin->calls,
+                                             GUINT_TO_POINTER(fnum));
+    if (call != NULL)
+    {
+        float loss = 0;
+        if ((call->video_bit_rate > 0) &&
+            (video_bit_rate < call->video_bit_rate))
+        {
+            loss = 1 - (float)video_bit_rate / call->video_bit_rate;
+        }
+        else if ((call->video_bit_rate == 0) &&
+                 (audio_bit_rate < call->audio_bit_rate))
+        {
+            loss = 1 - (float)audio_bit_rate / call->audio_bit_rate;
+        }
+        call->loss = MAX(call->loss, loss);
+    }
+    g_mutex_unlock(&plugin->av_lock);
 }
 
-static GList *toxprpl_status_types(PurpleAccount *acct)
+/* one step of the congestion control of a call, video gives way before
+ * audio and audio recovers first */
+static void toxprpl_call_adapt(toxprpl_plugin_data *plugin,
+                               toxprpl_call *call)
 {
-    GList *types = NULL;
-    PurpleStatusType *type;
-    int i;
+    toxprpl_stats *stats = &plugin->stats;
+    toxprpl_friend_data *fdata = g_hash_table_lookup(plugin->friends,
+            GUINT_TO_POINTER(call->friendnumber));
+    guint video_ceiling = !call->video ? 0 :
+        ((fdata != NULL) && (fdata->connection == TOX_CONNECTION_TCP)) ?
+        AV_VIDEO_BIT_RATE_TCP : AV_VIDEO_BIT_RATE;
+
+    g_mutex_lock(&plugin->av_lock);
+    guint loss = (guint)(call->loss * 100);
+    guint jitter = (guint)(call->jitter_usec / 1000);
+    guint audio = call->audio_bit_rate;
+    guint video = call->video_bit_rate;
+    call->loss = 0;
+    g_mutex_unlock(&plugin->av_lock);
+
+    toxprpl_histogram_add(&stats->av_loss_percent, loss);
+    toxprpl_histogram_add(&stats->av_jitter_msec, jitter);
+
+    guint64 *step = NULL;
+    if (video > video_ceiling)
+    {
+        /* the friend moved to a TCP relay */
+        video = video_ceiling;
+        step = &stats->av_rate_caps;
+    }
+    else if ((loss >= AV_ADAPT_LOSS_HIGH) || (jitter >= AV_ADAPT_JITTER_HIGH))
+    {
+        guint keep = MIN(AV_ADAPT_DECREASE, 100 - MIN(loss, 50));
+        call->stable_steps = 0;
+        if (video > AV_VIDEO_BIT_RATE_MIN)
+        {
+            video = MAX(video * keep / 100, AV_VIDEO_BIT_RATE_MIN);
+        }
+        else
+        {
+            audio = MAX(audio * keep / 100, AV_AUDIO_BIT_RATE_MIN);
+        }
+        step = &stats->av_rate_decreases;
+    }
+    else if ((loss <= AV_ADAPT_LOSS_LOW) && (jitter <= AV_ADAPT_JITTER_LOW))
+    {
+        if (++call->stable_steps >= AV_ADAPT_STABLE_STEPS)
+        {
+            if (audio < AV_AUDIO_BIT_RATE)
+            {
+                audio = MIN(audio + AV_AUDIO_BIT_RATE_STEP,
+                            AV_AUDIO_BIT_RATE);
+            }
+            else if (video < video_ceiling)
+            {
+                video = MIN(video + AV_VIDEO_BIT_RATE_STEP, video_ceiling);
+            }
+            step = &stats->av_rate_increases;
+        }
+    }
+    else
+    {
+        call->stable_steps = 0;
+    }
+
+    if ((audio != call->audio_bit_rate) || (video != call->video_bit_rate))
+    {
+        TOXAV_ERR_BIT_RATE_SET err_back;
+        if (toxav_bit_rate_set(plugin->toxav, call->friendnumber,
+                (audio != call->audio_bit_rate) ? (int32_t)audio : -1,
+                (video != call->video_bit_rate) ? (int32_t)video : -1,
+                &err_back))
+        {
+            toxprpl_log_misc("call with friend #%u: loss %u%%, jitter %u ms, "
+                             "now %u/%u kbit/s\n", call->friendnumber, loss,
+                             jitter, audio, video);
+            (*step)++;
+            g_mutex_lock(&plugin->av_lock);
+            call->audio_bit_rate = audio;
+            call->video_bit_rate = video;
+            g_mutex_unlock(&plugin->av_lock);
+        }
+        else
+        {
+            toxprpl_log_warning("could not set the bit rates of "
+                                "friend #%u (%d)\n", call->friendnumber,
+                                err_back);
+        }
+    }
 
-    purple_debug_info("toxprpl", "setting up status types\n");
+    toxprpl_histogram_add(&stats->av_audio_kbps, call->audio_bit_rate);
+    if (call->video)
+    {
+        toxprpl_histogram_add(&stats->av_video_kbps, call->video_bit_rate);
+    }
+}
 
-    for (i = 0; i < TOXPRPL_MAX_STATUS; i++)
+/* adapts the bit rates of running calls, called with the connection check
+ * on the main thread where the friends' connection types are known */
+static void toxprpl_av_adapt(PurpleConnection *gc)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    if (plugin->calls == NULL)
     {
-        type = purple_status_type_new_with_attrs(toxprpl_statuses[i].primitive,
-            toxprpl_statuses[i].id, toxprpl_statuses[i].title, TRUE, TRUE,
-            FALSE,
-            "message", _("Message"), purple_value_new(PURPLE_TYPE_STRING),
-            NULL);
-        types = g_list_append(types, type);
+        return;
     }
 
-    return types;
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, plugin->calls);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+    {
+        toxprpl_call *call = value;
+        if (call->active)
+        {
+            toxprpl_call_adapt(plugin, call);
+        }
+    }
 }
 
-static PurpleCmdRet toxprpl_myid_cmd_cb(PurpleConversation *conv,
-                                        const gchar *cmd, gchar **args,
-                                        gchar **error, void *data)
+static gboolean toxprpl_av_call(PurpleConnection *gc, const char *who,
+                                gboolean video)
 {
-    purple_debug_info("toxprpl", "/myid command detected\n");
-    PurpleConnection *gc = (PurpleConnection *)data;
     toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    PurpleBuddy *buddy = purple_find_buddy(purple_connection_get_account(gc),
+                                           who);
+    toxprpl_buddy_data *buddy_data = (buddy != NULL) ?
+        purple_buddy_get_protocol_data(buddy) : NULL;
+    if ((plugin == NULL) || (plugin->toxav == NULL) || (buddy_data == NULL))
+    {
+        return FALSE;
+    }
 
-    uint8_t bin_id[TOX_ADDRESS_SIZE];
-    tox_self_get_address(plugin->tox, bin_id);
-    gchar *id = toxprpl_tox_friend_id_to_string(bin_id);
+    uint32_t fnum = buddy_data->tox_friendlist_number;
+    TOXAV_ERR_CALL err_back;
+    if (!toxav_call(plugin->toxav, fnum, AV_AUDIO_BIT_RATE,
+                    video ? AV_VIDEO_BIT_RATE : 0, &err_back))
+    {
+        toxprpl_log_warning("could not call friend #%u (%d)\n",
+                            fnum, err_back);
+        return FALSE;
+    }
+    toxprpl_call_new(gc, fnum, who, video);
+    toxprpl_av_notice(gc, who, _("Calling..."));
+    return TRUE;
+}
 
-    gchar *message = g_strdup_printf(_("If someone wants to add you, give them "
-                                       "this id: %s"), id);
+static gboolean toxprpl_av_hangup(PurpleConnection *gc, const char *who)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    PurpleBuddy *buddy = purple_find_buddy(purple_connection_get_account(gc),
+                                           who);
+    toxprpl_buddy_data *buddy_data = (buddy != NULL) ?
+        purple_buddy_get_protocol_data(buddy) : NULL;
+    toxprpl_call *call = ((plugin != NULL) && (plugin->calls != NULL) &&
+                          (buddy_data != NULL)) ?
+        g_hash_table_lookup(plugin->calls,
+                GUINT_TO_POINTER(buddy_data->tox_friendlist_number)) : NULL;
+    if (call == NULL)
+    {
+        return FALSE;
+    }
 
-    purple_conversation_write(conv, NULL, message, PURPLE_MESSAGE_SYSTEM,
-                              time(NULL));
-    g_free(id);
-    g_free(message);
-    return PURPLE_CMD_RET_OK;
+    TOXAV_ERR_CALL_CONTROL err_back;
+    toxav_call_control(plugin->toxav, call->friendnumber,
+                       TOXAV_CALL_CONTROL_CANCEL, &err_back);
+    toxprpl_call_end(call, _("Call ended"));
+    return TRUE;
 }
 
-static PurpleCmdRet toxprpl_nick_cmd_cb(PurpleConversation *conv,
-                                        const gchar *cmd, gchar **args,
-                                        gchar **error, void *data)
+static gboolean toxprpl_initiate_media(PurpleAccount *account,
+                                       const char *who,
+                                       PurpleMediaSessionType type)
 {
-    purple_debug_info("toxprpl", "/nick %s command detected\n", args[0]);
-    PurpleConnection *gc = (PurpleConnection *)data;
-    toxprpl_set_nick_action(gc, args[0]);
-    return PURPLE_CMD_RET_OK;
+    PurpleConnection *gc = purple_account_get_connection(account);
+    toxprpl_return_val_if_fail(gc != NULL, FALSE);
+    return toxprpl_av_call(gc, who, (type & PURPLE_MEDIA_VIDEO) != 0);
 }
 
-static void toxprpl_sync_add_buddy(PurpleAccount *account, Tox *tox,
-                                   int friend_number)
+static PurpleMediaCaps toxprpl_get_media_caps(PurpleAccount *account,
+                                              const char *who)
 {
-    uint8_t alias[TOX_MAX_NAME_LENGTH + 1];
-    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
-    TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back_key;
-    /* TODO: Hanndle err_back */
-    if (tox_friend_get_public_key(tox, friend_number, public_key,
-                                  &err_back_key) != true)
+    PurpleBuddy *buddy = purple_find_buddy(account, who);
+    if ((buddy == NULL) ||
+        !PURPLE_BUDDY_IS_ONLINE(buddy))
     {
-        purple_debug_info("toxprpl", "Could not get id of friend #%d\n",
-                          friend_number);
-        return;
+        return PURPLE_MEDIA_CAPS_NONE;
     }
+    return PURPLE_MEDIA_CAPS_AUDIO | PURPLE_MEDIA_CAPS_VIDEO |
+           PURPLE_MEDIA_CAPS_AUDIO_VIDEO;
+}
 
-    gchar *buddy_key = toxprpl_tox_bin_id_to_string(public_key);
-
-    PurpleBuddy *buddy;
-    TOX_ERR_FRIEND_QUERY err_back_name;
-    /* TODO: Handle err_back_name */
-    int ret = tox_friend_get_name(tox, friend_number, alias, &err_back_name);
-    alias[TOX_MAX_NAME_LENGTH] = '\0';
-    if ((ret == 0) && (strlen((const char *)alias) > 0))
+static PurpleCmdRet toxprpl_hangup_cmd_cb(PurpleConversation *conv,
+                                          const gchar *cmd, gchar **args,
+                                          gchar **error, void *data)
+{
+    PurpleConnection *gc = (PurpleConnection *)data;
+    if (purple_conversation_get_gc(conv) != gc)
     {
-        purple_debug_info("toxprpl", "Got friend alias %s\n", alias);
-        buddy = purple_buddy_new(account, buddy_key, (const char*)alias);
+        /* registered once per account */
+        return PURPLE_CMD_RET_CONTINUE;
     }
-    else
+    if (!toxprpl_av_hangup(gc, purple_conversation_get_name(conv)))
     {
-        purple_debug_info("toxprpl", "Adding [%s]\n", buddy_key);
-        buddy = purple_buddy_new(account, buddy_key, NULL);
+        *error = g_strdup(_("There is no call with this buddy"));
+        return PURPLE_CMD_RET_FAILED;
     }
-
-    toxprpl_buddy_data *buddy_data = g_new0(toxprpl_buddy_data, 1);
-    buddy_data->tox_friendlist_number = friend_number;
-    purple_buddy_set_protocol_data(buddy, buddy_data);
-    purple_blist_add_buddy(buddy, NULL, NULL, NULL);
-    TOX_ERR_FRIEND_QUERY err_back_status;
-    /* TODO: Handle err_back_status */
-    TOX_USER_STATUS userstatus = tox_friend_get_status(tox, friend_number,
-                                                       &err_back_status);
-    purple_debug_info("toxprpl", "Friend %s has status %d\n", buddy_key,
-                      userstatus);
-    purple_prpl_got_user_status(account, buddy_key,
-        toxprpl_statuses[
-            toxprpl_get_status_index(tox,friend_number,userstatus)].id,
-        NULL);
-    g_free(buddy_key);
+    return PURPLE_CMD_RET_OK;
 }
 
-static void toxprpl_sync_friends(PurpleAccount *acct, Tox *tox)
+static void toxprpl_av_init(PurpleConnection *gc, toxprpl_plugin_data *plugin)
 {
-    uint32_t i;
+    TOXAV_ERR_NEW err_back;
+    plugin->toxav = toxav_new(plugin->tox, &err_back);
+    if (plugin->toxav == NULL)
+    {
+        toxprpl_log_warning("toxav initialization failed (%d), "
+                            "calls are disabled\n", err_back);
+        return;
+    }
 
-    uint32_t fl_len = tox_self_get_friend_list_size(tox);
-    uint32_t *friendlist = g_malloc0(fl_len * sizeof(uint32_t));
+    g_mutex_init(&plugin->av_lock);
+    plugin->calls = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                          NULL, toxprpl_call_unref);
+    toxav_callback_call(plugin->toxav, on_call, gc);
+    toxav_callback_call_state(plugin->toxav, on_call_state, gc);
+    /* these two run on the AV thread */
+    toxav_callback_audio_receive_frame(plugin->toxav, on_audio_receive_frame,
+                                       plugin);
+    toxav_callback_video_receive_frame(plugin->toxav, on_video_receive_frame,
+                                       plugin);
+    toxav_callback_bit_rate_status(plugin->toxav, on_bit_rate_status, plugin);
+}
 
-    if (fl_len != 0)
+/* ends all calls and stops the AV thread, before the Tox instance goes */
+static void toxprpl_av_free(toxprpl_plugin_data *plugin)
+{
+    if (plugin->toxav == NULL)
     {
-        tox_self_get_friend_list(tox, friendlist);
-        purple_debug_info("toxprpl", "got %u friends\n", fl_len);
-        GSList *buddies = purple_find_buddies(acct, NULL);
-        GSList *iterator;
-        for (i = 0; i < fl_len; i++)
-        {
-            iterator = buddies;
-            uint32_t fnum = friendlist[i];
-            uint8_t bin_id[TOX_PUBLIC_KEY_SIZE];
-            TOX_ERR_FRIEND_GET_PUBLIC_KEY err_back;
-            /* TODO: Hanndle err_back */
-            if (tox_friend_get_public_key(tox, fnum, bin_id, &err_back) == 0)
-            {
-                gchar *str_id = toxprpl_tox_bin_id_to_string(bin_id);
-                while (iterator != NULL)
-                {
-                    PurpleBuddy *buddy = iterator->data;
-                    if (strcmp(buddy->name, str_id) == 0)
-                    {
-                        toxprpl_buddy_data *buddy_data =
-                                    g_new0(toxprpl_buddy_data, 1);
-                        buddy_data->tox_friendlist_number = fnum;
-                        purple_buddy_set_protocol_data(buddy, buddy_data);
-                        friendlist[i] = -1;
-                    }
-                    iterator = iterator->next;
-                }
-                g_free(str_id);
-            }
-        }
-
-        iterator = buddies;
-        /* all left without buddy_data were not present in Tox and must be */
-        /* removed */
-        while (iterator != NULL)
-        {
-            PurpleBuddy *buddy = iterator->data;
-            toxprpl_buddy_data *buddy_data =
-                purple_buddy_get_protocol_data(buddy);
-            if (buddy_data == NULL)
-            {
-                purple_blist_remove_buddy(buddy);
-            }
-            iterator = iterator->next;
-        }
+        return;
+    }
 
-        g_slist_free(buddies);
+    if (plugin->av_thread != NULL)
+    {
+        g_atomic_int_set(&plugin->av_running, 0);
+        g_thread_join(plugin->av_thread);
+        plugin->av_thread = NULL;
     }
 
-    /* all left in friendlist that were not reset are not yet in blist */
-    for (i = 0; i < fl_len; i++)
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, plugin->calls);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
     {
-        if (friendlist[i] != -1)
+        toxprpl_call *call = value;
+        if (call->request != NULL)
         {
-            toxprpl_sync_add_buddy(acct, tox, friendlist[i]);
+            purple_request_close(PURPLE_REQUEST_ACTION, call->request);
+            call->request = NULL;
         }
+        toxprpl_call_stop_media(call);
     }
+    g_hash_table_destroy(plugin->calls);
+    plugin->calls = NULL;
+    g_mutex_clear(&plugin->av_lock);
 
-    g_free(friendlist);
-}
-
-static gboolean toxprpl_save_account(PurpleAccount *account, Tox* tox)
-{
-    PurpleConnection *gc = purple_account_get_connection(account);
-    const char *key = purple_account_get_string(account, "account_path",
-                                          DEFAULT_ACCOUNT_PATH);
-    gchar* filename = g_build_filename(purple_user_dir(), "tox", key,
-                                       "tox_save.tox", NULL);
-    gchar* dirname = g_path_get_dirname(filename);
-    g_mkdir_with_parents(dirname, 0777);
-    toxprpl_user_export(gc, filename);
-
-    return TRUE;
+    toxav_kill(plugin->toxav);
+    plugin->toxav = NULL;
 }
+#endif
 
 static void toxprpl_login_after_setup(PurpleAccount *acct,
                                       toxprpl_profile_data profile)
@@ -1228,6 +7051,17 @@ static void toxprpl_login_after_setup(PurpleAccount *acct,
     tox_callback_friend_request(tox, on_request, gc);
     tox_callback_friend_connection_status(tox, on_connectionstatus, gc);
     tox_callback_friend_typing(tox, on_typing_change, gc);
+    tox_callback_friend_read_receipt(tox, on_read_receipt, gc);
+    tox_callback_friend_lossless_packet(tox, on_lossless_packet, gc);
+    tox_callback_friend_lossy_packet(tox, on_lossy_packet, gc);
+
+    tox_callback_conference_invite(tox, on_conference_invite, gc);
+    tox_callback_conference_message(tox, on_conference_message, gc);
+    tox_callback_conference_title(tox, on_conference_title, gc);
+    tox_callback_conference_peer_name(tox, on_conference_peer_name, gc);
+    tox_callback_conference_peer_list_changed(tox,
+                                              on_conference_peer_list_changed,
+                                              gc);
 
 
     tox_callback_file_recv(tox, on_file_recv, gc);
@@ -1276,19 +7110,44 @@ static void toxprpl_login_after_setup(PurpleAccount *acct,
     toxprpl_plugin_data *plugin = g_new0(toxprpl_plugin_data, 1);
 
     plugin->tox = tox;
-    plugin->tox_timer = purple_timeout_add(80, tox_messenger_loop, gc);
-    purple_debug_info("toxprpl", "added messenger timer as %d\n",
-                      plugin->tox_timer);
-    plugin->connection_timer = purple_timeout_add_seconds(2,
-                                                        tox_connection_check,
-                                                        gc);
-    purple_debug_info("toxprpl", "added connection timer as %d\n",
-                      plugin->connection_timer);
-
+    plugin->iterate_budget = MAX(purple_account_get_int(acct,
+                                        "iterate_budget",
+                                        DEFAULT_ITERATE_BUDGET), 0);
+    plugin->send_slots = MAX(purple_account_get_int(acct, "send_slots",
+                                                    DEFAULT_SEND_SLOTS), 1);
+    plugin->compression_level = purple_account_get_int(acct,
+            "compression_level", DEFAULT_COMPRESSION_LEVEL);
+    plugin->send_queues = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                NULL,
+                                                toxprpl_send_queue_free);
+    plugin->stats.started = g_get_monotonic_time();
+    plugin->friends = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, toxprpl_friend_data_free);
+    plugin->conferences = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                NULL, toxprpl_conference_free);
+    plugin->avatar_transfers = g_hash_table_new_full(g_int64_hash,
+                                                     g_int64_equal, NULL,
+                                                     toxprpl_avatar_transfer_free);
+    toxprpl_outbox_load(acct, plugin);
+    toxprpl_nodes_load(acct, plugin);
+    plugin->requests = g_queue_new();
+    plugin->coalesce_messages = purple_account_get_bool(acct,
+            "coalesce_messages", DEFAULT_COALESCE_MESSAGES);
+    plugin->inbound = g_queue_new();
+    plugin->inbound_open = g_hash_table_new(g_direct_hash, g_direct_equal);
+    plugin->request_keys = g_hash_table_new_full(g_str_hash, g_str_equal,
+            NULL, toxprpl_friend_request_free);
+    plugin->accepted = g_queue_new();
+    /* keep bootstrapping if the first attempt doesn't get us in */
+    plugin->next_bootstrap = g_get_monotonic_time() +
+                             REBOOTSTRAP_BASE_DELAY * 1000;
 
     gchar *myid_help = "myid  print your tox id which you can give to "
                        "your friends";
     gchar *nick_help = "nick &lt;nickname&gt; set your nickname";
+    gchar *stats_help = "toxstats  print performance counters of this "
+                        "account";
+    gchar *ping_help = "toxping  measure the round trip time to this buddy";
 
     plugin->myid_command_id = purple_cmd_register("myid", "",
             PURPLE_CMD_P_DEFAULT, PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT,
@@ -1298,6 +7157,21 @@ static void toxprpl_login_after_setup(PurpleAccount *acct,
             PURPLE_CMD_P_DEFAULT, PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT,
             TOXPRPL_ID, toxprpl_nick_cmd_cb, nick_help, gc);
 
+    plugin->stats_command_id = purple_cmd_register("toxstats", "",
+            PURPLE_CMD_P_DEFAULT, PURPLE_CMD_FLAG_IM | PURPLE_CMD_FLAG_CHAT,
+            TOXPRPL_ID, toxprpl_stats_cmd_cb, stats_help, gc);
+
+    plugin->ping_command_id = purple_cmd_register("toxping", "",
+            PURPLE_CMD_P_DEFAULT, PURPLE_CMD_FLAG_IM, TOXPRPL_ID,
+            toxprpl_ping_cmd_cb, ping_help, gc);
+
+#ifdef HAVE_TOXAV
+    toxprpl_av_init(gc, plugin);
+    plugin->hangup_command_id = purple_cmd_register("hangup", "",
+            PURPLE_CMD_P_DEFAULT, PURPLE_CMD_FLAG_IM, TOXPRPL_ID,
+            toxprpl_hangup_cmd_cb, "hangup  end the call with this buddy", gc);
+#endif
+
     const char *nick = purple_account_get_string(acct, "nickname", NULL);
     if (!nick || (strlen(nick) == 0))
     {
@@ -1314,7 +7188,15 @@ static void toxprpl_login_after_setup(PurpleAccount *acct,
     }
 
     purple_connection_set_protocol_data(gc, plugin);
+    toxprpl_scheduler_add(gc);
     toxprpl_set_nick_action(gc, nick);
+
+    PurpleStoredImage *icon = purple_buddy_icons_find_account_icon(acct);
+    toxprpl_set_buddy_icon(gc, icon);
+    if (icon != NULL)
+    {
+        purple_imgstore_unref(icon);
+    }
 }
 
 static void toxprpl_user_import(PurpleAccount *acct, const char *filename, toxprpl_profile_data* profile)
@@ -1435,14 +7317,68 @@ static void toxprpl_close(PurpleConnection *gc)
         return;
     }
 
-    purple_debug_info("toxprpl", "removing timers %d and %d\n",
-            plugin->tox_timer, plugin->connection_timer);
-    purple_timeout_remove(plugin->tox_timer);
-    purple_timeout_remove(plugin->connection_timer);
+    toxprpl_scheduler_remove(gc);
 
     purple_cmd_unregister(plugin->myid_command_id);
     purple_cmd_unregister(plugin->nick_command_id);
+    purple_cmd_unregister(plugin->stats_command_id);
+    purple_cmd_unregister(plugin->ping_command_id);
+#ifdef HAVE_TOXAV
+    purple_cmd_unregister(plugin->hangup_command_id);
+    toxprpl_av_free(plugin);
+#endif
+
+    /* looks the friends up, so before they are freed */
+    toxprpl_inbound_flush(gc);
+
+    toxprpl_receipts_to_outbox(plugin);
+    toxprpl_outbox_free(plugin);
 
+    /* transfers can't continue without the Tox instance, keep what was
+     * received so far */
+    GList *xfers;
+    for (xfers = purple_xfers_get_all(); xfers != NULL;
+         xfers = g_list_next(xfers))
+    {
+        PurpleXfer *xfer = xfers->data;
+        if ((purple_xfer_get_account(xfer) == account) && (xfer->data != NULL))
+        {
+            toxprpl_xfer_save_partial(xfer);
+        }
+    }
+    g_hash_table_destroy(plugin->friends);
+    g_hash_table_destroy(plugin->conferences);
+    g_hash_table_destroy(plugin->send_queues);
+    g_hash_table_destroy(plugin->avatar_transfers);
+    g_list_free(plugin->stalled_xfers);
+    g_list_free(plugin->raw_pending);
+    if (plugin->presence_timer != 0)
+    {
+        purple_timeout_remove(plugin->presence_timer);
+    }
+    g_list_free(plugin->presence_pending);
+    if (plugin->request_timer != 0)
+    {
+        purple_timeout_remove(plugin->request_timer);
+    }
+    if (plugin->accept_timer != 0)
+    {
+        purple_timeout_remove(plugin->accept_timer);
+        toxprpl_requests_add(gc);
+    }
+    g_queue_free(plugin->requests);
+    g_queue_free(plugin->accepted);
+    g_queue_free(plugin->inbound);
+    g_hash_table_destroy(plugin->inbound_open);
+    g_hash_table_destroy(plugin->request_keys);
+    if (plugin->nodes_resolve != NULL)
+    {
+        g_cancellable_cancel(plugin->nodes_resolve);
+        g_object_unref(plugin->nodes_resolve);
+    }
+    g_list_free_full(plugin->nodes, toxprpl_node_free);
+    g_free(plugin->nodes_path);
+    g_free(plugin->avatar);
     toxprpl_save_account(account, plugin->tox);
 
     purple_debug_info("toxprpl", "shutting down\n");
@@ -1465,8 +7401,7 @@ static int toxprpl_send_im(PurpleConnection *gc, const char *who,
 {
     const char *from_username = gc->account->username;
 
-    purple_debug_info("toxprpl", "sending message from %s to %s\n",
-            from_username, who);
+    toxprpl_log_trace("sending message from %s to %s\n", from_username, who);
 
     int message_sent = -999;
 
@@ -1486,30 +7421,52 @@ static int toxprpl_send_im(PurpleConnection *gc, const char *who,
         return message_sent;
     }
     toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
-    char *no_html = purple_markup_strip_html(message);
-
+    char scratch[MESSAGE_SCRATCH_SIZE];
+    char *allocated;
     TOX_MESSAGE_TYPE msg_type;
-    if (purple_message_meify(no_html, -1))
-    {
-        msg_type = TOX_MESSAGE_TYPE_ACTION;
-    }
-    else
+    char *no_html = toxprpl_outgoing_text(message, scratch, &msg_type,
+                                          &allocated);
+
+    TOX_ERR_FRIEND_QUERY err_back_query;
+    if (tox_friend_get_connection_status(plugin->tox,
+            buddy_data->tox_friendlist_number, &err_back_query)
+                == TOX_CONNECTION_NONE)
     {
-        msg_type = TOX_MESSAGE_TYPE_NORMAL;
+        /* delivered by toxprpl_outbox_flush_cb() once the friend is online */
+        toxprpl_outbox_add(plugin, who, msg_type, no_html);
+        message_sent = 1;
     }
-
-    TOX_ERR_FRIEND_SEND_MESSAGE err_back;
-    /* ToDo: Handle err_back */
-    if (tox_friend_send_message(plugin->tox, buddy_data->tox_friendlist_number,
-                                msg_type, (uint8_t *)no_html, strlen(no_html),
-                                &err_back) != 0)
+    else if (g_hash_table_lookup(plugin->outbox, who) != NULL)
     {
+        /* outbox is still being flushed, queue behind it to keep the order */
+        toxprpl_outbox_add(plugin, who, msg_type, no_html);
+        toxprpl_outbox_schedule_flush(gc, who,
+                                      buddy_data->tox_friendlist_number);
         message_sent = 1;
     }
-    if (no_html)
+    else
     {
-        free(no_html);
+        TOX_ERR_FRIEND_SEND_MESSAGE err_back;
+        toxprpl_send_message(plugin, buddy_data->tox_friendlist_number,
+                             msg_type, no_html, &err_back);
+        if (err_back == TOX_ERR_FRIEND_SEND_MESSAGE_OK)
+        {
+            message_sent = 1;
+        }
+        else if (err_back == TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_CONNECTED)
+        {
+            toxprpl_outbox_add(plugin, who, msg_type, no_html);
+            message_sent = 1;
+        }
+        else if (err_back == TOX_ERR_FRIEND_SEND_MESSAGE_SENDQ)
+        {
+            toxprpl_outbox_add(plugin, who, msg_type, no_html);
+            toxprpl_outbox_schedule_flush(gc, who,
+                                          buddy_data->tox_friendlist_number);
+            message_sent = 1;
+        }
     }
+    g_free(allocated);
     return message_sent;
 }
 
@@ -1619,6 +7576,8 @@ static void toxprpl_remove_buddy(PurpleConnection *gc, PurpleBuddy *buddy,
     toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
     if (buddy_data != NULL)
     {
+        g_hash_table_remove(plugin->friends,
+                GUINT_TO_POINTER(buddy_data->tox_friendlist_number));
         purple_debug_info("toxprpl", "removing tox friend #%d\n",
                           buddy_data->tox_friendlist_number);
         TOX_ERR_FRIEND_DELETE err_back_del;
@@ -1731,39 +7690,113 @@ static void toxprpl_user_export(PurpleConnection *gc, const char *filename)
     }
 }
 
-static void toxprpl_export_account_dialog(PurplePluginAction *action)
+static void toxprpl_export_account_dialog(PurplePluginAction *action)
+{
+    purple_debug_info("toxprpl", "ask to export account\n");
+
+    PurpleConnection *gc = (PurpleConnection*)action->context;
+    PurpleAccount *account = purple_connection_get_account(gc);
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    if (plugin == NULL)
+    {
+        return;
+    }
+
+    if (plugin->tox == NULL)
+    {
+        return;
+    }
+
+    uint8_t bin_id[TOX_ADDRESS_SIZE];
+    tox_self_get_address(plugin->tox, bin_id);
+    gchar *id = toxprpl_tox_friend_id_to_string(bin_id);
+    strcpy(id+TOX_PUBLIC_KEY_SIZE, ".tox\0"); // insert extension instead of nospam
+
+    purple_request_file(gc,
+        _("Export existing Tox account data"),
+        id,
+        TRUE,
+        G_CALLBACK(toxprpl_user_export),
+        NULL,
+        account,
+        NULL,
+        NULL,
+        gc);
+    g_free(id);
+}
+
+static void toxprpl_action_show_delivery_stats(PurplePluginAction *action)
 {
-    purple_debug_info("toxprpl", "ask to export account\n");
-
     PurpleConnection *gc = (PurpleConnection*)action->context;
-    PurpleAccount *account = purple_connection_get_account(gc);
     toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
-    if (plugin == NULL)
+    toxprpl_return_if_fail(plugin != NULL);
+
+    const toxprpl_histogram *h = &plugin->receipt_latency;
+    guint pending = 0;
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, plugin->friends);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
     {
-        return;
+        pending += ((toxprpl_friend_data *)value)->receipt_count;
     }
 
-    if (plugin->tox == NULL)
+    gchar *text = g_strdup_printf(
+        _("<b>Delivered:</b> %" G_GUINT64_FORMAT "<br>"
+          "<b>Average:</b> %" G_GUINT64_FORMAT " ms<br>"
+          "<b>Median:</b> &lt;= %" G_GUINT64_FORMAT " ms<br>"
+          "<b>95th percentile:</b> &lt;= %" G_GUINT64_FORMAT " ms<br>"
+          "<b>99th percentile:</b> &lt;= %" G_GUINT64_FORMAT " ms<br>"
+          "<b>Maximum:</b> %" G_GUINT64_FORMAT " ms<br>"
+          "<b>Awaiting receipt:</b> %u<br>"
+          "<b>Retransmitted:</b> %" G_GUINT64_FORMAT "<br>"
+          "<b>No longer tracked:</b> %" G_GUINT64_FORMAT),
+        h->count, (h->count > 0) ? (h->sum / h->count) : 0,
+        toxprpl_histogram_percentile(h, 50),
+        toxprpl_histogram_percentile(h, 95),
+        toxprpl_histogram_percentile(h, 99), h->max, pending,
+        plugin->retransmits, plugin->receipts_evicted);
+
+    purple_notify_formatted(gc, _("Delivery statistics"),
+                            _("Message delivery latency"), NULL, text,
+                            NULL, NULL);
+    g_free(text);
+}
+
+static void toxprpl_stats_export(PurpleConnection *gc, const char *filename)
+{
+    gchar *text = toxprpl_stats_format(gc);
+    toxprpl_return_if_fail(text != NULL);
+
+    GError *error = NULL;
+    if (!g_file_set_contents(filename, text, -1, &error))
     {
-        return;
+        purple_notify_message(gc,
+                PURPLE_NOTIFY_MSG_ERROR,
+                _("Error"),
+                _("Could not save statistics:"),
+                error->message,
+                NULL, NULL);
+        g_error_free(error);
     }
+    g_free(text);
+}
 
-    uint8_t bin_id[TOX_ADDRESS_SIZE];
-    tox_self_get_address(plugin->tox, bin_id);
-    gchar *id = toxprpl_tox_friend_id_to_string(bin_id);
-    strcpy(id+TOX_PUBLIC_KEY_SIZE, ".tox\0"); // insert extension instead of nospam
+static void toxprpl_action_save_stats_dialog(PurplePluginAction *action)
+{
+    PurpleConnection *gc = (PurpleConnection*)action->context;
+    PurpleAccount *account = purple_connection_get_account(gc);
 
     purple_request_file(gc,
-        _("Export existing Tox account data"),
-        id,
+        _("Save performance statistics"),
+        "toxstats.txt",
         TRUE,
-        G_CALLBACK(toxprpl_user_export),
+        G_CALLBACK(toxprpl_stats_export),
         NULL,
         account,
         NULL,
         NULL,
         gc);
-    g_free(id);
 }
 
 static GList *toxprpl_account_actions(PurplePlugin *plugin, gpointer context)
@@ -1784,6 +7817,14 @@ static GList *toxprpl_account_actions(PurplePlugin *plugin, gpointer context)
     action = purple_plugin_action_new(_("Export account data..."),
             toxprpl_export_account_dialog);
     actions = g_list_append(actions, action);
+
+    action = purple_plugin_action_new(_("Show delivery statistics..."),
+            toxprpl_action_show_delivery_stats);
+    actions = g_list_append(actions, action);
+
+    action = purple_plugin_action_new(_("Save performance statistics..."),
+            toxprpl_action_save_stats_dialog);
+    actions = g_list_append(actions, action);
     return actions;
 }
 
@@ -1798,7 +7839,8 @@ static void toxprpl_free_buddy(PurpleBuddy *buddy)
 
 static gboolean toxprpl_offline_message(const PurpleBuddy *buddy)
 {
-    return FALSE;
+    /* queued in the outbox, see toxprpl_outbox_add() */
+    return TRUE;
 }
 
 static gboolean toxprpl_can_receive_file(PurpleConnection *gc, const char *who)
@@ -1858,30 +7900,13 @@ static void toxprpl_xfer_init(PurpleXfer *xfer)
         toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
         toxprpl_return_if_fail(buddy_data != NULL);
 
-        int friendnumber = buddy_data->tox_friendlist_number;
-        size_t filesize = purple_xfer_get_size(xfer);
-        const char *filename = purple_xfer_get_filename(xfer);
-
-        purple_debug_info("toxprpl", "sending xfer request for file '%s'.\n",
-            filename);
-        TOX_ERR_FILE_SEND err_back;
-        /* TODO: maybe parsing the file kind before is necessary */
-        int filenumber = tox_file_send(plugin->tox, friendnumber,
-                                       TOX_FILE_KIND_DATA, filesize, NULL,
-                                       (const uint8_t *)filename,
-                                       strlen(filename) + 1, &err_back);
-        /* TODO: Handle err_back */
-        toxprpl_return_if_fail(filenumber >= 0);
-
         xfer_data->tox = plugin->tox;
         xfer_data->friendnumber = buddy_data->tox_friendlist_number;
-        xfer_data->filenumber = filenumber;
+        /* no file number until the file is offered */
+        xfer_data->filenumber = G_MAXUINT32;
 
-        TOX_ERR_FILE_GET err_file_get;
-        /* TODO: Return type is bool */
-        tox_file_get_file_id(plugin->tox, friendnumber, filenumber,
-                             xfer_data->file_id, &err_file_get);
-        /* TODO: Handle err_file_get */
+        toxprpl_xfer_compress(xfer, plugin);
+        toxprpl_xfer_offer(xfer);
     }
     else if (purple_xfer_get_type(xfer) == PURPLE_XFER_RECEIVE)
     {
@@ -1896,6 +7921,7 @@ static void toxprpl_xfer_init(PurpleXfer *xfer)
         PurpleConnection *gc = purple_account_get_connection(account);
         toxprpl_return_if_fail(gc != NULL);
 
+        toxprpl_xfer_resume_partial(xfer);
         tox_file_control(xfer_data->tox, xfer_data->friendnumber,
             xfer_data->filenumber, TOX_FILE_CONTROL_RESUME, &err_back);
         if (err_back != TOX_ERR_FILE_CONTROL_OK)
@@ -1905,6 +7931,11 @@ static void toxprpl_xfer_init(PurpleXfer *xfer)
         }
 
         purple_xfer_start(xfer, -1, NULL, 0);
+        if (!purple_xfer_is_canceled(xfer) &&
+            !toxprpl_xfer_resume_finish(xfer))
+        {
+            purple_xfer_cancel_local(xfer);
+        }
     }
 }
 
@@ -1922,6 +7953,54 @@ static void toxprpl_xfer_free(PurpleXfer *xfer)
         idle_write_data->running = FALSE;
         xfer_data->idle_write_data = NULL;
     }
+
+    PurpleConnection *gc = purple_account_get_connection(
+            purple_xfer_get_account(xfer));
+    toxprpl_plugin_data *plugin = (gc != NULL) ?
+        purple_connection_get_protocol_data(gc) : NULL;
+    if (plugin != NULL)
+    {
+        plugin->stalled_xfers = g_list_remove(plugin->stalled_xfers, xfer);
+    }
+    g_list_free_full(xfer_data->pending.head, g_free);
+
+    if (xfer_data->queued)
+    {
+        toxprpl_send_queue_done(xfer);
+    }
+
+    if (xfer_data->recv_fp != NULL)
+    {
+        fclose(xfer_data->recv_fp);
+    }
+    if (xfer_data->resume_path != NULL)
+    {
+        /* never started, the received part is still valid */
+        g_rename(xfer_data->resume_path, purple_xfer_get_local_filename(xfer));
+        g_free(xfer_data->resume_path);
+    }
+
+    if (purple_xfer_is_completed(xfer) &&
+        (purple_xfer_get_type(xfer) == PURPLE_XFER_RECEIVE))
+    {
+        gchar *partial = g_strconcat(purple_xfer_get_local_filename(xfer),
+                                     PARTIAL_SUFFIX, NULL);
+        g_remove(partial);
+        g_free(partial);
+    }
+    else
+    {
+        toxprpl_xfer_save_partial(xfer);
+    }
+    toxprpl_xfer_digest_free(xfer_data);
+    if (xfer_data->deflate != NULL)
+    {
+        toxprpl_deflate_free(xfer_data->deflate);
+    }
+    if (xfer_data->inflate != NULL)
+    {
+        g_object_unref(xfer_data->inflate);
+    }
     g_free(xfer_data);
     xfer->data = NULL;
 }
@@ -2028,6 +8107,7 @@ static PurpleXfer *toxprpl_new_xfer(PurpleConnection *gc, const gchar *who)
 
     toxprpl_xfer_data *xfer_data = g_new0(toxprpl_xfer_data, 1);
     toxprpl_return_val_if_fail(xfer_data != NULL, NULL);
+    toxprpl_xfer_digest_init(xfer_data);
 
     xfer->data = xfer_data;
 
@@ -2064,8 +8144,18 @@ static PurpleXfer* toxprpl_new_xfer_receive(PurpleConnection *gc,
     xfer_data->tox = plugin_data->tox;
     xfer_data->friendnumber = friendnumber;
     xfer_data->filenumber = filenumber;
+    toxprpl_xfer_digest_init(xfer_data);
     xfer->data = xfer_data;
 
+    TOX_ERR_FILE_GET err_file_get;
+    if (!tox_file_get_file_id(plugin_data->tox, friendnumber, filenumber,
+                              xfer_data->file_id, &err_file_get))
+    {
+        toxprpl_log_warning("could not get the file id of %u/%u "
+                            "(%d)\n", friendnumber, filenumber,
+                            err_file_get);
+    }
+
     purple_xfer_set_filename(xfer, filename);
     purple_xfer_set_size(xfer, filesize);
 
@@ -2077,6 +8167,182 @@ static PurpleXfer* toxprpl_new_xfer_receive(PurpleConnection *gc,
     return xfer;
 }
 
+/* send queues */
+
+/*
+ * Files handed to toxprpl_send_file() with a name, i.e. dropped on a
+ * conversation or picked with "Send folder...", are queued per buddy and
+ * only send_slots of them are offered at the same time. Directories are
+ * expanded to the regular files below them. Each finished transfer frees
+ * its slot for the next file, and the overall progress is written into
+ * the conversation and shown by /toxstats.
+ */
+static void toxprpl_send_queue_free(gpointer data)
+{
+    toxprpl_send_queue *queue = data;
+    if (queue->pump_timer != 0)
+    {
+        purple_timeout_remove(queue->pump_timer);
+    }
+    g_list_free_full(queue->files.head, g_free);
+    g_free(queue->who);
+    g_free(queue);
+}
+
+static void toxprpl_send_queue_add(toxprpl_send_queue *queue,
+                                   const char *path)
+{
+    GStatBuf sb;
+    if (g_lstat(path, &sb) != 0)
+    {
+        toxprpl_log_warning("can't send %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+#ifdef S_ISLNK
+    /* linked files are sent, linked directories could lead back up and
+     * recurse forever */
+    if (S_ISLNK(sb.st_mode))
+    {
+        if ((g_stat(path, &sb) != 0) || S_ISDIR(sb.st_mode))
+        {
+            toxprpl_log_misc("not sending link %s\n", path);
+            return;
+        }
+    }
+#endif
+
+    if (S_ISDIR(sb.st_mode))
+    {
+        GDir *dir = g_dir_open(path, 0, NULL);
+        if (dir == NULL)
+        {
+            return;
+        }
+        const char *name;
+        while ((name = g_dir_read_name(dir)) != NULL)
+        {
+            gchar *child = g_build_filename(path, name, NULL);
+            toxprpl_send_queue_add(queue, child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+    }
+    else if (S_ISREG(sb.st_mode))
+    {
+        g_queue_push_tail(&queue->files, g_strdup(path));
+        queue->files_total++;
+        queue->bytes_total += sb.st_size;
+    }
+}
+
+static void toxprpl_send_queue_report(toxprpl_send_queue *queue)
+{
+    PurpleAccount *account = purple_connection_get_account(queue->gc);
+    PurpleConversation *conv = purple_find_conversation_with_account(
+            PURPLE_CONV_TYPE_IM, queue->who, account);
+    if (conv == NULL)
+    {
+        return;
+    }
+
+    gchar *done = purple_str_size_to_units(queue->bytes_done);
+    gchar *total = purple_str_size_to_units(queue->bytes_total);
+    gchar *message = g_strdup_printf(_("Sent %u of %u files (%s of %s)."),
+                                     queue->files_done, queue->files_total,
+                                     done, total);
+    purple_conversation_write(conv, NULL, message,
+                              PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_NO_LOG,
+                              time(NULL));
+    g_free(message);
+    g_free(total);
+    g_free(done);
+}
+
+/* offers queued files until all slots are taken, drops the queue once
+ * everything is done */
+static void toxprpl_send_queue_pump(toxprpl_send_queue *queue)
+{
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(
+            queue->gc);
+
+    while ((queue->in_flight < plugin->send_slots) &&
+           !g_queue_is_empty(&queue->files))
+    {
+        gchar *path = g_queue_pop_head(&queue->files);
+        PurpleXfer *xfer = toxprpl_new_xfer(queue->gc, queue->who);
+        if (xfer == NULL)
+        {
+            g_free(path);
+            queue->files_done++;
+            continue;
+        }
+
+        toxprpl_xfer_data *xfer_data = xfer->data;
+        xfer_data->queued = TRUE;
+        queue->in_flight++;
+        /* a file that can't be read is cancelled right away, which calls
+         * toxprpl_send_queue_done() */
+        purple_xfer_request_accepted(xfer, path);
+        g_free(path);
+    }
+
+    if ((queue->in_flight == 0) && g_queue_is_empty(&queue->files))
+    {
+        if (queue->files_total > 1)
+        {
+            toxprpl_send_queue_report(queue);
+        }
+        g_hash_table_remove(plugin->send_queues, queue->who);
+    }
+}
+
+static gboolean toxprpl_send_queue_pump_cb(gpointer data)
+{
+    toxprpl_send_queue *queue = data;
+    queue->pump_timer = 0;
+    toxprpl_send_queue_pump(queue);
+    return FALSE;
+}
+
+/* called when a queued transfer ended, successfully or not */
+static void toxprpl_send_queue_done(PurpleXfer *xfer)
+{
+    PurpleConnection *gc = purple_account_get_connection(
+            purple_xfer_get_account(xfer));
+    toxprpl_plugin_data *plugin = (gc != NULL) ?
+        purple_connection_get_protocol_data(gc) : NULL;
+    if ((plugin == NULL) || (plugin->send_queues == NULL))
+    {
+        return;
+    }
+
+    toxprpl_send_queue *queue = g_hash_table_lookup(plugin->send_queues,
+            purple_xfer_get_remote_user(xfer));
+    toxprpl_return_if_fail(queue != NULL && queue->in_flight > 0);
+
+    queue->in_flight--;
+    queue->files_done++;
+    if (purple_xfer_is_completed(xfer))
+    {
+        queue->bytes_done += purple_xfer_get_size(xfer);
+    }
+
+    /* progress every tenth of a large batch */
+    if ((queue->files_total >= 10) && (queue->files_done < queue->files_total)
+        && (queue->files_done % (queue->files_total / 10) == 0))
+    {
+        toxprpl_send_queue_report(queue);
+    }
+
+    /* the transfer is still being torn down, start the next one later */
+    if (queue->pump_timer == 0)
+    {
+        queue->pump_timer = purple_timeout_add(0, toxprpl_send_queue_pump_cb,
+                                               queue);
+    }
+}
+
 static void toxprpl_send_file(PurpleConnection *gc, const char *who,
                               const char *filename)
 {
@@ -2085,26 +8351,177 @@ static void toxprpl_send_file(PurpleConnection *gc, const char *who,
     toxprpl_return_if_fail(gc != NULL);
     toxprpl_return_if_fail(who != NULL);
 
-    PurpleXfer *xfer = toxprpl_new_xfer(gc, who);
-    toxprpl_return_if_fail(xfer != NULL);
+    if (filename == NULL)
+    {
+        /* let the user pick the file */
+        PurpleXfer *xfer = toxprpl_new_xfer(gc, who);
+        toxprpl_return_if_fail(xfer != NULL);
+        purple_xfer_request(xfer);
+        return;
+    }
+
+    toxprpl_plugin_data *plugin = purple_connection_get_protocol_data(gc);
+    toxprpl_return_if_fail(plugin != NULL && plugin->send_queues != NULL);
 
-    if (filename != NULL)
+    toxprpl_send_queue *queue = g_hash_table_lookup(plugin->send_queues, who);
+    if (queue == NULL)
     {
-        purple_debug_info("toxprpl", "filename != NULL\n");
-        purple_xfer_request_accepted(xfer, filename);
+        queue = g_new0(toxprpl_send_queue, 1);
+        queue->gc = gc;
+        queue->who = g_strdup(who);
+        g_hash_table_insert(plugin->send_queues, queue->who, queue);
     }
-    else
+
+    toxprpl_send_queue_add(queue, filename);
+    toxprpl_log_info("%u files queued for %s\n",
+                     g_queue_get_length(&queue->files), who);
+    toxprpl_send_queue_pump(queue);
+}
+
+typedef struct
+{
+    PurpleConnection *gc;
+    gchar *who;
+} toxprpl_folder_request;
+
+static void toxprpl_send_folder_ok(toxprpl_folder_request *request,
+                                   const char *dirname)
+{
+    if (dirname != NULL)
     {
-        purple_debug_info("toxprpl", "filename == NULL\n");
-        purple_xfer_request(xfer);
+        toxprpl_send_file(request->gc, request->who, dirname);
+    }
+    g_free(request->who);
+    g_free(request);
+}
+
+static void toxprpl_send_folder_cancel(toxprpl_folder_request *request,
+                                       const char *dirname)
+{
+    g_free(request->who);
+    g_free(request);
+}
+
+static void toxprpl_send_folder_action(PurpleBlistNode *node, gpointer data)
+{
+    toxprpl_return_if_fail(PURPLE_BLIST_NODE_IS_BUDDY(node));
+    PurpleBuddy *buddy = (PurpleBuddy *)node;
+    PurpleAccount *account = purple_buddy_get_account(buddy);
+    PurpleConnection *gc = purple_account_get_connection(account);
+    toxprpl_return_if_fail(gc != NULL);
+
+    toxprpl_folder_request *request = g_new0(toxprpl_folder_request, 1);
+    request->gc = gc;
+    request->who = g_strdup(purple_buddy_get_name(buddy));
+
+    purple_request_folder(gc,
+        _("Send folder"),
+        NULL,
+        G_CALLBACK(toxprpl_send_folder_ok),
+        G_CALLBACK(toxprpl_send_folder_cancel),
+        account,
+        request->who,
+        NULL,
+        request);
+}
+
+#ifdef HAVE_TOXAV
+/* data is the session type to call with, or none to hang up */
+static void toxprpl_call_action(PurpleBlistNode *node, gpointer data)
+{
+    toxprpl_return_if_fail(PURPLE_BLIST_NODE_IS_BUDDY(node));
+    PurpleBuddy *buddy = (PurpleBuddy *)node;
+    PurpleConnection *gc = purple_account_get_connection(
+            purple_buddy_get_account(buddy));
+    toxprpl_return_if_fail(gc != NULL);
+
+    PurpleMediaSessionType type = GPOINTER_TO_INT(data);
+    if (type == PURPLE_MEDIA_NONE)
+    {
+        toxprpl_av_hangup(gc, purple_buddy_get_name(buddy));
+    }
+    else if (!toxprpl_av_call(gc, purple_buddy_get_name(buddy),
+                              (type & PURPLE_MEDIA_VIDEO) != 0))
+    {
+        purple_notify_error(gc, _("Call"), _("The call could not be started"),
+                            NULL);
+    }
+}
+#endif
+
+static GList *toxprpl_blist_node_menu(PurpleBlistNode *node)
+{
+    if (!PURPLE_BLIST_NODE_IS_BUDDY(node))
+    {
+        return NULL;
+    }
+
+    PurpleMenuAction *action = purple_menu_action_new(_("Send folder..."),
+            PURPLE_CALLBACK(toxprpl_send_folder_action), NULL, NULL);
+    GList *menu = g_list_append(NULL, action);
+
+#ifdef HAVE_TOXAV
+    PurpleBuddy *buddy = (PurpleBuddy *)node;
+    PurpleConnection *gc = purple_account_get_connection(
+            purple_buddy_get_account(buddy));
+    toxprpl_plugin_data *plugin = (gc != NULL) ?
+        purple_connection_get_protocol_data(gc) : NULL;
+    toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
+    if ((plugin == NULL) || (plugin->toxav == NULL) || (buddy_data == NULL))
+    {
+        return menu;
+    }
+
+    if (g_hash_table_lookup(plugin->calls,
+            GUINT_TO_POINTER(buddy_data->tox_friendlist_number)) != NULL)
+    {
+        action = purple_menu_action_new(_("Hang up"),
+                PURPLE_CALLBACK(toxprpl_call_action), NULL, NULL);
+        menu = g_list_append(menu, action);
+    }
+    else if (PURPLE_BUDDY_IS_ONLINE(buddy))
+    {
+        action = purple_menu_action_new(_("Audio call"),
+                PURPLE_CALLBACK(toxprpl_call_action),
+                GINT_TO_POINTER(PURPLE_MEDIA_AUDIO), NULL);
+        menu = g_list_append(menu, action);
+        action = purple_menu_action_new(_("Video call"),
+                PURPLE_CALLBACK(toxprpl_call_action),
+                GINT_TO_POINTER(PURPLE_MEDIA_AUDIO | PURPLE_MEDIA_VIDEO),
+                NULL);
+        menu = g_list_append(menu, action);
+    }
+#endif
+    return menu;
+}
+
+static void toxprpl_typing_apply(toxprpl_friend_data *fdata)
+{
+    TOX_ERR_SET_TYPING err_back_typing;
+    toxprpl_log_trace("Send typing state %d to friend #%u\n",
+                      fdata->typing_wanted, fdata->friendnumber);
+    tox_self_set_typing(fdata->tox, fdata->friendnumber, fdata->typing_wanted,
+                        &err_back_typing);
+    fdata->typing_sent = fdata->typing_wanted;
+}
+
+static gboolean toxprpl_typing_timeout(gpointer data)
+{
+    toxprpl_friend_data *fdata = data;
+    if (fdata->typing_wanted != fdata->typing_sent)
+    {
+        /* state settled on something new during the interval */
+        toxprpl_typing_apply(fdata);
+        return TRUE;
     }
+
+    fdata->typing_timer = 0;
+    return FALSE;
 }
 
 static unsigned int toxprpl_send_typing(PurpleConnection *gc, const char *who,
     PurpleTypingState state)
 {
-    purple_debug_info("toxprpl", "send_typing\n");
-
     toxprpl_return_val_if_fail(gc != NULL, 0);
     toxprpl_return_val_if_fail(who != NULL, 0);
 
@@ -2120,41 +8537,54 @@ static unsigned int toxprpl_send_typing(PurpleConnection *gc, const char *who,
     toxprpl_buddy_data *buddy_data = purple_buddy_get_protocol_data(buddy);
     toxprpl_return_val_if_fail(buddy_data != NULL, 0);
 
-    TOX_ERR_SET_TYPING err_back_typing;
-    switch(state)
+    TOX_ERR_FRIEND_QUERY err_back;
+    if (tox_friend_get_connection_status(plugin->tox,
+            buddy_data->tox_friendlist_number, &err_back)
+                == TOX_CONNECTION_NONE)
     {
-        case PURPLE_TYPING:
-            purple_debug_info("toxprpl", "Send typing state: TYPING\n");
-            tox_self_set_typing(plugin->tox, buddy_data->tox_friendlist_number, TRUE, &err_back_typing);
-            break;
-        case PURPLE_TYPED:
-            /* typing pause */
-            purple_debug_info("toxprpl", "Send typing state: TYPED\n"); 
-            tox_self_set_typing(plugin->tox, buddy_data->tox_friendlist_number, FALSE, &err_back_typing);
-            break;
-        default:
-            purple_debug_info("toxprpl", "Send typing state: NOT_TYPING\n");
-            tox_self_set_typing(plugin->tox, buddy_data->tox_friendlist_number, FALSE, &err_back_typing);
-            break;
+        return 0;
+    }
+
+    toxprpl_friend_data *fdata = toxprpl_get_friend_data(plugin,
+            buddy_data->tox_friendlist_number);
+
+    /* PURPLE_TYPED (typing pause) is reported as not typing */
+    fdata->typing_wanted = (state == PURPLE_TYPING);
+    if ((fdata->typing_timer != 0) ||
+        (fdata->typing_wanted == fdata->typing_sent))
+    {
+        /* no change, or a change inside the coalescing interval which the
+         * timer will pick up */
+        return 0;
     }
 
+    toxprpl_typing_apply(fdata);
+    fdata->typing_timer = purple_timeout_add(TYPING_COALESCE_INTERVAL,
+                                             toxprpl_typing_timeout, fdata);
     return 0;
 }
 
 static PurplePluginProtocolInfo prpl_info =
 {
-    OPT_PROTO_NO_PASSWORD | OPT_PROTO_REGISTER_NOSCREENNAME | OPT_PROTO_INVITE_MESSAGE,  /* options */
+    OPT_PROTO_NO_PASSWORD | OPT_PROTO_REGISTER_NOSCREENNAME |
+    OPT_PROTO_INVITE_MESSAGE | OPT_PROTO_CHAT_TOPIC,  /* options */
     NULL,                               /* user_splits, initialized in toxprpl_init() */
     NULL,                               /* protocol_options, initialized in toxprpl_init() */
-    NO_BUDDY_ICONS,                     /* icon spec */
+    {                                   /* icon spec */
+        "png,jpg,gif",                  /* format */
+        0, 0,                           /* min width, height */
+        256, 256,                       /* max width, height */
+        AVATAR_MAX_SIZE,                /* max file size */
+        PURPLE_ICON_SCALE_SEND          /* scale rules */
+    },
     toxprpl_list_icon,                  /* list_icon */
     NULL,                               /* list_emblem */
     NULL,                               /* status_text */
-    NULL,                               /* tooltip_text */
+    toxprpl_tooltip_text,               /* tooltip_text */
     toxprpl_status_types,               /* status_types */
-    NULL,                               /* blist_node_menu */
-    NULL,                               /* chat_info */
-    NULL,                               /* chat_info_defaults */
+    toxprpl_blist_node_menu,            /* blist_node_menu */
+    toxprpl_chat_info,                  /* chat_info */
+    toxprpl_chat_info_defaults,         /* chat_info_defaults */
     toxprpl_login,                      /* login */
     toxprpl_close,                      /* close */
     toxprpl_send_im,                    /* send_im */
@@ -2173,13 +8603,13 @@ static PurplePluginProtocolInfo prpl_info =
     NULL,                               /* rem_permit */
     NULL,                               /* rem_deny */
     NULL,                               /* set_permit_deny */
-    NULL,                               /* join_chat */
+    toxprpl_join_chat,                  /* join_chat */
     NULL,                               /* reject_chat */
-    NULL,                               /* get_chat_name */
-    NULL,                               /* chat_invite */
-    NULL,                               /* chat_leave */
+    toxprpl_get_chat_name,              /* get_chat_name */
+    toxprpl_chat_invite,                /* chat_invite */
+    toxprpl_chat_leave,                 /* chat_leave */
     NULL,                               /* chat_whisper */
-    NULL,                               /* chat_send */
+    toxprpl_chat_send,                  /* chat_send */
     NULL,                               /* keepalive */
     NULL,                               /* register_user */
     NULL,                               /* get_cb_info */
@@ -2190,10 +8620,10 @@ static PurplePluginProtocolInfo prpl_info =
     toxprpl_free_buddy,                 /* buddy_free */
     NULL,                               /* convo_closed */
     NULL,                               /* normalize */
-    NULL,                               /* set_buddy_icon */
+    toxprpl_set_buddy_icon,             /* set_buddy_icon */
     NULL,                               /* remove_group */
     NULL,                               /* get_cb_real_name */
-    NULL,                               /* set_chat_topic */
+    toxprpl_set_chat_topic,             /* set_chat_topic */
     NULL,                               /* find_blist_chat */
     NULL,                               /* roomlist_get_list */
     NULL,                               /* roomlist_cancel */
@@ -2203,15 +8633,20 @@ static PurplePluginProtocolInfo prpl_info =
     toxprpl_new_xfer,                   /* new_xfer */
     toxprpl_offline_message,            /* offline_message */
     NULL,                               /* whiteboard_prpl_ops */
-    NULL,                               /* send_raw */
+    toxprpl_send_raw,                   /* send_raw */
     NULL,                               /* roomlist_room_serialize */
     NULL,                               /* unregister_user */
     NULL,                               /* send_attention */
     NULL,                               /* get_attention_types */
     sizeof(PurplePluginProtocolInfo),   /* struct_size */
     NULL,                               /* get_account_text_table */
+#ifdef HAVE_TOXAV
+    toxprpl_initiate_media,             /* initiate_media */
+    toxprpl_get_media_caps,             /* get_media_caps */
+#else
     NULL,                               /* initiate_media */
     NULL,                               /* get_media_caps */
+#endif
     NULL,                               /* get_moods */
     NULL,                               /* set_public_alias */
     NULL,                               /* get_public_alias */
@@ -2223,6 +8658,46 @@ static void toxprpl_init(PurplePlugin *plugin)
 {
     purple_debug_info("toxprpl", "starting up\n");
 
+    toxprpl_plugin = plugin;
+
+    if (sodium_init() < 0)
+    {
+        toxprpl_log_warning("libsodium initialization failed\n");
+    }
+
+#ifdef HAVE_TOXAV
+    GError *error = NULL;
+    if (!gst_init_check(NULL, NULL, &error))
+    {
+        toxprpl_log_warning("GStreamer initialization failed: "
+                            "%s\n", error->message);
+        g_error_free(error);
+    }
+#endif
+
+    purple_signal_connect(purple_network_get_handle(),
+            "network-configuration-changed", plugin,
+            PURPLE_CALLBACK(toxprpl_network_changed), NULL);
+
+    /* void message-delivered(PurpleConnection *gc, const char *who,
+     *                        const char *message, guint latency_ms) */
+    purple_signal_register(plugin, "message-delivered",
+            purple_marshal_VOID__POINTER_POINTER_POINTER_UINT, NULL, 4,
+            purple_value_new(PURPLE_TYPE_SUBTYPE, PURPLE_SUBTYPE_CONNECTION),
+            purple_value_new(PURPLE_TYPE_STRING),
+            purple_value_new(PURPLE_TYPE_STRING),
+            purple_value_new(PURPLE_TYPE_UINT));
+
+    /* void raw-received(PurpleConnection *gc, const char *who,
+     *                   const guchar *data, guint length, guint id) */
+    purple_signal_register(plugin, "raw-received",
+            purple_marshal_VOID__POINTER_POINTER_POINTER_UINT_UINT, NULL, 5,
+            purple_value_new(PURPLE_TYPE_SUBTYPE, PURPLE_SUBTYPE_CONNECTION),
+            purple_value_new(PURPLE_TYPE_STRING),
+            purple_value_new(PURPLE_TYPE_POINTER),
+            purple_value_new(PURPLE_TYPE_UINT),
+            purple_value_new(PURPLE_TYPE_UINT));
+
     PurpleAccountOption *option = purple_account_option_string_new(
         _("Nickname"), "nickname", "");
     prpl_info.protocol_options = g_list_append(NULL, option);
@@ -2247,6 +8722,62 @@ static void toxprpl_init(PurplePlugin *plugin)
         "account_path", DEFAULT_ACCOUNT_PATH);
     prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
                                                option);
+
+    option = purple_account_option_int_new(
+        _("Time per tick for file transfers (ms)"), "iterate_budget",
+        DEFAULT_ITERATE_BUDGET);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_int_new(
+        _("Simultaneous file transfers per buddy"), "send_slots",
+        DEFAULT_SEND_SLOTS);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_int_new(
+        _("Compression level for transfers to tox-prpl users (0-9)"),
+        "compression_level", DEFAULT_COMPRESSION_LEVEL);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_bool_new(
+        _("Show messages that arrive together as one"), "coalesce_messages",
+        DEFAULT_COALESCE_MESSAGES);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    static const char *request_policies[][2] =
+    {
+        { "Ask", "ask" },
+        { "Accept all", "accept" },
+        { "Reject all", "reject" }
+    };
+    GList *policies = NULL;
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS(request_policies); i++)
+    {
+        PurpleKeyValuePair *kvp = g_new0(PurpleKeyValuePair, 1);
+        kvp->key = g_strdup(_(request_policies[i][0]));
+        kvp->value = g_strdup(request_policies[i][1]);
+        policies = g_list_append(policies, kvp);
+    }
+    option = purple_account_option_list_new(_("Friend requests"),
+                                            "request_policy", policies);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_string_new(
+        _("Accept requests with a message matching (wildcards * and ?)"),
+        "request_accept_pattern", "");
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
+
+    option = purple_account_option_string_new(
+        _("Reject requests with a message matching (wildcards * and ?)"),
+        "request_reject_pattern", "");
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options,
+                                               option);
 }
 
 static PurplePluginInfo info =